@@ -0,0 +1,21 @@
+(import (scheme base)
+        (scheme write))
+
+; keeps a list of n pairs alive; run under `/usr/bin/time -f %M` and
+; divide the growth of the max RSS by n to get the bytes per pair
+
+(define n 1000000)
+
+(define (iota n acc)
+  (if (= n 0)
+      acc
+      (iota (- n 1) (cons n acc))))
+
+(define lst (iota n '()))
+
+(write-simple (length lst))
+(newline)
+
+; max RSS at n = 0 and n = 1000000
+; 7aecf47 (32-byte header) -> 11048 KB, 98412 KB: 89 bytes/pair
+; 16-byte header           -> 11112 KB, 67884 KB: 58 bytes/pair
@@ -23,3 +23,7 @@
 
 ; 70fb34 -> 10.374959
 ; fb6679 ->  4.275342
+; 592f7c -> 1.372378
+; no env without closed variables -> 0.646660
+; superinstructions -> 0.505693
+; inline caches -> 0.431855
@@ -14,19 +14,42 @@
 /* enable readline module */
 #define PIC_ENABLE_READLINE 1
 
+/* mark the heap with several threads during major GC (needs pthreads) */
+#define PIC_ENABLE_PARALLEL_MARK 1
+
+/* compile hot ireps to native code (x86-64 Linux only) */
+/* #define PIC_ENABLE_JIT 1 */
+
+/* keep the compiled code of loaded files in a cache file next to each;
+   off by default as it writes beside the sources (failed writes are ignored) */
+/* #define PIC_ENABLE_LOAD_CACHE 1 */
+
 /* treat false value as none */
 #define PIC_NONE_IS_FALSE 1
 
 /* initial memory size (to be dynamically extended if necessary) */
 #define PIC_ARENA_SIZE 100
-#define PIC_HEAP_PAGE_SIZE (10000)
-#define PIC_STACK_SIZE 1024
+#define PIC_HEAP_PAGE_SIZE (10000) /* smallest page */
+#define PIC_HEAP_PAGE_MAX (1024 * 1024) /* largest page, a power of two */
+#define PIC_HEAP_GROWTH 50 /* percent of the current size added when a space grows */
+#define PIC_HEAP_OCCUPANCY 50 /* target live/heap ratio in percent */
+#define PIC_NURSERY_SIZE (256 * 1024) /* bytes allocated between minor GCs */
+#define PIC_HEAP_CLASS_MAX 8 /* largest slab slot, in header units */
+#define PIC_MARK_STACK_SIZE (1024 * 1024) /* max entries before rescanning the heap */
+#define PIC_GC_STEP_SIZE (32 * 1024) /* bytes allocated between incremental marking steps */
+#define PIC_STACK_SIZE 1024 /* initial size of the value and frame stacks */
+#define PIC_STACK_MAX (1024 * 1024) /* stack overflow is raised beyond this */
 #define PIC_RESCUE_SIZE 30
 #define PIC_GLOBALS_SIZE 1024
+#define PIC_JIT_THRESHOLD 1000 /* calls before an irep is compiled */
+#define PIC_INLINE_SIZE 32 /* nodes in the body of an inlined procedure */
+#define PIC_IR_PAGE_SIZE (16 * 1024) /* bytes in each page of compiler nodes */
+#define PIC_LOAD_CACHE_SUFFIX ".picc" /* appended to the file name for its cache */
 #define PIC_MACROS_SIZE 1024
 #define PIC_SYM_POOL_SIZE 128
 #define PIC_IREP_SIZE 8
 #define PIC_POOL_SIZE 8
+#define PIC_CALLCACHE_SIZE 8
 #define PIC_ISEQ_SIZE 1024
 
 /* enable all debug flags */
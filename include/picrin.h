@@ -42,6 +42,15 @@ extern "C" {
 #define FALLTHROUGH ((void)0)
 #define UNUSED(v) ((void)(v))
 
+/* BSD setjmp saves the signal mask with a syscall, which is never needed */
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+# define PIC_SETJMP(buf) _setjmp(buf)
+# define PIC_LONGJMP(buf, val) _longjmp((buf), (val))
+#else
+# define PIC_SETJMP(buf) setjmp(buf)
+# define PIC_LONGJMP(buf, val) longjmp((buf), (val))
+#endif
+
 #define GENSYM2__(x,y) x##y
 #define GENSYM1__(x,y) GENSYM2__(x,y)
 #if defined(__COUNTER__)
@@ -56,7 +65,7 @@ extern "C" {
 struct pic_code;
 
 typedef struct {
-  int argc;
+  int argc, retc;
   struct pic_code *pc;
   pic_value *fp;
   struct pic_env *env;
@@ -99,6 +108,7 @@ typedef struct {
 
   struct xhash *global_tbl;
   pic_value *globals;
+  const char **global_names;    /* keys of global_tbl, by index */
   size_t glen, gcapa;
 
   pic_value lib_tbl;
@@ -133,8 +143,32 @@ void pic_gc_run(pic_state *);
 void pic_gc_protect(pic_state *, pic_value);
 int pic_gc_arena_preserve(pic_state *);
 void pic_gc_arena_restore(pic_state *, int);
+void pic_gc_write_barrier(pic_state *, struct pic_object *); /* call after storing into obj */
+
+struct pic_gc_stats {
+  size_t collections;           /* completed collections, minor or major */
+  unsigned long total_pause;    /* in usec */
+  unsigned long max_pause;      /* in usec */
+  size_t allocated;             /* bytes allocated since pic_open */
+  size_t live;                  /* bytes surviving the last collection */
+  size_t pages;                 /* heap pages mapped */
+  size_t objects[PIC_TT_IREP + 1]; /* surviving objects by enum pic_tt */
+};
+
+enum pic_gc_event {
+  PIC_GC_START,
+  PIC_GC_END
+};
+
+/* called around every GC pause; must not allocate from the heap */
+typedef void (*pic_gc_hook_t)(pic_state *, enum pic_gc_event, void *);
+
+void pic_gc_set_pause_target(pic_state *, unsigned long); /* in usec; 0 disables incremental GC */
+void pic_gc_stats(pic_state *, struct pic_gc_stats *);
+void pic_gc_set_hook(pic_state *, pic_gc_hook_t, void *);
 
 pic_state *pic_open(int argc, char *argv[], char **envp);
+pic_state *pic_open_with_gc_threads(int argc, char *argv[], char **envp, int); /* number of marking threads */
 void pic_close(pic_state *);
 
 void pic_define(pic_state *, const char *, pic_value); /* symbol is automatically exported */
@@ -171,6 +205,9 @@ pic_value pic_load(pic_state *, const char *);
 
 pic_value pic_apply(pic_state *pic, struct pic_proc *, pic_value);
 pic_value pic_apply_argv(pic_state *pic, struct pic_proc *, size_t, ...);
+pic_value pic_apply_array(pic_state *pic, struct pic_proc *, size_t, pic_value *);
+pic_value pic_values(pic_state *, size_t, pic_value *);
+size_t pic_receive(pic_state *, size_t, pic_value *);
 struct pic_proc *pic_compile(pic_state *, pic_value);
 pic_value pic_macroexpand(pic_state *, pic_value);
 
@@ -30,7 +30,7 @@ struct pic_cont {
   struct pic_object *arena[PIC_ARENA_SIZE];
   int arena_idx;
 
-  pic_value result;
+  pic_value result;		/* vector of the values passed */
 };
 
 #define PIC_BLK_INCREF(pic,blk) do {		\
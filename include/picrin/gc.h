@@ -9,31 +9,96 @@
 extern "C" {
 #endif
 
-#define PIC_GC_UNMARK 0
-#define PIC_GC_MARK 1
+enum pic_gc_phase {
+  PIC_GC_PHASE_NONE,
+  PIC_GC_PHASE_MARK             /* incremental marking in progress */
+};
 
+/* mark bits live in per-page bitmaps, not in the header */
 union header {
   struct {
     union header *ptr;
-    size_t size;
-    unsigned int mark : 1;
+    unsigned int size;            /* in units */
+    unsigned int old : 1;         /* survived at least one collection */
+    unsigned int remembered : 1;  /* registered in the remembered set */
   } s;
-  long alignment[4];
+  long alignment[2];
 };
 
+struct gc_markers;
+
+/* sits at the start of its mapping, which is aligned to PIC_HEAP_PAGE_MAX */
 struct heap_page {
   union header *basep, *endp;
+  size_t size;                  /* mapped bytes */
   struct heap_page *next;
+  unsigned long *marks;         /* one bit per unit from basep */
+  void *mem;                    /* start of the allocation */
+};
+
+/* pages of fixed-size slots for small objects */
+struct heap_class {
+  size_t nunits;                /* slot size in units, header included */
+  union header *freep;          /* free slots, chained by s.ptr */
+  struct heap_page *pages;
+  struct heap_page **sweep;     /* link to the first page not swept since
+                                   the last major GC, or NULL */
+  size_t size;                  /* mapped bytes */
 };
 
 struct pic_heap {
+  /* objects larger than the biggest size class */
   union header base, *freep;
   struct heap_page *pages;
+  size_t large_size;            /* mapped bytes */
+  union header *lab, *lab_end;  /* bump allocation buffer */
+  struct heap_page *huge;       /* one object per page */
+
+  struct heap_class classes[PIC_HEAP_CLASS_MAX + 1];
+
+  /* young generation: objects allocated since the last collection */
+  union header *young;          /* chained by s.ptr */
+  size_t young_size;            /* in units */
+
+  /* remembered set: old objects that may point to young ones */
+  struct pic_object **remset;
+  size_t rslen, rscapa;
+
+  /* objects marked but whose children are not scanned yet */
+  struct pic_object **mstack;
+  size_t mslen, mscapa;
+  bool mark_overflow;           /* some marked objects were not pushed */
+  struct gc_markers *markers;   /* parallel marking threads, or NULL */
+
+  /* ephemerons reached in the current mark, resolved once it is done */
+  struct pic_ephemeron **ephemerons;
+  size_t ephlen, ephcapa;
+
+  /* ireps with inline caches reached in the current mark */
+  struct pic_irep **ccireps;
+  size_t cclen, cccapa;
+
+  size_t old_size, major_threshold; /* in units */
+  size_t marked_size;           /* in units, by the current major collection */
+  size_t alloc_trigger;         /* collect when young_size reaches this */
+  size_t heap_size, target_size; /* in bytes */
+  bool minor;                   /* true while a minor collection runs */
+
+  enum pic_gc_phase phase;
+  unsigned long pause_target;   /* in usec; 0 means stop-the-world */
+
+  struct pic_gc_stats stats;
+  pic_gc_hook_t hook;
+  void *hook_data;
+  struct pic_proc *hook_proc;   /* (picrin gc) hook, run outside pauses */
+  bool hook_pending;            /* a pause ended since hook_proc last ran */
 };
 
-void init_heap(struct pic_heap *);
+void init_heap(struct pic_heap *, int);
 void finalize_heap(struct pic_heap *);
 
+void pic_gc_run_hook(pic_state *);
+
 #if defined(__cplusplus)
 }
 #endif
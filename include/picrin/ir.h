@@ -0,0 +1,92 @@
+/**
+ * See Copyright Notice in picrin.h
+ */
+
+#ifndef PICRIN_IR_H__
+#define PICRIN_IR_H__
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+enum pic_node_type {
+  NODE_QUOTE,
+  NODE_REF,                     /* variable of the scope depth lambdas up */
+  NODE_SELF,                    /* the procedure being called */
+  /* after resolution */
+  NODE_GREF,
+  NODE_LREF,
+  NODE_CREF,
+  NODE_UNBOX,
+  NODE_SETBANG,
+  NODE_LAMBDA,
+  NODE_IF,
+  NODE_BEGIN,
+  NODE_CALL,
+  NODE_TAILCALL,
+  NODE_VALUES,                  /* around the tail call of values */
+  NODE_CALL_WITH_VALUES,        /* around the call of call-with-values */
+  /* native VM procedures */
+  NODE_CONS,
+  NODE_CAR,
+  NODE_CDR,
+  NODE_NILP,
+  NODE_ADD,
+  NODE_SUB,
+  NODE_MUL,
+  NODE_DIV,
+  NODE_MINUS,
+  NODE_EQ,
+  NODE_LT,
+  NODE_LE,
+  NODE_GT,
+  NODE_GE
+};
+
+struct pic_lambda {
+  pic_sym *args, *locals;       /* the rest argument is the first local */
+  int argc, localc;
+  bool varg;
+  pic_sym *closes;              /* variables referred to from inner lambdas */
+  int closec;
+  /* after resolution */
+  int *boxes;                   /* frame slots that hold a box */
+  int boxc;
+  int *captures;                /* free variables, as cv_tbl of the irep */
+  int capc;
+  struct pic_node *body;
+};
+
+struct pic_node {
+  enum pic_node_type type;
+  union {
+    pic_value value;            /* NODE_QUOTE */
+    struct {
+      int depth;
+      pic_sym sym;
+    } ref;                      /* NODE_REF */
+    int i;                      /* NODE_GREF, NODE_LREF and NODE_CREF */
+    struct pic_lambda *lambda;  /* NODE_LAMBDA */
+  } u;
+  int len;
+  struct pic_node *elts[];      /* operands; the operator comes first in calls */
+};
+
+/* the nodes of a compilation, freed all at once */
+struct pic_ir {
+  pic_state *pic;
+  struct pic_ir_page *page;
+};
+
+struct pic_ir *pic_ir_new(pic_state *);
+void *pic_ir_alloc(struct pic_ir *, size_t);
+void pic_ir_free(struct pic_ir *);
+
+struct pic_node *pic_analyze(pic_state *, struct pic_ir *, pic_value);
+struct pic_irep *pic_codegen(pic_state *, struct pic_node *);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
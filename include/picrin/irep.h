@@ -21,13 +21,20 @@ enum pic_opcode {
   OP_GSET,
   OP_LREF,
   OP_LSET,
-  OP_CREF,
-  OP_CSET,
+  OP_CREF,                      /* free variable of the closure */
+  OP_BOX,                       /* puts a frame slot into a box */
+  OP_UNBOX,
+  OP_SETBOX,
   OP_JMP,
   OP_JMPIF,
   OP_CALL,
   OP_TAILCALL,
+  OP_GCALL,                     /* CALL through an inline cache */
+  OP_GTAILCALL,                 /* TAILCALL through an inline cache */
+  OP_CALLV,                     /* CALL of the values returned by the last call */
+  OP_TAILCALLV,                 /* TAILCALL of the values returned by the last call */
   OP_RET,
+  OP_VALUES,                    /* RET of several values */
   OP_LAMBDA,
   OP_CONS,
   OP_CAR,
@@ -41,6 +48,13 @@ enum pic_opcode {
   OP_EQ,
   OP_LT,
   OP_LE,
+  /* superinstructions; operands of the fused tail stay in the following slots */
+  OP_LREF2,                     /* LREF LREF */
+  OP_LREFADDI,                  /* LREF PUSHINT ADD */
+  OP_LREFSUBI,                  /* LREF PUSHINT SUB */
+  OP_EQJMPIF,                   /* EQ JMPIF */
+  OP_LTJMPIF,                   /* LT JMPIF */
+  OP_LEJMPIF,                   /* LE JMPIF */
   OP_STOP
 };
 
@@ -49,29 +63,51 @@ struct pic_code {
   union {
     int i;
     char c;
-    struct {
-      short depth;
-      short idx;
-    } r;
   } u;
 };
 
+/*
+ * Inline cache of a call site whose operator is a global variable. The
+ * caches of an irep follow its code, and the operand of OP_GCALL is the
+ * distance from the instruction to its cache in code slots, like that
+ * of a jump.
+ */
+struct pic_callcache {
+  struct pic_proc *proc;        /* last callee, checked for arity; weak */
+  struct pic_irep *irep;        /* owner, for the write barrier */
+  int argc;
+};
+
+#define PIC_CALLCACHE_SLOTS ((sizeof(struct pic_callcache) + sizeof(struct pic_code) - 1) / sizeof(struct pic_code))
+
 struct pic_irep {
   PIC_OBJECT_HEADER
   struct pic_code *code;
   int argc, localc;
-  unsigned *cv_tbl, cv_num;
+  /* where OP_LAMBDA finds each free variable: a frame slot of the parent,
+     or ~i for free variable i of the parent */
+  int *cv_tbl;
+  unsigned cv_num;
   bool varg;
+#if PIC_ENABLE_JIT
+  unsigned ncall;               /* counted until the irep is compiled */
+  struct pic_jit *jit;          /* native code, or NULL */
+#endif
   struct pic_irep **irep;
   pic_value *pool;
-  size_t clen, ilen, plen;
+  size_t clen, ilen, plen, cclen;
 };
 
-pic_value pic_analyze(pic_state *, pic_value);
-struct pic_irep *pic_codegen(pic_state *pic, pic_value obj);
+/* the i-th inline cache, stored after the code */
+#define pic_irep_callcache(irep, i) \
+  ((struct pic_callcache *)((irep)->code + (irep)->clen + (i) * PIC_CALLCACHE_SLOTS))
 
 void pic_dump_irep(pic_state *, struct pic_irep *);
 
+/* pic_compile of a program already macroexpanded */
+struct pic_proc *pic_compile_expanded(pic_state *, pic_value);
+int pic_global_index(pic_state *, const char *);
+
 #if defined(__cplusplus)
 }
 #endif
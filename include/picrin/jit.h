@@ -0,0 +1,48 @@
+/**
+ * See Copyright Notice in picrin.h
+ */
+
+#ifndef PICRIN_JIT_H__
+#define PICRIN_JIT_H__
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#if PIC_ENABLE_JIT
+
+#if ! (defined(__x86_64__) && defined(__linux__))
+# error the JIT supports x86-64 Linux only
+#endif
+#if PIC_NAN_BOXING
+# error the JIT supports unboxed values only
+#endif
+
+/* runs native code from target and returns the next instruction to interpret */
+typedef struct pic_code *(*pic_jit_entry_t)(pic_state *, void *target);
+
+struct pic_jit {
+  void *mem;                    /* entry and exit stubs, then the code */
+  size_t size;                  /* mapped bytes */
+  void **addr;                  /* native code of each instruction, or NULL
+                                   if it is always left to the interpreter */
+};
+
+void pic_jit_compile(pic_state *, struct pic_irep *);
+void pic_jit_free(pic_state *, struct pic_irep *);
+
+static inline struct pic_code *
+pic_jit_run(pic_state *pic, struct pic_irep *irep, struct pic_code *pc)
+{
+  void *target = irep->jit->addr[pc - irep->code];
+
+  return target ? ((pic_jit_entry_t)irep->jit->mem)(pic, target) : pc;
+}
+
+#endif
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -9,11 +9,11 @@
 extern "C" {
 #endif
 
+/* free variables of a closure, copied when it is created */
 struct pic_env {
   PIC_OBJECT_HEADER
-  pic_value *values;
   int valuec;
-  struct pic_env *up;
+  pic_value values[];
 };
 
 struct pic_proc {
@@ -36,6 +36,7 @@ struct pic_proc {
 
 struct pic_proc *pic_proc_new(pic_state *, pic_func_t);
 struct pic_proc *pic_proc_new_irep(pic_state *, struct pic_irep *, struct pic_env *);
+struct pic_env *pic_env_new(pic_state *, size_t);
 
 /* closed variables accessor */
 void pic_proc_cv_init(pic_state *, struct pic_proc *, size_t);
@@ -43,6 +44,14 @@ int pic_proc_cv_size(pic_state *, struct pic_proc *);
 pic_value pic_proc_cv_ref(pic_state *, struct pic_proc *, size_t);
 void pic_proc_cv_set(pic_state *, struct pic_proc *, size_t, pic_value);
 
+/*
+ * Like pic_apply, but leave errors to the enclosing rescue frame: an
+ * error longjmps straight past the caller's C frame. The caller must
+ * hold nothing that needs freeing or restoring across the call.
+ */
+pic_value pic_apply_nocatch(pic_state *, struct pic_proc *, pic_value);
+pic_value pic_apply_array_nocatch(pic_state *, struct pic_proc *, size_t, pic_value *);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -103,6 +103,8 @@ enum pic_tt {
   PIC_TT_SC,
   PIC_TT_LIB,
   PIC_TT_VAR,
+  PIC_TT_EPHEMERON,
+  PIC_TT_WTABLE,
   PIC_TT_IREP
 };
 
@@ -250,6 +252,10 @@ pic_type_repr(enum pic_tt tt)
     return "lib";
   case PIC_TT_VAR:
     return "var";
+  case PIC_TT_EPHEMERON:
+    return "ephemeron";
+  case PIC_TT_WTABLE:
+    return "weak-table";
   case PIC_TT_IREP:
     return "irep";
   }
@@ -0,0 +1,50 @@
+/**
+ * See Copyright Notice in picrin.h
+ */
+
+#ifndef PICRIN_WEAK_H__
+#define PICRIN_WEAK_H__
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* value is kept alive only as long as key is; a weak reference is an
+   ephemeron that carries no value */
+struct pic_ephemeron {
+  PIC_OBJECT_HEADER
+  pic_value key;
+  pic_value value;
+  bool broken;                  /* key was collected; both fields cleared */
+};
+
+/* hash table with weak keys and ephemeron entries */
+struct pic_wtable {
+  PIC_OBJECT_HEADER
+  struct pic_ephemeron **slots; /* open addressing; broken entries are
+                                   dropped when the table is rehashed */
+  size_t capa, count;           /* count includes broken entries */
+};
+
+#define pic_ephemeron_p(v) (pic_type(v) == PIC_TT_EPHEMERON)
+#define pic_ephemeron_ptr(v) ((struct pic_ephemeron *)pic_ptr(v))
+
+#define pic_wtable_p(v) (pic_type(v) == PIC_TT_WTABLE)
+#define pic_wtable_ptr(v) ((struct pic_wtable *)pic_ptr(v))
+
+struct pic_ephemeron *pic_ephemeron_new(pic_state *, pic_value, pic_value);
+struct pic_ephemeron *pic_weak_new(pic_state *, pic_value);
+void pic_ephemeron_set(pic_state *, struct pic_ephemeron *, pic_value);
+
+struct pic_wtable *pic_wtable_new(pic_state *);
+bool pic_wtable_has(pic_state *, struct pic_wtable *, pic_value);
+pic_value pic_wtable_ref(pic_state *, struct pic_wtable *, pic_value);
+void pic_wtable_set(pic_state *, struct pic_wtable *, pic_value, pic_value);
+void pic_wtable_del(pic_state *, struct pic_wtable *, pic_value);
+size_t pic_wtable_size(pic_state *, struct pic_wtable *);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -242,20 +242,7 @@
           (picrin core-syntax)
           (picrin bootstrap-tools))
 
-  (define *values-tag* (cons #f '()))
-
-  (define (values . args)
-    (if (and (pair? args)
-             (null? (cdr args)))
-        (car args)
-        (cons *values-tag* args)))
-
-  (define (call-with-values producer consumer)
-    (let ((res (producer)))
-      (if (and (pair? res)
-               (eq? *values-tag* (car res)))
-          (apply consumer (cdr res))
-          (consumer res))))
+  ;; values and call-with-values are native, see src/proc.c and src/vm.c
 
   (define-syntax let*-values
     (er-macro-transformer
@@ -318,11 +305,13 @@
                                  `(,(r var) (,var)))
                             vars))
               ,@bindings
-              (,(r 'let) ((,(r 'result) (begin ,@body)))
+              (,(r 'call-with-values)
+               (,(r 'lambda) () ,@body)
+               (,(r 'lambda) ,(r 'results)
                 ,@(map (lambda (var)
                          `(,(r 'parameter-set!) ,var ,(r var)))
                        vars)
-                ,(r 'result))))))))
+                (,(r 'apply) ,(r 'values) ,(r 'results))))))))))
 
   (export parameterize))
 
@@ -3,11 +3,15 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "picrin.h"
 #include "picrin/pair.h"
 #include "picrin/irep.h"
+#include "picrin/ir.h"
 #include "picrin/proc.h"
 #include "picrin/lib.h"
 #include "picrin/macro.h"
@@ -19,6 +23,176 @@
 # error enable PIC_NONE_IS_FALSE
 #endif
 
+/**
+ * intermediate representation
+ */
+
+union pic_ir_align {
+  void *p;
+  double d;
+  long l;
+};
+
+struct pic_ir_page {
+  struct pic_ir_page *next;
+  size_t size, used;            /* in units of union pic_ir_align */
+  union pic_ir_align data[];
+};
+
+struct pic_ir *
+pic_ir_new(pic_state *pic)
+{
+  struct pic_ir *ir;
+
+  ir = (struct pic_ir *)pic_alloc(pic, sizeof(struct pic_ir));
+  ir->pic = pic;
+  ir->page = NULL;
+  return ir;
+}
+
+void *
+pic_ir_alloc(struct pic_ir *ir, size_t size)
+{
+  struct pic_ir_page *page = ir->page;
+  size_t n, units;
+  void *ptr;
+
+  n = (size + sizeof(union pic_ir_align) - 1) / sizeof(union pic_ir_align);
+  if (page == NULL || page->used + n > page->size) {
+    units = PIC_IR_PAGE_SIZE / sizeof(union pic_ir_align);
+    if (units < n) {
+      units = n;
+    }
+    page = (struct pic_ir_page *)pic_alloc(ir->pic, sizeof(struct pic_ir_page) + sizeof(union pic_ir_align) * units);
+    page->next = ir->page;
+    page->size = units;
+    page->used = 0;
+    ir->page = page;
+  }
+  ptr = page->data + page->used;
+  page->used += n;
+  return ptr;
+}
+
+void
+pic_ir_free(struct pic_ir *ir)
+{
+  struct pic_ir_page *page, *next;
+
+  for (page = ir->page; page != NULL; page = next) {
+    next = page->next;
+    pic_free(ir->pic, page);
+  }
+  pic_free(ir->pic, ir);
+}
+
+static struct pic_node *
+alloc_node(struct pic_ir *ir, enum pic_node_type type, int len)
+{
+  struct pic_node *node;
+
+  node = (struct pic_node *)pic_ir_alloc(ir, sizeof(struct pic_node) + sizeof(struct pic_node *) * len);
+  node->type = type;
+  node->len = len;
+  return node;
+}
+
+static struct pic_node *
+new_node(struct pic_ir *ir, enum pic_node_type type, int len, ...)
+{
+  struct pic_node *node;
+  va_list ap;
+  int i;
+
+  node = alloc_node(ir, type, len);
+
+  va_start(ap, len);
+  for (i = 0; i < len; ++i) {
+    node->elts[i] = va_arg(ap, struct pic_node *);
+  }
+  va_end(ap);
+
+  return node;
+}
+
+/* the same node, for its operands to be replaced */
+static struct pic_node *
+copy_shallow(struct pic_ir *ir, struct pic_node *node)
+{
+  struct pic_node *copy;
+
+  copy = alloc_node(ir, node->type, node->len);
+  copy->u = node->u;
+  memcpy(copy->elts, node->elts, sizeof(struct pic_node *) * node->len);
+  return copy;
+}
+
+static struct pic_node *
+new_quote(struct pic_ir *ir, pic_value value)
+{
+  struct pic_node *node;
+
+  node = alloc_node(ir, NODE_QUOTE, 0);
+  node->u.value = value;
+  return node;
+}
+
+static struct pic_node *
+new_ref(struct pic_ir *ir, int depth, pic_sym sym)
+{
+  struct pic_node *node;
+
+  node = alloc_node(ir, NODE_REF, 0);
+  node->u.ref.depth = depth;
+  node->u.ref.sym = sym;
+  return node;
+}
+
+/* gref, lref or cref */
+static struct pic_node *
+new_index(struct pic_ir *ir, enum pic_node_type type, int i)
+{
+  struct pic_node *node;
+
+  node = alloc_node(ir, type, 0);
+  node->u.i = i;
+  return node;
+}
+
+static struct pic_node *
+new_lambda(struct pic_ir *ir, struct pic_lambda *lambda)
+{
+  struct pic_node *node;
+
+  node = alloc_node(ir, NODE_LAMBDA, 0);
+  node->u.lambda = lambda;
+  return node;
+}
+
+static struct pic_lambda *
+alloc_lambda(struct pic_ir *ir)
+{
+  struct pic_lambda *lambda;
+
+  lambda = (struct pic_lambda *)pic_ir_alloc(ir, sizeof(struct pic_lambda));
+  memset(lambda, 0, sizeof(struct pic_lambda));
+  return lambda;
+}
+
+static pic_sym *
+copy_syms(struct pic_ir *ir, const pic_sym *syms, int n)
+{
+  pic_sym *copy;
+
+  copy = (pic_sym *)pic_ir_alloc(ir, sizeof(pic_sym) * n);
+  memcpy(copy, syms, sizeof(pic_sym) * n);
+  return copy;
+}
+
+/**
+ * analyzer
+ */
+
 static pic_sym *
 analyze_args(pic_state *pic, pic_value args, bool *varg, int *argc, int *localc)
 {
@@ -88,20 +262,17 @@ typedef struct analyze_scope {
 
 typedef struct analyze_state {
   pic_state *pic;
+  struct pic_ir *ir;
   analyze_scope *scope;
   pic_sym rCONS, rCAR, rCDR, rNILP;
   pic_sym rADD, rSUB, rMUL, rDIV;
   pic_sym rEQ, rLT, rLE, rGT, rGE;
-  pic_sym sCALL, sTAILCALL, sREF;
+  pic_sym rVALUES, rCALL_WITH_VALUES;
 } analyze_state;
 
 static void push_scope(analyze_state *, pic_value);
 static void pop_scope(analyze_state *);
 
-#define register_symbol(pic, state, slot, name) do {    \
-    state->slot = pic_intern_cstr(pic, name);           \
-  } while (0)
-
 #define register_renamed_symbol(pic, state, slot, lib, name) do {       \
     struct xh_entry *e;                                                 \
     if (! (e = xh_get(lib->senv->tbl, name)))                           \
@@ -110,15 +281,14 @@ static void pop_scope(analyze_state *);
   } while (0)
 
 static analyze_state *
-new_analyze_state(pic_state *pic)
+new_analyze_state(pic_state *pic, struct pic_ir *ir)
 {
   analyze_state *state;
-  struct xhash *global_tbl;
-  struct xh_iter it;
   struct pic_lib *stdlib;
 
   state = (analyze_state *)pic_alloc(pic, sizeof(analyze_state));
   state->pic = pic;
+  state->ir = ir;
   state->scope = NULL;
 
   stdlib = pic_find_library(pic, pic_parse(pic, "(scheme base)"));
@@ -137,19 +307,12 @@ new_analyze_state(pic_state *pic)
   register_renamed_symbol(pic, state, rLE, stdlib, "<=");
   register_renamed_symbol(pic, state, rGT, stdlib, ">");
   register_renamed_symbol(pic, state, rGE, stdlib, ">=");
-
-  register_symbol(pic, state, sCALL, "call");
-  register_symbol(pic, state, sTAILCALL, "tail-call");
-  register_symbol(pic, state, sREF, "ref");
+  register_renamed_symbol(pic, state, rVALUES, stdlib, "values");
+  register_renamed_symbol(pic, state, rCALL_WITH_VALUES, stdlib, "call-with-values");
 
   /* push initial scope */
   push_scope(state, pic_nil_value());
 
-  global_tbl = pic->global_tbl;
-  for (xh_begin(global_tbl, &it); ! xh_isend(&it); xh_next(&it)) {
-    xh_put(state->scope->var_tbl, it.e->key, 0);
-  }
-
   return state;
 }
 
@@ -220,6 +383,10 @@ lookup_var(analyze_state *state, pic_sym sym)
     ++depth;
     goto enter;
   }
+  /* the initial scope also holds all the global variables */
+  if (xh_get(state->pic->global_tbl, key)) {
+    return depth;
+  }
   return -1;
 }
 
@@ -230,40 +397,49 @@ define_var(analyze_state *state, pic_sym sym)
   analyze_scope *scope = state->scope;
   const char *name = pic_symbol_name(pic, sym);
 
-  xh_put(state->scope->var_tbl, name, 0);
+  if (! xh_get(scope->var_tbl, name)) {
+    xh_put(scope->var_tbl, name, 0);
+  }
 
   scope->localc++;
   scope->vars = (pic_sym *)pic_realloc(pic, scope->vars, sizeof(pic_sym) * (scope->argc + scope->localc));
   scope->vars[scope->argc + scope->localc - 1] = sym;
 }
 
-static pic_value
-new_ref(analyze_state *state, int depth, pic_sym sym)
-{
-  return pic_list(state->pic, 3,
-                  pic_symbol_value(state->sREF),
-                  pic_int_value(depth),
-                  pic_symbol_value(sym));
-}
-
-static pic_value analyze_node(analyze_state *, pic_value, bool);
-static pic_value analyze_call(analyze_state *, pic_value, bool);
-static pic_value analyze_lambda(analyze_state *, pic_value);
+static struct pic_node *analyze_node(analyze_state *, pic_value, bool);
+static struct pic_node *analyze_call(analyze_state *, pic_value, bool);
+static struct pic_node *analyze_lambda(analyze_state *, pic_value);
 
-static pic_value
+/* nodes live in the IR, so only the temporaries of the analysis are dropped */
+static struct pic_node *
 analyze(analyze_state *state, pic_value obj, bool tailpos)
 {
   int ai = pic_gc_arena_preserve(state->pic);
-  pic_value res;
+  struct pic_node *node;
 
-  res = analyze_node(state, obj, tailpos);
+  node = analyze_node(state, obj, tailpos);
 
   pic_gc_arena_restore(state->pic, ai);
-  pic_gc_protect(state->pic, res);
-  return res;
+  return node;
+}
+
+/* a native VM procedure applied to the operands of obj */
+static struct pic_node *
+analyze_op(analyze_state *state, enum pic_node_type type, pic_value obj)
+{
+  pic_state *pic = state->pic;
+  struct pic_node *node;
+  pic_value arg;
+  int i = 0;
+
+  node = alloc_node(state->ir, type, pic_length(pic, obj) - 1);
+  pic_for_each (arg, pic_cdr(pic, obj)) {
+    node->elts[i++] = analyze(state, arg, false);
+  }
+  return node;
 }
 
-static pic_value
+static struct pic_node *
 analyze_node(analyze_state *state, pic_value obj, bool tailpos)
 {
   pic_state *pic = state->pic;
@@ -278,9 +454,10 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
       pic_error(pic, "symbol: unbound variable");
     }
     /* at this stage, lref/cref/gref are not distinguished */
-    return new_ref(state, depth, sym);
+    return new_ref(state->ir, depth, sym);
   }
   case PIC_TT_PAIR: {
+    struct pic_node *node;
     pic_value proc;
 
     if (! pic_list_p(pic, obj)) {
@@ -316,16 +493,15 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
 	}
 
         define_var(state, pic_sym(var));
-        return pic_list(pic, 3,
-                        pic_symbol_value(pic->sSETBANG),
-                        analyze(state, var, false),
-                        analyze(state, val, false));
+        node = analyze(state, var, false);
+        return new_node(state->ir, NODE_SETBANG, 2, node, analyze(state, val, false));
       }
       else if (sym == pic->sLAMBDA) {
         return analyze_lambda(state, obj);
       }
       else if (sym == pic->sIF) {
 	pic_value if_true, if_false;
+        struct pic_node *test;
 
 	if_false = pic_none_value();
 	switch (pic_length(pic, obj)) {
@@ -339,15 +515,13 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
 	  if_true = pic_list_ref(pic, obj, 2);
 	}
 
-        return pic_list(pic, 4,
-                        pic_symbol_value(pic->sIF),
-                        analyze(state, pic_list_ref(pic, obj, 1), false),
-                        analyze(state, if_true, tailpos),
-                        analyze(state, if_false, tailpos));
+        test = analyze(state, pic_list_ref(pic, obj, 1), false);
+        node = analyze(state, if_true, tailpos);
+        return new_node(state->ir, NODE_IF, 3, test, node, analyze(state, if_false, tailpos));
       }
       else if (sym == pic->sBEGIN) {
-	pic_value seq;
         bool tail;
+        int i;
 
         switch (pic_length(pic, obj)) {
         case 1:
@@ -355,16 +529,17 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
         case 2:
           return analyze(state, pic_list_ref(pic, obj, 1), tailpos);
         default:
-          seq = pic_list(pic, 1, pic_symbol_value(pic->sBEGIN));
+          node = alloc_node(state->ir, NODE_BEGIN, pic_length(pic, obj) - 1);
+          i = 0;
           for (obj = pic_cdr(pic, obj); ! pic_nil_p(obj); obj = pic_cdr(pic, obj)) {
             if (pic_nil_p(pic_cdr(pic, obj))) {
               tail = tailpos;
             } else {
               tail = false;
             }
-            seq = pic_cons(pic, analyze(state, pic_car(pic, obj), tail), seq);
+            node->elts[i++] = analyze(state, pic_car(pic, obj), tail);
           }
-          return pic_reverse(pic, seq);
+          return node;
         }
       }
       else if (sym == pic->sSETBANG) {
@@ -381,16 +556,14 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
 
         val = pic_list_ref(pic, obj, 2);
 
-        return pic_list(pic, 3,
-                        pic_symbol_value(pic->sSETBANG),
-                        analyze(state, var, false),
-                        analyze(state, val, false));
+        node = analyze(state, var, false);
+        return new_node(state->ir, NODE_SETBANG, 2, node, analyze(state, val, false));
       }
       else if (sym == pic->sQUOTE) {
 	if (pic_length(pic, obj) != 2) {
 	  pic_error(pic, "syntax error");
 	}
-        return obj;
+        return new_quote(state->ir, pic_list_ref(pic, obj, 1));
       }
 
 #define ARGC_ASSERT(n) do {				\
@@ -399,32 +572,21 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
 	}						\
       } while (0)
 
-#define CONSTRUCT_OP1(op)                                               \
-      pic_list(pic, 2,                                                  \
-               pic_symbol_value(op),                                    \
-               analyze(state, pic_list_ref(pic, obj, 1), false))
-
-#define CONSTRUCT_OP2(op)                                               \
-      pic_list(pic, 3,                                                  \
-               pic_symbol_value(op),                                    \
-               analyze(state, pic_list_ref(pic, obj, 1), false),        \
-               analyze(state, pic_list_ref(pic, obj, 2), false))
-
       else if (sym == state->rCONS) {
 	ARGC_ASSERT(2);
-        return CONSTRUCT_OP2(pic->sCONS);
+        return analyze_op(state, NODE_CONS, obj);
       }
       else if (sym == state->rCAR) {
 	ARGC_ASSERT(1);
-        return CONSTRUCT_OP1(pic->sCAR);
+        return analyze_op(state, NODE_CAR, obj);
       }
       else if (sym == state->rCDR) {
 	ARGC_ASSERT(1);
-        return CONSTRUCT_OP1(pic->sCDR);
+        return analyze_op(state, NODE_CDR, obj);
       }
       else if (sym == state->rNILP) {
 	ARGC_ASSERT(1);
-        return CONSTRUCT_OP1(pic->sNILP);
+        return analyze_op(state, NODE_NILP, obj);
       }
 
 #define ARGC_ASSERT_GE(n) do {				\
@@ -433,11 +595,11 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
 	}						\
       } while (0)
 
-#define FOLD_ARGS(sym) do {                                             \
-        obj = analyze(state, pic_car(pic, args), false);                \
+#define FOLD_ARGS(type) do {                                            \
+        node = analyze(state, pic_car(pic, args), false);               \
         pic_for_each (arg, pic_cdr(pic, args)) {                        \
-          obj = pic_list(pic, 3, pic_symbol_value(sym), obj,            \
-                         analyze(state, arg, false));                   \
+          node = new_node(state->ir, type, 2, node,                     \
+                          analyze(state, arg, false));                  \
         }                                                               \
       } while (0)
 
@@ -447,13 +609,13 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
 	ARGC_ASSERT_GE(0);
 	switch (pic_length(pic, obj)) {
 	case 1:
-          return pic_int_value(0);
+          return analyze(state, pic_int_value(0), tailpos);
 	case 2:
 	  return analyze(state, pic_car(pic, pic_cdr(pic, obj)), tailpos);
 	default:
 	  args = pic_cdr(pic, obj);
-          FOLD_ARGS(pic->sADD);
-          return obj;
+          FOLD_ARGS(NODE_ADD);
+          return node;
 	}
       }
       else if (sym == state->rSUB) {
@@ -462,12 +624,11 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
 	ARGC_ASSERT_GE(1);
 	switch (pic_length(pic, obj)) {
 	case 2:
-          return pic_list(pic, 2, pic_symbol_value(pic->sMINUS),
-                          analyze(state, pic_car(pic, pic_cdr(pic, obj)), false));
+          return analyze_op(state, NODE_MINUS, obj);
 	default:
 	  args = pic_cdr(pic, obj);
-          FOLD_ARGS(pic->sSUB);
-          return obj;
+          FOLD_ARGS(NODE_SUB);
+          return node;
 	}
       }
       else if (sym == state->rMUL) {
@@ -476,13 +637,13 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
 	ARGC_ASSERT_GE(0);
 	switch (pic_length(pic, obj)) {
 	case 1:
-          return pic_int_value(1);
+          return analyze(state, pic_int_value(1), tailpos);
 	case 2:
 	  return analyze(state, pic_car(pic, pic_cdr(pic, obj)), tailpos);
 	default:
 	  args = pic_cdr(pic, obj);
-          FOLD_ARGS(pic->sMUL);
-          return obj;
+          FOLD_ARGS(NODE_MUL);
+          return node;
 	}
       }
       else if (sym == state->rDIV) {
@@ -496,30 +657,38 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
           return analyze(state, obj, tailpos);
 	default:
 	  args = pic_cdr(pic, obj);
-          FOLD_ARGS(pic->sDIV);
-          return obj;
+          FOLD_ARGS(NODE_DIV);
+          return node;
 	}
 	break;
       }
       else if (sym == state->rEQ) {
 	ARGC_ASSERT(2);
-        return CONSTRUCT_OP2(pic->sEQ);
+        return analyze_op(state, NODE_EQ, obj);
       }
       else if (sym == state->rLT) {
 	ARGC_ASSERT(2);
-        return CONSTRUCT_OP2(pic->sLT);
+        return analyze_op(state, NODE_LT, obj);
       }
       else if (sym == state->rLE) {
 	ARGC_ASSERT(2);
-        return CONSTRUCT_OP2(pic->sLE);
+        return analyze_op(state, NODE_LE, obj);
       }
       else if (sym == state->rGT) {
 	ARGC_ASSERT(2);
-        return CONSTRUCT_OP2(pic->sGT);
+        return analyze_op(state, NODE_GT, obj);
       }
       else if (sym == state->rGE) {
 	ARGC_ASSERT(2);
-        return CONSTRUCT_OP2(pic->sGE);
+        return analyze_op(state, NODE_GE, obj);
+      }
+      /* the plain call is kept inside, for VMs that go through the procedures */
+      else if (sym == state->rVALUES && tailpos) {
+        return new_node(state->ir, NODE_VALUES, 1, analyze_call(state, obj, tailpos));
+      }
+      else if (sym == state->rCALL_WITH_VALUES) {
+	ARGC_ASSERT(2);
+        return new_node(state->ir, NODE_CALL_WITH_VALUES, 1, analyze_call(state, obj, tailpos));
       }
     }
     return analyze_call(state, obj, tailpos);
@@ -532,7 +701,7 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
   case PIC_TT_STRING:
   case PIC_TT_VECTOR:
   case PIC_TT_BLOB: {
-    return pic_list(pic, 2, pic_symbol_value(pic->sQUOTE), obj);
+    return new_quote(state->ir, obj);
   }
   case PIC_TT_CONT:
   case PIC_TT_ENV:
@@ -546,41 +715,34 @@ analyze_node(analyze_state *state, pic_value obj, bool tailpos)
   case PIC_TT_SC:
   case PIC_TT_LIB:
   case PIC_TT_VAR:
+  case PIC_TT_EPHEMERON:
+  case PIC_TT_WTABLE:
   case PIC_TT_IREP:
     pic_error(pic, "invalid expression given");
   }
 }
 
-static pic_value
+static struct pic_node *
 analyze_call(analyze_state *state, pic_value obj, bool tailpos)
 {
   pic_state *pic = state->pic;
-  int ai = pic_gc_arena_preserve(pic);
-  pic_value seq, elt;
-  pic_sym call;
+  struct pic_node *node;
+  pic_value elt;
+  int i = 0;
 
-  if (! tailpos) {
-    call = state->sCALL;
-  } else {
-    call = state->sTAILCALL;
-  }
-  seq = pic_list(pic, 1, pic_symbol_value(call));
+  node = alloc_node(state->ir, tailpos ? NODE_TAILCALL : NODE_CALL, pic_length(pic, obj));
   pic_for_each (elt, obj) {
-    seq = pic_cons(pic, analyze(state, elt, false), seq);
+    node->elts[i++] = analyze(state, elt, false);
   }
-  seq = pic_reverse(pic, seq);
-
-  pic_gc_arena_restore(pic, ai);
-  pic_gc_protect(pic, seq);
-  return seq;
+  return node;
 }
 
-static pic_value
+static struct pic_node *
 analyze_lambda(analyze_state *state, pic_value obj)
 {
   pic_state *pic = state->pic;
-  int ai = pic_gc_arena_preserve(pic);
-  pic_value args, body, locals, varg, closes;
+  struct pic_lambda *lambda;
+  pic_value args, body;
 
   if (pic_length(pic, obj) < 2) {
     pic_error(pic, "syntax error");
@@ -592,6 +754,8 @@ analyze_lambda(analyze_state *state, pic_value obj)
     pic_error(pic, "syntax error");
   }
 
+  lambda = alloc_lambda(state->ir);
+
   push_scope(state, args);
   {
     analyze_scope *scope = state->scope;
@@ -600,295 +764,1328 @@ analyze_lambda(analyze_state *state, pic_value obj)
     /* analyze body in inner environment */
     body = pic_cdr(pic, pic_cdr(pic, obj));
     body = pic_cons(pic, pic_symbol_value(pic->sBEGIN), body);
-    body = analyze(state, body, true);
-
-    args = pic_nil_value();
-    for (i = 1; i < scope->argc; ++i) {
-      args = pic_cons(pic, pic_symbol_value(scope->vars[i]), args);
-    }
-    args = pic_reverse(pic, args);
+    lambda->body = analyze(state, body, true);
 
-    locals = pic_nil_value();
-    for (i = 0; i < scope->localc; ++i) {
-      locals = pic_cons(pic, pic_symbol_value(scope->vars[scope->argc + i]), locals);
-    }
-    locals = pic_reverse(pic, locals);
-
-    varg = scope->varg ? pic_true_value() : pic_false_value();
+    lambda->argc = scope->argc - 1;
+    lambda->args = copy_syms(state->ir, scope->vars + 1, lambda->argc);
+    lambda->localc = scope->localc;
+    lambda->locals = copy_syms(state->ir, scope->vars + scope->argc, lambda->localc);
+    lambda->varg = scope->varg;
 
-    closes = pic_nil_value();
+    /* only variables referenced from inner lambdas are boxed in the env */
+    lambda->closes = (pic_sym *)pic_ir_alloc(state->ir, sizeof(pic_sym) * (scope->argc + scope->localc));
     for (i = 1; i < scope->argc + scope->localc; ++i) {
       pic_sym var = scope->vars[i];
-      if (xh_get(scope->var_tbl, pic_symbol_name(pic, var))) {
-        closes = pic_cons(pic, pic_symbol_value(var), closes);
+      if (xh_get(scope->var_tbl, pic_symbol_name(pic, var))->val == 1) {
+        lambda->closes[lambda->closec++] = var;
       }
     }
-    closes = pic_reverse(pic, closes);
   }
   pop_scope(state);
 
-  obj = pic_list(pic, 6, pic_symbol_value(pic->sLAMBDA), args, locals, varg, closes, body);
-  pic_gc_arena_restore(pic, ai);
-  pic_gc_protect(pic, obj);
-  return obj;
+  return new_lambda(state->ir, lambda);
 }
 
-pic_value
-pic_analyze(pic_state *pic, pic_value obj)
+struct pic_node *
+pic_analyze(pic_state *pic, struct pic_ir *ir, pic_value obj)
 {
   analyze_state *state;
+  struct pic_node *node;
 
-  state = new_analyze_state(pic);
+  state = new_analyze_state(pic, ir);
 
-  obj = analyze(state, obj, false);
+  node = analyze(state, obj, false);
 
   destroy_analyze_state(state);
-  return obj;
+  return node;
 }
 
-typedef struct resolver_scope {
-  int depth;
-  bool varg;
-  int argc, localc;
-  struct xhash *cvs, *lvs;
-  unsigned cv_num;
+/**
+ * constant folding, propagation and inlining
+ */
 
-  struct resolver_scope *up;
-} resolver_scope;
+struct optimize_const {
+  pic_sym sym;
+  pic_value value;
+};
 
-typedef struct resolver_state {
+struct optimize_inline {
+  pic_sym sym;
+  struct pic_node *lambda;      /* as analyzed */
+  bool active;                  /* not inlined into its own copies */
+  bool dropped;                 /* inlined at all of its calls */
+};
+
+typedef struct optimize_scope {
+  /* arguments that are bound to constants and never assigned */
+  struct optimize_const *consts;
+  size_t clen;
+  /* the body as analyzed */
+  struct pic_node *body;
+  /* small local procedures that are only ever called */
+  struct optimize_inline *inlines;
+  size_t ilen;
+  /* variables of the lambdas inlined into this frame */
+  pic_sym *locals;
+  size_t llen;
+
+  struct optimize_scope *up;
+} optimize_scope;
+
+typedef struct optimize_state {
   pic_state *pic;
-  resolver_scope *scope;
-  pic_sym sREF;
-  pic_sym sGREF, sCREF, sLREF;
-} resolver_state;
+  struct pic_ir *ir;
+  optimize_scope *scope;
+  pic_sym rNOT, rEQP, rEQVP, rEQUALP;
+} optimize_state;
 
-static void push_resolver_scope(resolver_state *, pic_value, pic_value, bool, pic_value);
-static void pop_resolver_scope(resolver_state *);
+static void
+push_optimize_scope(optimize_state *state, struct pic_node *body, struct optimize_const *consts, size_t clen)
+{
+  optimize_scope *scope;
 
-static resolver_state *
-new_resolver_state(pic_state *pic)
+  scope = (optimize_scope *)pic_alloc(state->pic, sizeof(optimize_scope));
+  scope->up = state->scope;
+  scope->consts = consts;
+  scope->clen = clen;
+  scope->body = body;
+  scope->inlines = NULL;
+  scope->ilen = 0;
+  scope->locals = NULL;
+  scope->llen = 0;
+
+  state->scope = scope;
+}
+
+static void
+pop_optimize_scope(optimize_state *state)
 {
-  resolver_state *state;
+  optimize_scope *scope;
 
-  state = (resolver_state *)pic_alloc(pic, sizeof(resolver_state));
+  scope = state->scope->up;
+  pic_free(state->pic, state->scope->inlines);
+  pic_free(state->pic, state->scope->locals);
+  pic_free(state->pic, state->scope);
+  state->scope = scope;
+}
+
+static optimize_state *
+new_optimize_state(pic_state *pic, struct pic_ir *ir)
+{
+  optimize_state *state;
+  struct pic_lib *stdlib;
+
+  state = (optimize_state *)pic_alloc(pic, sizeof(optimize_state));
   state->pic = pic;
+  state->ir = ir;
   state->scope = NULL;
 
-  register_symbol(pic, state, sREF, "ref");
-  register_symbol(pic, state, sGREF, "gref");
-  register_symbol(pic, state, sLREF, "lref");
-  register_symbol(pic, state, sCREF, "cref");
+  stdlib = pic_find_library(pic, pic_parse(pic, "(scheme base)"));
+
+  /* pure procedures folded on constant arguments */
+  register_renamed_symbol(pic, state, rNOT, stdlib, "not");
+  register_renamed_symbol(pic, state, rEQP, stdlib, "eq?");
+  register_renamed_symbol(pic, state, rEQVP, stdlib, "eqv?");
+  register_renamed_symbol(pic, state, rEQUALP, stdlib, "equal?");
 
-  push_resolver_scope(state, pic_nil_value(), pic_nil_value(), false, pic_nil_value());
+  /* toplevel, which has no frame to inline into */
+  push_optimize_scope(state, NULL, NULL, 0);
 
   return state;
 }
 
 static void
-destroy_resolver_state(resolver_state *state)
+destroy_optimize_state(optimize_state *state)
 {
-  pop_resolver_scope(state);
+  pop_optimize_scope(state);
   pic_free(state->pic, state);
 }
 
-static void
-push_resolver_scope(resolver_state *state, pic_value args, pic_value locals, bool varg, pic_value closes)
+static struct optimize_const *
+find_const(struct optimize_const *consts, size_t clen, pic_sym sym)
 {
-  pic_state *pic = state->pic;
-  resolver_scope *scope;
-  int i, c;
-
-  scope = (resolver_scope *)pic_alloc(pic, sizeof(resolver_scope));
-  scope->up = state->scope;
-  scope->depth = scope->up ? scope->up->depth + 1 : 0;
-  scope->lvs = xh_new();
-  scope->cvs = xh_new();
-  scope->argc = pic_length(pic, args) + 1;
-  scope->localc = pic_length(pic, locals);
-  scope->varg = varg;
+  size_t i;
 
-  /* arguments */
-  for (i = 1; i < scope->argc; ++i) {
-    xh_put(scope->lvs, pic_symbol_name(pic, pic_sym(pic_list_ref(pic, args, i - 1))), i);
+  for (i = 0; i < clen; ++i) {
+    if (consts[i].sym == sym)
+      return &consts[i];
   }
+  return NULL;
+}
 
-  /* locals */
-  for (i = 0; i < scope->localc; ++i) {
-    xh_put(scope->lvs, pic_symbol_name(pic, pic_sym(pic_list_ref(pic, locals, i))), scope->argc + i);
+static bool
+number_p(pic_value v, double *f)
+{
+  if (pic_int_p(v)) {
+    *f = pic_int(v);
+    return true;
   }
+  if (pic_float_p(v)) {
+    *f = pic_float(v);
+    return true;
+  }
+  return false;
+}
 
-  /* closed variables */
-  scope->cv_num = 0;
-  for (i = 0, c = pic_length(pic, closes); i < c; ++i) {
-    xh_put(scope->cvs, pic_symbol_name(pic, pic_sym(pic_list_ref(pic, closes, i))), scope->cv_num++);
+/* the same results as the arithmetic instructions of the VM */
+static bool
+fold_arith(enum pic_node_type op, pic_value a, pic_value b, pic_value *r)
+{
+  double x, y;
+
+  if (pic_int_p(a) && pic_int_p(b)) {
+    int m = pic_int(a), n = pic_int(b), i;
+    bool overflow;
+
+    if (op == NODE_ADD)
+      overflow = __builtin_add_overflow(m, n, &i);
+    else if (op == NODE_SUB)
+      overflow = __builtin_sub_overflow(m, n, &i);
+    else if (op == NODE_MUL)
+      overflow = __builtin_mul_overflow(m, n, &i);
+    else
+      overflow = n == 0 || (m == INT_MIN && n == -1) || m % n != 0 || (i = m / n, false);
+
+    if (! overflow) {
+      *r = pic_int_value(i);
+      return true;
+    }
+  }
+  if (! number_p(a, &x) || ! number_p(b, &y)) {
+    return false;
+  }
+  if (op == NODE_DIV && y == 0) {
+    return false;               /* left to the VM */
   }
 
-  state->scope = scope;
+  if (op == NODE_ADD)
+    *r = pic_float_value(x + y);
+  else if (op == NODE_SUB)
+    *r = pic_float_value(x - y);
+  else if (op == NODE_MUL)
+    *r = pic_float_value(x * y);
+  else
+    *r = pic_float_value(x / y);
+  return true;
 }
 
-static void
-pop_resolver_scope(resolver_state *state)
+static bool
+fold_compare(enum pic_node_type op, pic_value a, pic_value b, pic_value *r)
 {
-  resolver_scope *scope;
+  double x, y;
 
-  scope = state->scope;
-  xh_destroy(scope->cvs);
-  xh_destroy(scope->lvs);
+  if (! number_p(a, &x) || ! number_p(b, &y)) {
+    return false;
+  }
 
-  scope = scope->up;
-  pic_free(state->pic, state->scope);
-  state->scope = scope;
+  if (op == NODE_EQ)
+    *r = pic_bool_value(x == y);
+  else if (op == NODE_LT)
+    *r = pic_bool_value(x < y);
+  else if (op == NODE_LE)
+    *r = pic_bool_value(x <= y);
+  else if (op == NODE_GT)
+    *r = pic_bool_value(x > y);
+  else
+    *r = pic_bool_value(x >= y);
+  return true;
 }
 
 static bool
-is_closed(resolver_state *state, pic_sym sym)
+ref_p(struct pic_node *node, int depth, pic_sym sym)
 {
-  return xh_get(state->scope->cvs, pic_symbol_name(state->pic, sym)) != NULL;
+  return node->type == NODE_REF && node->u.ref.depth == depth && node->u.ref.sym == sym;
 }
 
-static pic_value
-resolve_gref(resolver_state *state, pic_sym sym)
+/*
+ * counts the assignments and references in node of variable sym of the
+ * scope depth levels up, and the references that are the operator of a
+ * call with argc arguments
+ */
+static void
+scan_var(struct pic_node *node, int depth, pic_sym sym, int argc, int *sets, int *refs, int *calls)
 {
-  pic_state *pic = state->pic;
-  const char *name = pic_symbol_name(pic, sym);
-  struct xh_entry *e;
-  size_t i;
+  int i;
 
-  if ((e = xh_get(pic->global_tbl, name))) {
-    i = e->val;
-  }
-  else {
-    i = pic->glen++;
-    if (i >= pic->gcapa) {
-      pic_error(pic, "global table overflow");
+  switch (node->type) {
+  case NODE_REF:
+    if (ref_p(node, depth, sym)) {
+      ++*refs;
+    }
+    return;
+  case NODE_LAMBDA:
+    scan_var(node->u.lambda->body, depth + 1, sym, argc, sets, refs, calls);
+    return;
+  case NODE_SETBANG:
+    if (ref_p(node->elts[0], depth, sym)) {
+      ++*sets;
+    }
+    scan_var(node->elts[1], depth, sym, argc, sets, refs, calls);
+    return;
+  case NODE_CALL:
+  case NODE_TAILCALL:
+    if (ref_p(node->elts[0], depth, sym) && node->len - 1 == argc) {
+      ++*calls;
     }
-    xh_put(pic->global_tbl, name, i);
+    break;
+  default:
+    break;
+  }
+  for (i = 0; i < node->len; ++i) {
+    scan_var(node->elts[i], depth, sym, argc, sets, refs, calls);
   }
-  return pic_list(pic, 2, pic_symbol_value(state->sGREF), pic_int_value(i));
 }
 
-static pic_value
-resolve_lref(resolver_state *state, pic_sym sym)
+static int
+count_sets(struct pic_node *node, int depth, pic_sym sym)
 {
-  pic_state *pic = state->pic;
-  int i;
-
-  i = xh_get(state->scope->lvs, pic_symbol_name(pic, sym))->val;
+  int sets = 0, refs = 0, calls = 0;
 
-  return pic_list(pic, 2, pic_symbol_value(state->sLREF), pic_int_value(i));
+  scan_var(node, depth, sym, -1, &sets, &refs, &calls);
+  return sets;
 }
 
-static pic_value
-resolve_cref(resolver_state *state, int depth, pic_sym sym)
+static int
+count_refs(struct pic_node *node, int depth, pic_sym sym)
 {
-  pic_state *pic = state->pic;
-  resolver_scope *scope = state->scope;
-  int i, d;
-
-  d = depth;
-  while (d-- > 0) {
-    scope = scope->up;
-  }
+  int sets = 0, refs = 0, calls = 0;
 
-  i = xh_get(scope->cvs, pic_symbol_name(pic, sym))->val;
-
-  return pic_list(pic, 3,
-                  pic_symbol_value(state->sCREF),
-                  pic_int_value(depth),
-                  pic_int_value(i));
+  scan_var(node, depth, sym, -1, &sets, &refs, &calls);
+  return refs;
 }
 
-static pic_value resolve_reference_node(resolver_state *state, pic_value obj);
-
-static pic_value
-resolve_reference(resolver_state *state, pic_value obj)
+static int
+node_size(struct pic_node *node)
 {
-  int ai = pic_gc_arena_preserve(state->pic);
+  int n = 1, i;
 
-  obj = resolve_reference_node(state, obj);
-
-  pic_gc_arena_restore(state->pic, ai);
-  pic_gc_protect(state->pic, obj);
-  return obj;
+  if (node->type == NODE_LAMBDA) {
+    return n + node_size(node->u.lambda->body);
+  }
+  for (i = 0; i < node->len; ++i) {
+    n += node_size(node->elts[i]);
+  }
+  return n;
 }
 
-static pic_value
-resolve_reference_node(resolver_state *state, pic_value obj)
+/* fresh names for all the variables bound in node */
+static void
+rename_binders(optimize_state *state, struct pic_node *node, struct xhash *renames)
 {
   pic_state *pic = state->pic;
-  resolver_scope *scope = state->scope;
-  pic_sym tag;
-
-  if (! pic_pair_p(obj))
-    return obj;
-
-  tag = pic_sym(pic_car(pic, obj));
-  if (tag == state->sREF) {
-    int depth;
-    pic_sym sym;
+  struct pic_lambda *lambda;
+  int i;
 
-    depth = pic_int(pic_list_ref(pic, obj, 1));
-    sym = pic_sym(pic_list_ref(pic, obj, 2));
-    if (depth == scope->depth) {
-      return resolve_gref(state, sym);
+  if (node->type == NODE_LAMBDA) {
+    lambda = node->u.lambda;
+    for (i = 0; i < lambda->argc; ++i) {
+      xh_put(renames, pic_symbol_name(pic, lambda->args[i]), pic_gensym(pic, lambda->args[i]));
     }
-    else if (depth == 0 && is_closed(state, sym)) {
-      return resolve_lref(state, sym);
-    }
-    else {
-      return resolve_cref(state, depth, sym);
+    for (i = 0; i < lambda->localc; ++i) {
+      xh_put(renames, pic_symbol_name(pic, lambda->locals[i]), pic_gensym(pic, lambda->locals[i]));
     }
+    rename_binders(state, lambda->body, renames);
+    return;
   }
-  else if (tag == pic->sLAMBDA) {
-    pic_value args, locals, closes, body;
-    bool varg;
-
-    args = pic_list_ref(pic, obj, 1);
-    locals = pic_list_ref(pic, obj, 2);
-    varg = pic_true_p(pic_list_ref(pic, obj, 3));
-    closes = pic_list_ref(pic, obj, 4);
-    body = pic_list_ref(pic, obj, 5);
+  for (i = 0; i < node->len; ++i) {
+    rename_binders(state, node->elts[i], renames);
+  }
+}
 
-    push_resolver_scope(state, args, locals, varg, closes);
-    {
-      body = resolve_reference(state, body);
-    }
-    pop_resolver_scope(state);
+static pic_sym
+rename_var(optimize_state *state, pic_sym sym, struct xhash *renames)
+{
+  struct xh_entry *e;
 
-    return pic_list(pic, 6, pic_symbol_value(pic->sLAMBDA), args, locals, pic_bool_value(varg), closes, body);
+  if (renames && (e = xh_get(renames, pic_symbol_name(state->pic, sym)))) {
+    return e->val;
   }
-  else if (tag == pic->sQUOTE) {
-    return obj;
+  return sym;
+}
+
+static pic_sym *
+rename_vars(optimize_state *state, pic_sym *vars, int n, struct xhash *renames)
+{
+  pic_sym *syms;
+  int i;
+
+  syms = (pic_sym *)pic_ir_alloc(state->ir, sizeof(pic_sym) * n);
+  for (i = 0; i < n; ++i) {
+    syms[i] = rename_var(state, vars[i], renames);
   }
-  else {
-    int ai = pic_gc_arena_preserve(pic);
-    pic_value seq = pic_list(pic, 1, pic_symbol_value(tag)), elt;
+  return syms;
+}
 
-    pic_for_each (elt, pic_cdr(pic, obj)) {
-      seq = pic_cons(pic, resolve_reference(state, elt), seq);
+static struct pic_lambda *copy_lambda(optimize_state *, struct pic_lambda *, int, int, struct xhash *);
 
-      pic_gc_arena_restore(pic, ai);
-      pic_gc_protect(pic, seq);
+/*
+ * copies node, which is level lambdas deep in the scope being moved, so
+ * that its references to outer scopes reach delta levels further
+ */
+static struct pic_node *
+copy_node(optimize_state *state, struct pic_node *node, int level, int delta, struct xhash *renames)
+{
+  struct pic_node *copy;
+  int depth, i;
+
+  switch (node->type) {
+  case NODE_QUOTE:
+    return node;
+  case NODE_REF:
+    depth = node->u.ref.depth;
+    return new_ref(state->ir, depth > level ? depth + delta : depth, rename_var(state, node->u.ref.sym, renames));
+  case NODE_LAMBDA:
+    return new_lambda(state->ir, copy_lambda(state, node->u.lambda, level + 1, delta, renames));
+  default:
+    copy = copy_shallow(state->ir, node);
+    for (i = 0; i < node->len; ++i) {
+      copy->elts[i] = copy_node(state, node->elts[i], level, delta, renames);
     }
-    return pic_reverse(pic, seq);
+    return copy;
   }
 }
 
-static pic_value
-pic_resolve(pic_state *pic, pic_value obj)
+static struct pic_lambda *
+copy_lambda(optimize_state *state, struct pic_lambda *lambda, int level, int delta, struct xhash *renames)
 {
-  resolver_state *state;
-
-  state = new_resolver_state(pic);
-
-  obj = resolve_reference(state, obj);
+  struct pic_lambda *copy;
+
+  copy = alloc_lambda(state->ir);
+  *copy = *lambda;
+  copy->args = rename_vars(state, lambda->args, lambda->argc, renames);
+  copy->locals = rename_vars(state, lambda->locals, lambda->localc, renames);
+  copy->closes = rename_vars(state, lambda->closes, lambda->closec, renames);
+  copy->body = copy_node(state, lambda->body, level, delta, renames);
+  return copy;
+}
 
-  destroy_resolver_state(state);
-  return obj;
+/* node moved out of tail position */
+static struct pic_node *
+untail(optimize_state *state, struct pic_node *node)
+{
+  struct pic_node *copy;
+
+  switch (node->type) {
+  case NODE_TAILCALL:
+    copy = copy_shallow(state->ir, node);
+    copy->type = NODE_CALL;
+    return copy;
+  case NODE_IF:
+    copy = copy_shallow(state->ir, node);
+    copy->elts[1] = untail(state, node->elts[1]);
+    copy->elts[2] = untail(state, node->elts[2]);
+    return copy;
+  case NODE_BEGIN:
+    copy = copy_shallow(state->ir, node);
+    copy->elts[node->len - 1] = untail(state, node->elts[node->len - 1]);
+    return copy;
+  case NODE_VALUES:
+    return untail(state, node->elts[0]);
+  case NODE_CALL_WITH_VALUES:
+    copy = copy_shallow(state->ir, node);
+    copy->elts[0] = untail(state, node->elts[0]);
+    return copy;
+  default:
+    return node;
+  }
 }
 
-/**
+/* references to sym from the body of the procedure bound to it for good */
+static struct pic_node *
+replace_self(optimize_state *state, struct pic_node *node, pic_sym sym)
+{
+  struct pic_node *copy;
+  int i;
+
+  switch (node->type) {
+  case NODE_QUOTE:
+  case NODE_LAMBDA:
+    return node;
+  case NODE_REF:
+    return ref_p(node, 1, sym) ? alloc_node(state->ir, NODE_SELF, 0) : node;
+  default:
+    copy = copy_shallow(state->ir, node);
+    for (i = 0; i < node->len; ++i) {
+      copy->elts[i] = replace_self(state, node->elts[i], sym);
+    }
+    return copy;
+  }
+}
+
+/* variables of the scope that are referred to from inner lambdas */
+static void
+collect_captured(optimize_state *state, struct pic_node *node, int level, struct xhash *captured)
+{
+  int i;
+
+  switch (node->type) {
+  case NODE_REF:
+    if (level > 0 && node->u.ref.depth == level) {
+      xh_put(captured, pic_symbol_name(state->pic, node->u.ref.sym), 1);
+    }
+    return;
+  case NODE_LAMBDA:
+    collect_captured(state, node->u.lambda->body, level + 1, captured);
+    return;
+  default:
+    for (i = 0; i < node->len; ++i) {
+      collect_captured(state, node->elts[i], level, captured);
+    }
+  }
+}
+
+static bool
+local_p(pic_sym sym, pic_sym *syms, int n)
+{
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    if (syms[i] == sym)
+      return true;
+  }
+  return false;
+}
+
+/* small local procedures defined in the body and only ever called */
+static void
+find_inlines(optimize_state *state, struct pic_lambda *lambda, struct optimize_const *inits, size_t initc)
+{
+  pic_state *pic = state->pic;
+  optimize_scope *scope = state->scope;
+  struct pic_node *body = scope->body, **defs, *var, *val;
+  int i, n, argc, sets, refs, calls;
+  pic_sym sym;
+
+  if (body->type == NODE_BEGIN) {
+    defs = body->elts;
+    n = body->len;
+  } else {
+    defs = &body;
+    n = 1;
+  }
+
+  for (i = 0; i < n; ++i) {
+    if (defs[i]->type != NODE_SETBANG)
+      continue;
+
+    var = defs[i]->elts[0];
+    val = defs[i]->elts[1];
+    if (var->u.ref.depth != 0 || val->type != NODE_LAMBDA || val->u.lambda->varg)
+      continue;
+
+    /* variables that may hold something else before the definition */
+    sym = var->u.ref.sym;
+    if (! local_p(sym, lambda->locals, lambda->localc) && find_const(inits, initc, sym) == NULL)
+      continue;
+
+    if (node_size(val->u.lambda->body) > PIC_INLINE_SIZE)
+      continue;
+
+    argc = val->u.lambda->argc;
+    sets = refs = calls = 0;
+    scan_var(body, 0, sym, argc, &sets, &refs, &calls);
+    if (sets != 1 || refs != calls)
+      continue;
+    if (count_refs(val->u.lambda->body, 1, sym) > 0)
+      continue;                 /* recursive */
+
+    scope->inlines = pic_realloc(pic, scope->inlines, sizeof(struct optimize_inline) * (scope->ilen + 1));
+    scope->inlines[scope->ilen].sym = sym;
+    scope->inlines[scope->ilen].lambda = val;
+    scope->inlines[scope->ilen].active = false;
+    scope->inlines[scope->ilen].dropped = false;
+    scope->ilen++;
+  }
+}
+
+/* the definition of sym in the body, which is not referred to any more */
+static struct pic_node *
+drop_definition(optimize_state *state, struct pic_node *body, pic_sym sym)
+{
+  struct pic_node *seq, *elt;
+  int i, n = 0;
+
+  if (body->type == NODE_SETBANG && ref_p(body->elts[0], 0, sym)) {
+    return new_quote(state->ir, pic_none_value());
+  }
+  if (body->type != NODE_BEGIN) {
+    return body;
+  }
+
+  seq = alloc_node(state->ir, NODE_BEGIN, body->len);
+  for (i = 0; i < body->len; ++i) {
+    elt = body->elts[i];
+    if (elt->type == NODE_SETBANG && ref_p(elt->elts[0], 0, sym)) {
+      if (i < body->len - 1) {
+        continue;
+      }
+      elt = new_quote(state->ir, pic_none_value());
+    }
+    seq->elts[n++] = elt;
+  }
+  seq->len = n;
+  return seq;
+}
+
+static void
+add_local(optimize_state *state, pic_sym sym)
+{
+  optimize_scope *scope = state->scope;
+
+  scope->locals = pic_realloc(state->pic, scope->locals, sizeof(pic_sym) * (scope->llen + 1));
+  scope->locals[scope->llen++] = sym;
+}
+
+static struct pic_node *optimize(optimize_state *, struct pic_node *);
+
+/*
+ * inits are the arguments the lambda is applied to right away that are
+ * constants, and self the variable it is assigned to once and for all
+ */
+static struct pic_lambda *
+optimize_lambda(optimize_state *state, struct pic_lambda *lambda, struct optimize_const *inits, size_t initc, struct pic_node *self)
+{
+  pic_state *pic = state->pic;
+  struct pic_lambda *opt;
+  struct pic_node *body = lambda->body;
+  struct optimize_const *consts;
+  struct xhash *captured;
+  size_t clen = 0, i, j;
+  int k;
+
+  consts = (struct optimize_const *)pic_ir_alloc(state->ir, sizeof(struct optimize_const) * initc);
+  for (i = 0; i < initc; ++i) {
+    if (count_sets(body, 0, inits[i].sym) == 0) {
+      consts[clen++] = inits[i];
+    }
+  }
+
+  opt = alloc_lambda(state->ir);
+  *opt = *lambda;
+
+  push_optimize_scope(state, body, consts, clen);
+  {
+    optimize_scope *scope = state->scope;
+
+    find_inlines(state, lambda, inits, initc);
+
+    body = optimize(state, body);
+
+    /* procedures that were inlined at all of their calls */
+    for (i = 0; i < scope->ilen; ++i) {
+      if (count_refs(body, 0, scope->inlines[i].sym) == 0) {
+        body = drop_definition(state, body, scope->inlines[i].sym);
+        scope->inlines[i].dropped = true;
+      }
+    }
+
+    opt->locals = (pic_sym *)pic_ir_alloc(state->ir, sizeof(pic_sym) * (lambda->localc + scope->llen));
+    opt->localc = 0;
+    for (k = 0; k < lambda->localc; ++k) {
+      for (j = 0; j < scope->ilen; ++j) {
+        if (scope->inlines[j].dropped && scope->inlines[j].sym == lambda->locals[k])
+          break;
+      }
+      if (j == scope->ilen) {
+        opt->locals[opt->localc++] = lambda->locals[k];
+      }
+    }
+    for (i = 0; i < scope->llen; ++i) {
+      opt->locals[opt->localc++] = scope->locals[i];
+    }
+  }
+  pop_optimize_scope(state);
+
+  if (self) {
+    body = replace_self(state, body, self->u.ref.sym);
+  }
+  opt->body = body;
+
+  /* variables referenced from inner lambdas */
+  captured = xh_new();
+  collect_captured(state, body, 0, captured);
+  opt->closes = (pic_sym *)pic_ir_alloc(state->ir, sizeof(pic_sym) * (opt->argc + opt->localc));
+  opt->closec = 0;
+  for (k = 0; k < opt->argc; ++k) {
+    if (xh_get(captured, pic_symbol_name(pic, opt->args[k]))) {
+      opt->closes[opt->closec++] = opt->args[k];
+    }
+  }
+  for (k = 0; k < opt->localc; ++k) {
+    if (xh_get(captured, pic_symbol_name(pic, opt->locals[k]))) {
+      opt->closes[opt->closec++] = opt->locals[k];
+    }
+  }
+  xh_destroy(captured);
+
+  return opt;
+}
+
+static struct pic_node *
+new_call(optimize_state *state, enum pic_node_type type, struct pic_node *proc, struct pic_node **args, int argc)
+{
+  struct pic_node *call;
+
+  call = alloc_node(state->ir, type, argc + 1);
+  call->elts[0] = proc;
+  memcpy(call->elts + 1, args, sizeof(struct pic_node *) * argc);
+  return call;
+}
+
+/*
+ * A lambda applied right away has its variables moved into the locals of
+ * this frame, unless they are captured. Otherwise the call is kept.
+ */
+static struct pic_node *
+optimize_let(optimize_state *state, enum pic_node_type type, struct pic_lambda *proc, struct pic_node **args, int argc, bool *inlined)
+{
+  struct pic_ir *ir = state->ir;
+  struct optimize_const *inits;
+  struct pic_node *body, *seq;
+  size_t initc = 0;
+  int i, n = 0;
+
+  *inlined = false;
+  if (proc->varg || proc->argc != argc) {
+    proc = optimize_lambda(state, proc, NULL, 0, NULL);
+    return new_call(state, type, new_lambda(ir, proc), args, argc);
+  }
+
+  inits = (struct optimize_const *)pic_ir_alloc(ir, sizeof(struct optimize_const) * argc);
+  for (i = 0; i < argc; ++i) {
+    if (args[i]->type == NODE_QUOTE) {
+      inits[initc].sym = proc->args[i];
+      inits[initc].value = args[i]->u.value;
+      initc++;
+    }
+  }
+  proc = optimize_lambda(state, proc, inits, initc, NULL);
+
+  if (state->scope->up == NULL || proc->closec > 0) {
+    return new_call(state, type, new_lambda(ir, proc), args, argc);
+  }
+  body = proc->body;
+
+  seq = alloc_node(ir, NODE_BEGIN, argc + 1);
+  for (i = 0; i < argc; ++i) {
+    pic_sym var = proc->args[i];
+
+    if (count_refs(body, 0, var) == 0 && args[i]->type == NODE_QUOTE) {
+      if (count_sets(body, 0, var) == 0)
+        continue;
+    }
+    else {
+      seq->elts[n++] = new_node(ir, NODE_SETBANG, 2, new_ref(ir, 0, var), args[i]);
+    }
+    add_local(state, var);
+  }
+  for (i = 0; i < proc->localc; ++i) {
+    add_local(state, proc->locals[i]);
+  }
+
+  body = copy_node(state, body, 0, -1, NULL);
+  if (type == NODE_CALL) {
+    body = untail(state, body);
+  }
+  *inlined = true;
+
+  if (n == 0) {
+    return body;
+  }
+  seq->elts[n++] = body;
+  seq->len = n;
+  return seq;
+}
+
+static struct optimize_inline *
+find_inline(optimize_state *state, struct pic_node *ref, int argc)
+{
+  optimize_scope *scope = state->scope;
+  int depth = ref->u.ref.depth;
+  size_t i;
+
+  while (depth-- > 0 && scope) {
+    scope = scope->up;
+  }
+  if (scope == NULL)
+    return NULL;
+
+  for (i = 0; i < scope->ilen; ++i) {
+    struct optimize_inline *in = &scope->inlines[i];
+
+    if (in->sym == ref->u.ref.sym && ! in->active && in->lambda->u.lambda->argc == argc) {
+      return in;
+    }
+  }
+  return NULL;
+}
+
+static struct pic_node *
+optimize_call(optimize_state *state, struct pic_node *node)
+{
+  pic_state *pic = state->pic;
+  struct pic_node *proc, **args, *v;
+  int argc = node->len - 1, i;
+  bool inlined;
+
+  proc = node->elts[0];
+
+  args = (struct pic_node **)pic_ir_alloc(state->ir, sizeof(struct pic_node *) * argc);
+  for (i = 0; i < argc; ++i) {
+    args[i] = optimize(state, node->elts[i + 1]);
+  }
+
+  /* a call to a small local procedure becomes a let of a copy of it */
+  if (proc->type == NODE_REF && state->scope->up) {
+    struct optimize_inline *in;
+
+    if ((in = find_inline(state, proc, argc)) != NULL) {
+      struct pic_lambda *copy;
+      struct xhash *renames;
+
+      renames = xh_new();
+      rename_binders(state, in->lambda, renames);
+      copy = copy_lambda(state, in->lambda->u.lambda, 0, proc->u.ref.depth, renames);
+      xh_destroy(renames);
+
+      in->active = true;
+      v = optimize_let(state, node->type, copy, args, argc, &inlined);
+      in->active = false;
+      if (inlined) {
+        return v;
+      }
+    }
+  }
+
+  if (proc->type == NODE_LAMBDA) {
+    return optimize_let(state, node->type, proc->u.lambda, args, argc, &inlined);
+  }
+
+  proc = optimize(state, proc);
+
+  /* pure procedures of the standard library on constants */
+  if (proc->type == NODE_REF) {
+    pic_sym sym = proc->u.ref.sym;
+    pic_value r;
+    bool folded = false;
+
+    if (sym == state->rNOT && argc == 1 && args[0]->type == NODE_QUOTE) {
+      r = pic_bool_value(pic_false_p(args[0]->u.value));
+      folded = true;
+    }
+    else if ((sym == state->rEQP || sym == state->rEQVP || sym == state->rEQUALP) && argc == 2
+             && args[0]->type == NODE_QUOTE && args[1]->type == NODE_QUOTE) {
+      pic_value a = args[0]->u.value, b = args[1]->u.value;
+
+      if (sym == state->rEQP)
+        r = pic_bool_value(pic_eq_p(a, b));
+      else if (sym == state->rEQVP)
+        r = pic_bool_value(pic_eqv_p(a, b));
+      else
+        r = pic_bool_value(pic_equal_p(pic, a, b));
+      folded = true;
+    }
+    if (folded) {
+      return new_quote(state->ir, r);
+    }
+  }
+
+  return new_call(state, node->type, proc, args, argc);
+}
+
+static struct pic_node *
+optimize(optimize_state *state, struct pic_node *node)
+{
+  pic_state *pic = state->pic;
+  struct pic_ir *ir = state->ir;
+  struct pic_node *a, *b, *v, *seq;
+  pic_value x, y, r;
+  int i, n;
+
+  switch (node->type) {
+  case NODE_REF: {
+    optimize_scope *scope = state->scope;
+    struct optimize_const *c;
+    int depth = node->u.ref.depth;
+
+    while (depth-- > 0 && scope) {
+      scope = scope->up;
+    }
+    if (scope && (c = find_const(scope->consts, scope->clen, node->u.ref.sym)) != NULL) {
+      return new_quote(ir, c->value);
+    }
+    return node;
+  }
+  case NODE_QUOTE:
+    return node;
+  case NODE_LAMBDA:
+    return new_lambda(ir, optimize_lambda(state, node->u.lambda, NULL, 0, NULL));
+  case NODE_SETBANG:
+    a = node->elts[0];
+    v = node->elts[1];
+
+    /* a local procedure defined once for all refers to itself by its frame */
+    if (v->type == NODE_LAMBDA && state->scope->up && a->u.ref.depth == 0
+        && count_sets(state->scope->body, 0, a->u.ref.sym) == 1) {
+      v = new_lambda(ir, optimize_lambda(state, v->u.lambda, NULL, 0, a));
+    } else {
+      v = optimize(state, v);
+    }
+    return new_node(ir, NODE_SETBANG, 2, a, v);
+  case NODE_IF:
+    a = optimize(state, node->elts[0]);
+
+    /* dead branch */
+    if (a->type == NODE_QUOTE) {
+      return optimize(state, node->elts[pic_false_p(a->u.value) ? 2 : 1]);
+    }
+    b = optimize(state, node->elts[1]);
+    return new_node(ir, NODE_IF, 3, a, b, optimize(state, node->elts[2]));
+  case NODE_BEGIN:
+    /* constants and lambdas have no effect but as the last one */
+    seq = alloc_node(ir, NODE_BEGIN, node->len);
+    n = 0;
+    for (i = 0; i < node->len; ++i) {
+      v = optimize(state, node->elts[i]);
+      if (i == node->len - 1 || ! (v->type == NODE_QUOTE || v->type == NODE_LAMBDA)) {
+        seq->elts[n++] = v;
+      }
+    }
+    if (n == 1) {
+      return seq->elts[0];
+    }
+    seq->len = n;
+    return seq;
+  case NODE_CAR:
+  case NODE_CDR:
+  case NODE_NILP:
+  case NODE_MINUS:
+    a = optimize(state, node->elts[0]);
+
+    if (a->type == NODE_QUOTE) {
+      double f;
+
+      x = a->u.value;
+      if (node->type == NODE_NILP) {
+        return new_quote(ir, pic_bool_value(pic_nil_p(x)));
+      }
+      if (node->type == NODE_CAR && pic_pair_p(x)) {
+        return new_quote(ir, pic_car(pic, x));
+      }
+      if (node->type == NODE_CDR && pic_pair_p(x)) {
+        return new_quote(ir, pic_cdr(pic, x));
+      }
+      if (node->type == NODE_MINUS && number_p(x, &f) && ! (pic_int_p(x) && pic_int(x) == INT_MIN)) {
+        return new_quote(ir, pic_int_p(x) ? pic_int_value(-pic_int(x)) : pic_float_value(-f));
+      }
+    }
+    return new_node(ir, node->type, 1, a);
+  case NODE_ADD:
+  case NODE_SUB:
+  case NODE_MUL:
+  case NODE_DIV:
+  case NODE_EQ:
+  case NODE_LT:
+  case NODE_LE:
+  case NODE_GT:
+  case NODE_GE:
+    a = optimize(state, node->elts[0]);
+    b = optimize(state, node->elts[1]);
+
+    if (a->type == NODE_QUOTE && b->type == NODE_QUOTE) {
+      bool folded;
+
+      x = a->u.value;
+      y = b->u.value;
+      if (node->type == NODE_ADD || node->type == NODE_SUB || node->type == NODE_MUL || node->type == NODE_DIV) {
+        folded = fold_arith(node->type, x, y, &r);
+      } else {
+        folded = fold_compare(node->type, x, y, &r);
+      }
+      if (folded) {
+        return new_quote(ir, r);
+      }
+    }
+    return new_node(ir, node->type, 2, a, b);
+  case NODE_CALL:
+  case NODE_TAILCALL:
+    return optimize_call(state, node);
+  default:
+    /* values, call-with-values and cons */
+    seq = copy_shallow(ir, node);
+    for (i = 0; i < node->len; ++i) {
+      seq->elts[i] = optimize(state, node->elts[i]);
+    }
+    return seq;
+  }
+}
+
+static struct pic_node *
+pic_optimize(pic_state *pic, struct pic_ir *ir, struct pic_node *node)
+{
+  optimize_state *state;
+
+  state = new_optimize_state(pic, ir);
+
+  node = optimize(state, node);
+
+  destroy_optimize_state(state);
+  return node;
+}
+
+typedef struct resolver_scope {
+  int depth;
+  bool varg;
+  int argc, localc;
+  struct xhash *lvs;
+  /* frame slots holding a box, for variables assigned after they are captured */
+  bool *boxed;
+  /* free variables, copied into the closure when it is created */
+  struct xhash *cvs;
+  pic_sym *cv_syms;
+  int *cv_depths;               /* of the scope each one belongs to */
+  unsigned cv_num;
+
+  struct resolver_scope *up;
+} resolver_scope;
+
+typedef struct resolver_state {
+  pic_state *pic;
+  struct pic_ir *ir;
+  resolver_scope *scope;
+} resolver_state;
+
+static void push_resolver_scope(resolver_state *, struct pic_lambda *);
+static void pop_resolver_scope(resolver_state *);
+
+static resolver_state *
+new_resolver_state(pic_state *pic, struct pic_ir *ir)
+{
+  resolver_state *state;
+
+  state = (resolver_state *)pic_alloc(pic, sizeof(resolver_state));
+  state->pic = pic;
+  state->ir = ir;
+  state->scope = NULL;
+
+  push_resolver_scope(state, NULL);
+
+  return state;
+}
+
+static void
+destroy_resolver_state(resolver_state *state)
+{
+  pop_resolver_scope(state);
+  pic_free(state->pic, state);
+}
+
+/*
+ * Records for each variable of the frame the first element of the body
+ * in which it is captured by a lambda, and the last one in which the
+ * frame assigns it. Assignments from lambdas count as after capture.
+ */
+static void
+scan_frame(resolver_state *state, struct pic_node *node, int level, int elt, int *captured, int *assigned)
+{
+  pic_state *pic = state->pic;
+  resolver_scope *scope = state->scope;
+  struct pic_node *var;
+  struct xh_entry *e;
+  int i;
+
+  switch (node->type) {
+  case NODE_REF:
+    if (level > 0 && node->u.ref.depth == level) {
+      e = xh_get(scope->lvs, pic_symbol_name(pic, node->u.ref.sym));
+      if (captured[e->val] < 0) {
+        captured[e->val] = elt;
+      }
+    }
+    return;
+  case NODE_LAMBDA:
+    scan_frame(state, node->u.lambda->body, level + 1, elt, captured, assigned);
+    return;
+  case NODE_SETBANG:
+    var = node->elts[0];
+    if (var->u.ref.depth == level) {
+      e = xh_get(scope->lvs, pic_symbol_name(pic, var->u.ref.sym));
+      if (level > 0) {
+        if (captured[e->val] < 0) {
+          captured[e->val] = elt;
+        }
+        assigned[e->val] = INT_MAX;
+      }
+      else if (assigned[e->val] < elt) {
+        assigned[e->val] = elt;
+      }
+    }
+    scan_frame(state, node->elts[1], level, elt, captured, assigned);
+    return;
+  default:
+    for (i = 0; i < node->len; ++i) {
+      scan_frame(state, node->elts[i], level, elt, captured, assigned);
+    }
+  }
+}
+
+/* lambda is NULL for the toplevel */
+static void
+push_resolver_scope(resolver_state *state, struct pic_lambda *lambda)
+{
+  pic_state *pic = state->pic;
+  resolver_scope *scope;
+  struct pic_node *body;
+  int *captured, *assigned;
+  int i, n;
+
+  scope = (resolver_scope *)pic_alloc(pic, sizeof(resolver_scope));
+  scope->up = state->scope;
+  scope->depth = scope->up ? scope->up->depth + 1 : 0;
+  scope->lvs = xh_new();
+  scope->cvs = xh_new();
+  scope->argc = lambda ? lambda->argc + 1 : 1;
+  scope->localc = lambda ? lambda->localc : 0;
+  scope->varg = lambda ? lambda->varg : false;
+  scope->cv_syms = NULL;
+  scope->cv_depths = NULL;
+  scope->cv_num = 0;
+
+  /* arguments */
+  for (i = 1; i < scope->argc; ++i) {
+    xh_put(scope->lvs, pic_symbol_name(pic, lambda->args[i - 1]), i);
+  }
+
+  /* locals */
+  for (i = 0; i < scope->localc; ++i) {
+    xh_put(scope->lvs, pic_symbol_name(pic, lambda->locals[i]), scope->argc + i);
+  }
+
+  state->scope = scope;
+
+  /* captured variables that are assigned afterwards go into boxes */
+  n = scope->argc + scope->localc;
+  scope->boxed = (bool *)pic_calloc(pic, n, sizeof(bool));
+  if (lambda == NULL) {
+    return;
+  }
+  captured = (int *)pic_alloc(pic, sizeof(int) * n);
+  assigned = (int *)pic_alloc(pic, sizeof(int) * n);
+  for (i = 0; i < n; ++i) {
+    captured[i] = assigned[i] = -1;
+  }
+  body = lambda->body;
+  if (body->type == NODE_BEGIN) {
+    for (i = 0; i < body->len; ++i) {
+      scan_frame(state, body->elts[i], 0, i, captured, assigned);
+    }
+  }
+  else {
+    scan_frame(state, body, 0, 0, captured, assigned);
+  }
+  for (i = 0; i < n; ++i) {
+    scope->boxed[i] = captured[i] >= 0 && assigned[i] >= captured[i];
+  }
+  pic_free(pic, captured);
+  pic_free(pic, assigned);
+}
+
+static void
+pop_resolver_scope(resolver_state *state)
+{
+  resolver_scope *scope;
+
+  scope = state->scope;
+  xh_destroy(scope->cvs);
+  xh_destroy(scope->lvs);
+  pic_free(state->pic, scope->boxed);
+  pic_free(state->pic, scope->cv_syms);
+  pic_free(state->pic, scope->cv_depths);
+
+  scope = scope->up;
+  pic_free(state->pic, state->scope);
+  state->scope = scope;
+}
+
+/* the slot of global variable name, allocated on the first reference */
+int
+pic_global_index(pic_state *pic, const char *name)
+{
+  struct xh_entry *e;
+  size_t i;
+
+  if ((e = xh_get(pic->global_tbl, name))) {
+    i = e->val;
+  }
+  else {
+    i = pic->glen++;
+    if (i >= pic->gcapa) {
+      pic_error(pic, "global table overflow");
+    }
+    e = xh_put(pic->global_tbl, name, i);
+    pic->global_names[i] = e->key;
+  }
+  return i;
+}
+
+static int
+resolve_gref(resolver_state *state, pic_sym sym)
+{
+  return pic_global_index(state->pic, pic_symbol_name(state->pic, sym));
+}
+
+/* the frame slot of variable sym of the scope */
+static int
+resolve_lref(resolver_state *state, resolver_scope *scope, pic_sym sym)
+{
+  return xh_get(scope->lvs, pic_symbol_name(state->pic, sym))->val;
+}
+
+/* the free variable of the scope for variable sym of the scope depth levels up */
+static int
+resolve_cref(resolver_state *state, resolver_scope *scope, int depth, pic_sym sym)
+{
+  pic_state *pic = state->pic;
+  const char *name = pic_symbol_name(pic, sym);
+  struct xh_entry *e;
+  unsigned i;
+
+  if ((e = xh_get(scope->cvs, name))) {
+    i = e->val;
+  }
+  else {
+    i = scope->cv_num++;
+    scope->cv_syms = (pic_sym *)pic_realloc(pic, scope->cv_syms, sizeof(pic_sym) * scope->cv_num);
+    scope->cv_depths = (int *)pic_realloc(pic, scope->cv_depths, sizeof(int) * scope->cv_num);
+    scope->cv_syms[i] = sym;
+    scope->cv_depths[i] = depth;
+    xh_put(scope->cvs, name, i);
+  }
+  return i;
+}
+
+static bool
+is_boxed(resolver_state *state, int depth, pic_sym sym)
+{
+  resolver_scope *scope = state->scope;
+
+  while (depth-- > 0) {
+    scope = scope->up;
+  }
+  return scope->boxed[xh_get(scope->lvs, pic_symbol_name(state->pic, sym))->val];
+}
+
+static struct pic_node *
+resolve_var(resolver_state *state, int depth, pic_sym sym)
+{
+  struct pic_node *ref;
+
+  if (depth == 0) {
+    ref = new_index(state->ir, NODE_LREF, resolve_lref(state, state->scope, sym));
+  } else {
+    ref = new_index(state->ir, NODE_CREF, resolve_cref(state, state->scope, depth, sym));
+  }
+  if (is_boxed(state, depth, sym)) {
+    ref = new_node(state->ir, NODE_UNBOX, 1, ref);
+  }
+  return ref;
+}
+
+static struct pic_node *resolve(resolver_state *, struct pic_node *);
+
+static struct pic_lambda *
+resolve_lambda(resolver_state *state, struct pic_lambda *lambda)
+{
+  pic_state *pic = state->pic;
+  struct pic_lambda *res;
+  pic_sym *syms;
+  int *depths, i, n;
+
+  res = alloc_lambda(state->ir);
+  *res = *lambda;
+
+  push_resolver_scope(state, lambda);
+  {
+    resolver_scope *scope = state->scope;
+
+    res->body = resolve(state, lambda->body);
+
+    res->boxes = (int *)pic_ir_alloc(state->ir, sizeof(int) * (scope->argc + scope->localc));
+    res->boxc = 0;
+    for (i = 1; i < scope->argc + scope->localc; ++i) {
+      if (scope->boxed[i]) {
+        res->boxes[res->boxc++] = i;
+      }
+    }
+
+    /* taken over, as the scope is gone when they are resolved */
+    syms = scope->cv_syms;
+    depths = scope->cv_depths;
+    n = scope->cv_num;
+    scope->cv_syms = NULL;
+    scope->cv_depths = NULL;
+  }
+  pop_resolver_scope(state);
+
+  /* where the closure finds its free variables in this frame */
+  res->captures = (int *)pic_ir_alloc(state->ir, sizeof(int) * n);
+  res->capc = n;
+  for (i = 0; i < n; ++i) {
+    if (depths[i] == 1) {
+      res->captures[i] = resolve_lref(state, state->scope, syms[i]);
+    } else {
+      res->captures[i] = ~resolve_cref(state, state->scope, depths[i] - 1, syms[i]);
+    }
+  }
+  pic_free(pic, syms);
+  pic_free(pic, depths);
+
+  return res;
+}
+
+static struct pic_node *
+resolve(resolver_state *state, struct pic_node *node)
+{
+  resolver_scope *scope = state->scope;
+  struct pic_node *res;
+  int i;
+
+  switch (node->type) {
+  case NODE_REF:
+    if (node->u.ref.depth == scope->depth) {
+      return new_index(state->ir, NODE_GREF, resolve_gref(state, node->u.ref.sym));
+    }
+    return resolve_var(state, node->u.ref.depth, node->u.ref.sym);
+  case NODE_SELF:
+    /* the procedure being called stays in the first slot of its frame */
+    return new_index(state->ir, NODE_LREF, 0);
+  case NODE_LAMBDA:
+    return new_lambda(state->ir, resolve_lambda(state, node->u.lambda));
+  case NODE_QUOTE:
+    return node;
+  default:
+    res = copy_shallow(state->ir, node);
+    for (i = 0; i < node->len; ++i) {
+      res->elts[i] = resolve(state, node->elts[i]);
+    }
+    return res;
+  }
+}
+
+static struct pic_node *
+pic_resolve(pic_state *pic, struct pic_ir *ir, struct pic_node *node)
+{
+  resolver_state *state;
+
+  state = new_resolver_state(pic, ir);
+
+  node = resolve(state, node);
+
+  destroy_resolver_state(state);
+  return node;
+}
+
+/**
  * scope object
  */
 
@@ -896,8 +2093,9 @@ typedef struct codegen_context {
   bool varg;
   /* rest args variable is counted by localc */
   int argc, localc;
-  /* closed variable table */
-  unsigned *cv_tbl, cv_num;
+  /* free variable table */
+  int *cv_tbl;
+  unsigned cv_num;
   /* actual bit code sequence */
   struct pic_code *code;
   size_t clen, ccapa;
@@ -907,6 +2105,9 @@ typedef struct codegen_context {
   /* constant object pool */
   pic_value *pool;
   size_t plen, pcapa;
+  /* inline caches of global calls, until they are moved after the code */
+  struct pic_callcache *cc;
+  size_t cclen, cccapa;
 
   struct codegen_context *up;
 } codegen_context;
@@ -918,12 +2119,9 @@ typedef struct codegen_context {
 typedef struct codegen_state {
   pic_state *pic;
   codegen_context *cxt;
-  pic_sym sGREF, sCREF, sLREF;
-  pic_sym sCALL, sTAILCALL;
-  unsigned *cv_tbl, cv_num;
 } codegen_state;
 
-static void push_codegen_context(codegen_state *, pic_value, pic_value, bool, pic_value);
+static void push_codegen_context(codegen_state *, struct pic_lambda *);
 static struct pic_irep *pop_codegen_context(codegen_state *);
 
 static codegen_state *
@@ -935,13 +2133,7 @@ new_codegen_state(pic_state *pic)
   state->pic = pic;
   state->cxt = NULL;
 
-  register_symbol(pic, state, sCALL, "call");
-  register_symbol(pic, state, sTAILCALL, "tail-call");
-  register_symbol(pic, state, sGREF, "gref");
-  register_symbol(pic, state, sLREF, "lref");
-  register_symbol(pic, state, sCREF, "cref");
-
-  push_codegen_context(state, pic_nil_value(), pic_nil_value(), false, pic_nil_value());
+  push_codegen_context(state, NULL);
 
   return state;
 }
@@ -958,39 +2150,25 @@ destroy_codegen_state(codegen_state *state)
   return irep;
 }
 
+/* lambda is NULL for the toplevel */
 static void
-push_codegen_context(codegen_state *state, pic_value args, pic_value locals, bool varg, pic_value closes)
+push_codegen_context(codegen_state *state, struct pic_lambda *lambda)
 {
   pic_state *pic = state->pic;
   codegen_context *cxt;
-  int i, c;
-  struct xhash *vars;
 
   cxt = (codegen_context *)pic_alloc(pic, sizeof(codegen_context));
   cxt->up = state->cxt;
-  cxt->argc = pic_length(pic, args) + 1;
-  cxt->localc = pic_length(pic, locals);
-  cxt->varg = varg;
+  cxt->argc = lambda ? lambda->argc + 1 : 1;
+  cxt->localc = lambda ? lambda->localc : 0;
+  cxt->varg = lambda ? lambda->varg : false;
 
-  /* number local variables */
-  vars = xh_new();
-  for (i = 1; i < cxt->argc; ++i) {
-    xh_put(vars, pic_symbol_name(pic, pic_sym(pic_list_ref(pic, args, i - 1))), i);
+  /* free variables, as resolved in the parent */
+  cxt->cv_num = lambda ? lambda->capc : 0;
+  cxt->cv_tbl = (int *)pic_calloc(pic, cxt->cv_num, sizeof(int));
+  if (cxt->cv_num > 0) {
+    memcpy(cxt->cv_tbl, lambda->captures, sizeof(int) * cxt->cv_num);
   }
-  for (i = 0; i < cxt->localc; ++i) {
-    xh_put(vars, pic_symbol_name(pic, pic_sym(pic_list_ref(pic, locals, i))), cxt->argc + i);
-  }
-
-  /* closed variables */
-  cxt->cv_tbl = NULL;
-  cxt->cv_num = 0;
-  for (i = 0, c = pic_length(pic, closes); i < c; ++i) {
-    i = cxt->cv_num++;
-    cxt->cv_tbl = (unsigned *)pic_realloc(pic, cxt->cv_tbl, sizeof(unsigned) * cxt->cv_num);
-    cxt->cv_tbl[i] = xh_get(vars, pic_symbol_name(pic, pic_sym(pic_list_ref(pic, closes, i))))->val;
-  }
-
-  xh_destroy(vars);
 
   cxt->code = (struct pic_code *)pic_calloc(pic, PIC_ISEQ_SIZE, sizeof(struct pic_code));
   cxt->clen = 0;
@@ -1004,6 +2182,10 @@ push_codegen_context(codegen_state *state, pic_value args, pic_value locals, boo
   cxt->plen = 0;
   cxt->pcapa = PIC_POOL_SIZE;
 
+  cxt->cc = (struct pic_callcache *)pic_calloc(pic, PIC_CALLCACHE_SIZE, sizeof(struct pic_callcache));
+  cxt->cclen = 0;
+  cxt->cccapa = PIC_CALLCACHE_SIZE;
+
   state->cxt = cxt;
 }
 
@@ -1013,6 +2195,7 @@ pop_codegen_context(codegen_state *state)
   pic_state *pic = state->pic;
   codegen_context *cxt = state->cxt;
   struct pic_irep *irep;
+  size_t i;
 
   /* create irep */
   irep = (struct pic_irep *)pic_obj_alloc(pic, sizeof(struct pic_irep), PIC_TT_IREP);
@@ -1021,12 +2204,29 @@ pop_codegen_context(codegen_state *state)
   irep->localc = state->cxt->localc;
   irep->cv_tbl = state->cxt->cv_tbl;
   irep->cv_num = state->cxt->cv_num;
-  irep->code = pic_realloc(pic, state->cxt->code, sizeof(struct pic_code) * state->cxt->clen);
+#if PIC_ENABLE_JIT
+  irep->ncall = 0;
+  irep->jit = NULL;
+#endif
+  irep->code = pic_realloc(pic, state->cxt->code, sizeof(struct pic_code) * (state->cxt->clen + PIC_CALLCACHE_SLOTS * state->cxt->cclen));
   irep->clen = state->cxt->clen;
   irep->irep = pic_realloc(pic, state->cxt->irep, sizeof(struct pic_irep *) * state->cxt->ilen);
   irep->ilen = state->cxt->ilen;
   irep->pool = pic_realloc(pic, state->cxt->pool, sizeof(pic_value) * state->cxt->plen);
   irep->plen = state->cxt->plen;
+  irep->cclen = state->cxt->cclen;
+
+  /* lay out the inline caches after the code, and point the calls to them */
+  for (i = 0; i < irep->cclen; ++i) {
+    *pic_irep_callcache(irep, i) = state->cxt->cc[i];
+    pic_irep_callcache(irep, i)->irep = irep;
+  }
+  for (i = 0; i < irep->clen; ++i) {
+    if (irep->code[i].insn == OP_GCALL || irep->code[i].insn == OP_GTAILCALL) {
+      irep->code[i].u.i = irep->clen - i + irep->code[i].u.i * PIC_CALLCACHE_SLOTS;
+    }
+  }
+  pic_free(pic, state->cxt->cc);
 
   /* destroy context */
   cxt = cxt->up;
@@ -1036,113 +2236,190 @@ pop_codegen_context(codegen_state *state)
   return irep;
 }
 
-static struct pic_irep *codegen_lambda(codegen_state *, pic_value);
+
+static struct pic_irep *codegen_lambda(codegen_state *, struct pic_lambda *);
+
+static int
+add_const(codegen_state *state, pic_value obj)
+{
+  codegen_context *cxt = state->cxt;
+
+  if (cxt->plen >= cxt->pcapa) {
+    cxt->pcapa *= 2;
+    cxt->pool = (pic_value *)pic_realloc(state->pic, cxt->pool, sizeof(pic_value) * cxt->pcapa);
+  }
+  cxt->pool[cxt->plen] = obj;
+  return cxt->plen++;
+}
+
+static int
+add_irep(codegen_state *state, struct pic_lambda *lambda)
+{
+  codegen_context *cxt = state->cxt;
+  int k;
+
+  if (cxt->ilen >= cxt->icapa) {
+    cxt->icapa *= 2;
+    cxt->irep = (struct pic_irep **)pic_realloc(state->pic, cxt->irep, sizeof(struct pic_irep *) * cxt->icapa);
+  }
+  k = cxt->ilen++;
+  cxt->irep[k] = codegen_lambda(state, lambda);
+  return k;
+}
+
+static int
+add_callcache(codegen_state *state, int argc)
+{
+  codegen_context *cxt = state->cxt;
+
+  if (cxt->cclen >= cxt->cccapa) {
+    cxt->cccapa *= 2;
+    cxt->cc = (struct pic_callcache *)pic_realloc(state->pic, cxt->cc, sizeof(struct pic_callcache) * cxt->cccapa);
+  }
+  cxt->cc[cxt->cclen].proc = NULL;
+  cxt->cc[cxt->cclen].argc = argc;
+  return cxt->cclen++;
+}
+
+/* room for the instructions a node emits around those of its children */
+#define CODEGEN_MARGIN 16
+
+static void
+reserve_code(codegen_state *state)
+{
+  codegen_context *cxt = state->cxt;
+
+  if (cxt->clen + CODEGEN_MARGIN >= cxt->ccapa) {
+    cxt->ccapa *= 2;
+    cxt->code = (struct pic_code *)pic_realloc(state->pic, cxt->code, sizeof(struct pic_code) * cxt->ccapa);
+  }
+}
+
+static void codegen_node(codegen_state *, struct pic_node *);
+
+static void
+codegen(codegen_state *state, struct pic_node *node)
+{
+  reserve_code(state);
+  codegen_node(state, node);
+  reserve_code(state);
+}
+
+static const enum pic_opcode binops[] = {
+  [NODE_CONS] = OP_CONS,
+  [NODE_ADD] = OP_ADD,
+  [NODE_SUB] = OP_SUB,
+  [NODE_MUL] = OP_MUL,
+  [NODE_DIV] = OP_DIV,
+  [NODE_EQ] = OP_EQ,
+  [NODE_LT] = OP_LT,
+  [NODE_LE] = OP_LE,
+  /* the operands swapped */
+  [NODE_GT] = OP_LT,
+  [NODE_GE] = OP_LE
+};
+
+static const enum pic_opcode unops[] = {
+  [NODE_CAR] = OP_CAR,
+  [NODE_CDR] = OP_CDR,
+  [NODE_NILP] = OP_NILP,
+  [NODE_MINUS] = OP_MINUS
+};
 
 static void
-codegen(codegen_state *state, pic_value obj)
+codegen_node(codegen_state *state, struct pic_node *node)
 {
   pic_state *pic = state->pic;
   codegen_context *cxt = state->cxt;
-  pic_sym sym;
+  struct pic_node *var, *call;
+  pic_value obj;
+  int i, s, t;
 
-  sym = pic_sym(pic_car(pic, obj));
-  if (sym == state->sGREF) {
+  switch (node->type) {
+  case NODE_GREF:
     cxt->code[cxt->clen].insn = OP_GREF;
-    cxt->code[cxt->clen].u.i = pic_int(pic_list_ref(pic, obj, 1));
+    cxt->code[cxt->clen].u.i = node->u.i;
     cxt->clen++;
     return;
-  } else if (sym == state->sCREF) {
+  case NODE_CREF:
     cxt->code[cxt->clen].insn = OP_CREF;
-    cxt->code[cxt->clen].u.r.depth = pic_int(pic_list_ref(pic, obj, 1));
-    cxt->code[cxt->clen].u.r.idx = pic_int(pic_list_ref(pic, obj, 2));
+    cxt->code[cxt->clen].u.i = node->u.i;
     cxt->clen++;
     return;
-  } else if (sym == state->sLREF) {
+  case NODE_LREF:
     cxt->code[cxt->clen].insn = OP_LREF;
-    cxt->code[cxt->clen].u.i = pic_int(pic_list_ref(pic, obj, 1));
+    cxt->code[cxt->clen].u.i = node->u.i;
     cxt->clen++;
     return;
-  } else if (sym == pic->sSETBANG) {
-    pic_value var, val;
-    pic_sym type;
-
-    val = pic_list_ref(pic, obj, 2);
-    codegen(state, val);
+  case NODE_UNBOX:
+    codegen(state, node->elts[0]);
+    cxt->code[cxt->clen].insn = OP_UNBOX;
+    cxt->clen++;
+    return;
+  case NODE_SETBANG:
+    codegen(state, node->elts[1]);
 
-    var = pic_list_ref(pic, obj, 1);
-    type = pic_sym(pic_list_ref(pic, var, 0));
-    if (type == state->sGREF) {
+    var = node->elts[0];
+    switch (var->type) {
+    case NODE_GREF:
       cxt->code[cxt->clen].insn = OP_GSET;
-      cxt->code[cxt->clen].u.i = pic_int(pic_list_ref(pic, var, 1));
-      cxt->clen++;
-      cxt->code[cxt->clen].insn = OP_PUSHNONE;
-      cxt->clen++;
-      return;
-    }
-    else if (type == state->sCREF) {
-      cxt->code[cxt->clen].insn = OP_CSET;
-      cxt->code[cxt->clen].u.r.depth = pic_int(pic_list_ref(pic, var, 1));
-      cxt->code[cxt->clen].u.r.idx = pic_int(pic_list_ref(pic, var, 2));
+      cxt->code[cxt->clen].u.i = var->u.i;
       cxt->clen++;
-      cxt->code[cxt->clen].insn = OP_PUSHNONE;
+      break;
+    case NODE_UNBOX:
+      codegen(state, var->elts[0]);
+      cxt->code[cxt->clen].insn = OP_SETBOX;
       cxt->clen++;
-      return;
-    }
-    else if (type == state->sLREF) {
+      break;
+    case NODE_LREF:
       cxt->code[cxt->clen].insn = OP_LSET;
-      cxt->code[cxt->clen].u.i = pic_int(pic_list_ref(pic, var, 1));
+      cxt->code[cxt->clen].u.i = var->u.i;
       cxt->clen++;
-      cxt->code[cxt->clen].insn = OP_PUSHNONE;
-      cxt->clen++;
-      return;
-    }
-  }
-  else if (sym == pic->sLAMBDA) {
-    int k;
-
-    if (cxt->ilen >= cxt->icapa) {
-      cxt->icapa *= 2;
-      cxt->irep = (struct pic_irep **)pic_realloc(pic, cxt->irep, sizeof(struct pic_irep *) * cxt->icapa);
+      break;
+    default:
+      pic_error(pic, "codegen: unknown AST type");
     }
-    k = cxt->ilen++;
-    cxt->code[cxt->clen].insn = OP_LAMBDA;
-    cxt->code[cxt->clen].u.i = k;
+    cxt->code[cxt->clen].insn = OP_PUSHNONE;
     cxt->clen++;
-
-    cxt->irep[k] = codegen_lambda(state, obj);
     return;
-  }
-  else if (sym == pic->sIF) {
-    int s, t;
-
-    codegen(state, pic_list_ref(pic, obj, 1));
+  case NODE_LAMBDA:
+    cxt->code[cxt->clen].insn = OP_LAMBDA;
+    s = cxt->clen++;
+    cxt->code[s].u.i = add_irep(state, node->u.lambda);
+    return;
+  case NODE_IF:
+    codegen(state, node->elts[0]);
 
     cxt->code[cxt->clen].insn = OP_JMPIF;
     s = cxt->clen++;
 
     /* if false branch */
-    codegen(state, pic_list_ref(pic, obj, 3));
+    codegen(state, node->elts[2]);
     cxt->code[cxt->clen].insn = OP_JMP;
     t = cxt->clen++;
 
     cxt->code[s].u.i = cxt->clen - s;
 
     /* if true branch */
-    codegen(state, pic_list_ref(pic, obj, 2));
+    codegen(state, node->elts[1]);
     cxt->code[t].u.i = cxt->clen - t;
     return;
-  }
-  else if (sym == pic->sBEGIN) {
-    pic_value elt;
-    pic_for_each (elt, pic_cdr(pic, obj)) {
-      codegen(state, elt);
+  case NODE_BEGIN:
+    for (i = 0; i < node->len - 1; ++i) {
+      codegen(state, node->elts[i]);
+
+      /* a begin may be an argument, so only its last value stays */
+      if (node->elts[i]->type == NODE_SETBANG) {
+        cxt->clen--;            /* the unspecified value pushed last */
+      } else {
+        cxt->code[cxt->clen].insn = OP_POP;
+        cxt->clen++;
+      }
     }
+    codegen(state, node->elts[i]);
     return;
-  }
-  else if (sym == pic->sQUOTE) {
-    int pidx;
-
-    obj = pic_list_ref(pic, obj, 1);
+  case NODE_QUOTE:
+    obj = node->u.value;
     switch (pic_type(obj)) {
     case PIC_TT_BOOL:
       if (pic_true_p(obj)) {
@@ -1167,145 +2444,98 @@ codegen(codegen_state *state, pic_value obj)
       cxt->clen++;
       return;
     default:
-      if (cxt->plen >= cxt->pcapa) {
-        cxt->pcapa *= 2;
-        cxt->pool = (pic_value *)pic_realloc(pic, cxt->pool, sizeof(pic_value) * cxt->pcapa);
-      }
-      pidx = cxt->plen++;
-      cxt->pool[pidx] = obj;
       cxt->code[cxt->clen].insn = OP_PUSHCONST;
-      cxt->code[cxt->clen].u.i = pidx;
-      cxt->clen++;
+      s = cxt->clen++;
+      cxt->code[s].u.i = add_const(state, obj);
       return;
     }
-  }
-  else if (sym == pic->sCONS) {
-    codegen(state, pic_list_ref(pic, obj, 1));
-    codegen(state, pic_list_ref(pic, obj, 2));
-    cxt->code[cxt->clen].insn = OP_CONS;
-    cxt->clen++;
-    return;
-  }
-  else if (sym == pic->sCAR) {
-    codegen(state, pic_list_ref(pic, obj, 1));
-    cxt->code[cxt->clen].insn = OP_CAR;
-    cxt->clen++;
-    return;
-  }
-  else if (sym == pic->sCDR) {
-    codegen(state, pic_list_ref(pic, obj, 1));
-    cxt->code[cxt->clen].insn = OP_CDR;
-    cxt->clen++;
-    return;
-  }
-  else if (sym == pic->sNILP) {
-    codegen(state, pic_list_ref(pic, obj, 1));
-    cxt->code[cxt->clen].insn = OP_NILP;
-    cxt->clen++;
-    return;
-  }
-  else if (sym == pic->sADD) {
-    codegen(state, pic_list_ref(pic, obj, 1));
-    codegen(state, pic_list_ref(pic, obj, 2));
-    cxt->code[cxt->clen].insn = OP_ADD;
-    cxt->clen++;
-    return;
-  }
-  else if (sym == pic->sSUB) {
-    codegen(state, pic_list_ref(pic, obj, 1));
-    codegen(state, pic_list_ref(pic, obj, 2));
-    cxt->code[cxt->clen].insn = OP_SUB;
-    cxt->clen++;
-    return;
-  }
-  else if (sym == pic->sMUL) {
-    codegen(state, pic_list_ref(pic, obj, 1));
-    codegen(state, pic_list_ref(pic, obj, 2));
-    cxt->code[cxt->clen].insn = OP_MUL;
-    cxt->clen++;
-    return;
-  }
-  else if (sym == pic->sDIV) {
-    codegen(state, pic_list_ref(pic, obj, 1));
-    codegen(state, pic_list_ref(pic, obj, 2));
-    cxt->code[cxt->clen].insn = OP_DIV;
-    cxt->clen++;
-    return;
-  }
-  else if (sym == pic->sMINUS) {
-    codegen(state, pic_list_ref(pic, obj, 1));
-    cxt->code[cxt->clen].insn = OP_MINUS;
+  case NODE_CAR:
+  case NODE_CDR:
+  case NODE_NILP:
+  case NODE_MINUS:
+    codegen(state, node->elts[0]);
+    cxt->code[cxt->clen].insn = unops[node->type];
     cxt->clen++;
     return;
-  }
-  else if (sym == pic->sEQ) {
-    codegen(state, pic_list_ref(pic, obj, 1));
-    codegen(state, pic_list_ref(pic, obj, 2));
-    cxt->code[cxt->clen].insn = OP_EQ;
+  case NODE_CONS:
+  case NODE_ADD:
+  case NODE_SUB:
+  case NODE_MUL:
+  case NODE_DIV:
+  case NODE_EQ:
+  case NODE_LT:
+  case NODE_LE:
+    codegen(state, node->elts[0]);
+    codegen(state, node->elts[1]);
+    cxt->code[cxt->clen].insn = binops[node->type];
     cxt->clen++;
     return;
-  }
-  else if (sym == pic->sLT) {
-    codegen(state, pic_list_ref(pic, obj, 1));
-    codegen(state, pic_list_ref(pic, obj, 2));
-    cxt->code[cxt->clen].insn = OP_LT;
+  case NODE_GT:
+  case NODE_GE:
+    codegen(state, node->elts[1]);
+    codegen(state, node->elts[0]);
+    cxt->code[cxt->clen].insn = binops[node->type];
     cxt->clen++;
     return;
-  }
-  else if (sym == pic->sLE) {
-    codegen(state, pic_list_ref(pic, obj, 1));
-    codegen(state, pic_list_ref(pic, obj, 2));
-    cxt->code[cxt->clen].insn = OP_LE;
+  case NODE_CALL:
+  case NODE_TAILCALL:
+    for (i = 0; i < node->len; ++i) {
+      codegen(state, node->elts[i]);
+    }
+    if (node->elts[0]->type == NODE_GREF) {
+      cxt->code[cxt->clen].insn = (node->type == NODE_CALL) ? OP_GCALL : OP_GTAILCALL;
+      cxt->code[cxt->clen].u.i = add_callcache(state, node->len);
+    }
+    else {
+      cxt->code[cxt->clen].insn = (node->type == NODE_CALL) ? OP_CALL : OP_TAILCALL;
+      cxt->code[cxt->clen].u.i = node->len;
+    }
     cxt->clen++;
     return;
-  }
-  else if (sym == pic->sGT) {
-    codegen(state, pic_list_ref(pic, obj, 2));
-    codegen(state, pic_list_ref(pic, obj, 1));
-    cxt->code[cxt->clen].insn = OP_LT;
+  case NODE_VALUES:
+    call = node->elts[0];
+    for (i = 1; i < call->len; ++i) {
+      codegen(state, call->elts[i]);
+    }
+    cxt->code[cxt->clen].insn = OP_VALUES;
+    cxt->code[cxt->clen].u.i = call->len - 1;
     cxt->clen++;
     return;
-  }
-  else if (sym == pic->sGE) {
-    codegen(state, pic_list_ref(pic, obj, 2));
-    codegen(state, pic_list_ref(pic, obj, 1));
-    cxt->code[cxt->clen].insn = OP_LE;
+  case NODE_CALL_WITH_VALUES:
+    call = node->elts[0];
+
+    /* the values of the producer land right above the consumer */
+    codegen(state, call->elts[2]);
+    codegen(state, call->elts[1]);
+    cxt->code[cxt->clen].insn = OP_CALL;
+    cxt->code[cxt->clen].u.i = 1;
     cxt->clen++;
-    return;
-  }
-  else if (sym == state->sCALL || sym == state->sTAILCALL) {
-    int len = pic_length(pic, obj);
-    pic_value elt;
-
-    pic_for_each (elt, pic_cdr(pic, obj)) {
-      codegen(state, elt);
-    }
-    cxt->code[cxt->clen].insn = (sym == state->sCALL) ? OP_CALL : OP_TAILCALL;
-    cxt->code[cxt->clen].u.i = len - 1;
+    cxt->code[cxt->clen].insn = (call->type == NODE_CALL) ? OP_CALLV : OP_TAILCALLV;
     cxt->clen++;
     return;
+  default:
+    pic_error(pic, "codegen: unknown AST type");
   }
-  pic_error(pic, "codegen: unknown AST type");
 }
 
 static struct pic_irep *
-codegen_lambda(codegen_state *state, pic_value obj)
+codegen_lambda(codegen_state *state, struct pic_lambda *lambda)
 {
-  pic_state *pic = state->pic;
-  pic_value args, locals, closes, body;
-  bool varg;
-
-  args = pic_list_ref(pic, obj, 1);
-  locals = pic_list_ref(pic, obj, 2);
-  varg = pic_true_p(pic_list_ref(pic, obj, 3));
-  closes = pic_list_ref(pic, obj, 4);
-  body = pic_list_ref(pic, obj, 5);
+  int i;
 
   /* inner environment */
-  push_codegen_context(state, args, locals, varg, closes);
+  push_codegen_context(state, lambda);
   {
+    reserve_code(state);
+    for (i = 0; i < lambda->boxc; ++i) {
+      state->cxt->code[state->cxt->clen].insn = OP_BOX;
+      state->cxt->code[state->cxt->clen].u.i = lambda->boxes[i];
+      state->cxt->clen++;
+      reserve_code(state);
+    }
+
     /* body */
-    codegen(state, body);
+    codegen(state, lambda->body);
     state->cxt->code[state->cxt->clen].insn = OP_RET;
     state->cxt->clen++;
   }
@@ -1313,29 +2543,165 @@ codegen_lambda(codegen_state *state, pic_value obj)
 }
 
 struct pic_irep *
-pic_codegen(pic_state *pic, pic_value obj)
+pic_codegen(pic_state *pic, struct pic_node *node)
 {
   codegen_state *state;
 
   state = new_codegen_state(pic);
 
-  codegen(state, obj);
+  codegen(state, node);
   state->cxt->code[state->cxt->clen].insn = OP_RET;
   state->cxt->clen++;
 
   return destroy_codegen_state(state);
 }
 
-struct pic_proc *
-pic_compile(pic_state *pic, pic_value obj)
+/* the original instructions stay behind the fused one as its slow path */
+static const struct {
+  int len;
+  enum pic_opcode seq[3], insn;
+} superinsns[] = {
+  { 3, { OP_LREF, OP_PUSHINT, OP_ADD }, OP_LREFADDI },
+  { 3, { OP_LREF, OP_PUSHINT, OP_SUB }, OP_LREFSUBI },
+  { 2, { OP_EQ, OP_JMPIF }, OP_EQJMPIF },
+  { 2, { OP_LT, OP_JMPIF }, OP_LTJMPIF },
+  { 2, { OP_LE, OP_JMPIF }, OP_LEJMPIF },
+  { 2, { OP_LREF, OP_LREF }, OP_LREF2 },
+};
+
+static void
+peephole(pic_state *pic, struct pic_irep *irep)
+{
+  struct pic_code *code = irep->code;
+  bool *target;
+  size_t i, j, k, t;
+
+  /* jump threading: a jump to a return is a return */
+  for (i = 0; i < irep->clen; ++i) {
+    if (code[i].insn == OP_JMP) {
+      for (t = i + code[i].u.i, j = 0; code[t].insn == OP_JMP && j < irep->clen; ++j) {
+        t += code[t].u.i;
+      }
+      if (code[t].insn == OP_RET) {
+        code[i].insn = OP_RET;
+      }
+    }
+  }
+
+  target = (bool *)pic_calloc(pic, irep->clen + 1, sizeof(bool));
+  for (i = 0; i < irep->clen; ++i) {
+    if (code[i].insn == OP_JMP || code[i].insn == OP_JMPIF) {
+      target[i + code[i].u.i] = true;
+    }
+  }
+
+  for (i = 0; i < irep->clen; ) {
+    for (k = 0; k < sizeof superinsns / sizeof superinsns[0]; ++k) {
+      if (i + superinsns[k].len > irep->clen)
+        continue;
+      for (j = 0; j < (size_t)superinsns[k].len; ++j) {
+        if (code[i + j].insn != superinsns[k].seq[j] || (j > 0 && target[i + j]))
+          break;
+      }
+      if (j == (size_t)superinsns[k].len)
+        break;
+    }
+    if (k < sizeof superinsns / sizeof superinsns[0]) {
+      code[i].insn = superinsns[k].insn;
+      i += superinsns[k].len;
+    }
+    else {
+      i++;
+    }
+  }
+
+  pic_free(pic, target);
+
+  for (i = 0; i < irep->ilen; ++i) {
+    peephole(pic, irep->irep[i]);
+  }
+}
+
+
+#if DEBUG
+
+static const char *node_names[] = {
+  "quote", "ref", "self", "gref", "lref", "cref", "unbox", "set!", "lambda",
+  "if", "begin", "call", "tail-call", "values", "call-with-values",
+  "cons", "car", "cdr", "null?", "+", "-", "*", "/", "minus",
+  "=", "<", "<=", ">", ">="
+};
+
+static void
+dump_node(pic_state *pic, struct pic_node *node)
+{
+  struct pic_lambda *lambda;
+  int i;
+
+  printf("(%s", node_names[node->type]);
+  switch (node->type) {
+  case NODE_QUOTE:
+    printf(" ");
+    pic_debug(pic, node->u.value);
+    break;
+  case NODE_REF:
+    printf(" %d %s", node->u.ref.depth, pic_symbol_name(pic, node->u.ref.sym));
+    break;
+  case NODE_GREF:
+  case NODE_LREF:
+  case NODE_CREF:
+    printf(" %d", node->u.i);
+    break;
+  case NODE_LAMBDA:
+    lambda = node->u.lambda;
+    printf(" (");
+    for (i = 0; i < lambda->argc; ++i) {
+      printf(i ? " %s" : "%s", pic_symbol_name(pic, lambda->args[i]));
+    }
+    printf(") (");
+    for (i = 0; i < lambda->localc; ++i) {
+      printf(i ? " %s" : "%s", pic_symbol_name(pic, lambda->locals[i]));
+    }
+    printf(") %s (", lambda->varg ? "#t" : "#f");
+    for (i = 0; i < lambda->closec; ++i) {
+      printf(i ? " %s" : "%s", pic_symbol_name(pic, lambda->closes[i]));
+    }
+    printf(") (");
+    for (i = 0; i < lambda->boxc; ++i) {
+      printf(i ? " %d" : "%d", lambda->boxes[i]);
+    }
+    printf(") (");
+    for (i = 0; i < lambda->capc; ++i) {
+      printf(i ? " %d" : "%d", lambda->captures[i]);
+    }
+    printf(") ");
+    dump_node(pic, lambda->body);
+    break;
+  default:
+    break;
+  }
+  for (i = 0; i < node->len; ++i) {
+    printf(" ");
+    dump_node(pic, node->elts[i]);
+  }
+  printf(")");
+}
+
+#endif
+
+static struct pic_proc *
+compile(pic_state *pic, pic_value obj, bool expanded)
 {
   struct pic_proc *proc;
   struct pic_irep *irep;
+  struct pic_ir *ir;
+  struct pic_node *node;
   jmp_buf jmp, *prev_jmp = pic->jmp;
   int ai = pic_gc_arena_preserve(pic);
 
+  ir = pic_ir_new(pic);
 
-  if (setjmp(jmp) == 0) {
+  if (PIC_SETJMP(jmp) == 0) {
     pic->jmp = &jmp;
   }
   else {
@@ -1355,37 +2721,58 @@ pic_compile(pic_state *pic, pic_value obj)
 #endif
 
   /* macroexpand */
-  obj = pic_macroexpand(pic, obj);
+  if (! expanded) {
+    obj = pic_macroexpand(pic, obj);
 #if DEBUG
-  fprintf(stderr, "## macroexpand completed\n");
-  pic_debug(pic, obj);
-  fprintf(stderr, "\n");
-  fprintf(stderr, "ai = %d\n", pic_gc_arena_preserve(pic));
+    fprintf(stderr, "## macroexpand completed\n");
+    pic_debug(pic, obj);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "ai = %d\n", pic_gc_arena_preserve(pic));
 #endif
+  }
+
+  /* the constants of the nodes point into the expanded program */
+  pic_gc_protect(pic, obj);
 
   /* analyze */
-  obj = pic_analyze(pic, obj);
+  node = pic_analyze(pic, ir, obj);
 #if DEBUG
   fprintf(stderr, "## analyzer completed\n");
-  pic_debug(pic, obj);
+  dump_node(pic, node);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "ai = %d\n", pic_gc_arena_preserve(pic));
+#endif
+
+  /* optimization */
+  node = pic_optimize(pic, ir, node);
+#if DEBUG
+  fprintf(stderr, "## optimizer completed\n");
+  dump_node(pic, node);
   fprintf(stderr, "\n");
   fprintf(stderr, "ai = %d\n", pic_gc_arena_preserve(pic));
 #endif
 
   /* resolution */
-  obj = pic_resolve(pic, obj);
+  node = pic_resolve(pic, ir, node);
 #if DEBUG
   fprintf(stderr, "## resolver completed\n");
-  pic_debug(pic, obj);
+  dump_node(pic, node);
   fprintf(stderr, "\n");
   fprintf(stderr, "ai = %d\n", pic_gc_arena_preserve(pic));
 #endif
 
   /* codegen */
-  irep = pic_codegen(pic, obj);
+  irep = pic_codegen(pic, node);
 #if DEBUG
   fprintf(stderr, "## codegen completed\n");
   pic_dump_irep(pic, irep);
+#endif
+
+  /* peephole */
+  peephole(pic, irep);
+#if DEBUG
+  fprintf(stderr, "## peephole completed\n");
+  pic_dump_irep(pic, irep);
 
   fprintf(stderr, "## compilation finished\n");
   puts("");
@@ -1399,6 +2786,7 @@ pic_compile(pic_state *pic, pic_value obj)
 
  exit:
   pic->jmp = prev_jmp;
+  pic_ir_free(ir);
 
   pic_gc_arena_restore(pic, ai);
   pic_gc_protect(pic, pic_obj_value(proc));
@@ -1406,6 +2794,18 @@ pic_compile(pic_state *pic, pic_value obj)
   return proc;
 }
 
+struct pic_proc *
+pic_compile(pic_state *pic, pic_value obj)
+{
+  return compile(pic, obj, false);
+}
+
+struct pic_proc *
+pic_compile_expanded(pic_state *pic, pic_value obj)
+{
+  return compile(pic, obj, true);
+}
+
 static int
 scope_global_define(pic_state *pic, const char *name)
 {
@@ -1419,6 +2819,7 @@ scope_global_define(pic_state *pic, const char *name)
   if (pic->glen >= pic->gcapa) {
     pic_error(pic, "global table overflow");
   }
+  pic->global_names[e->val] = e->key;
   return e->val;
 }
 
@@ -1515,10 +2916,16 @@ print_code(pic_state *pic, struct pic_code c)
     printf("OP_LSET\t%d\n", c.u.i);
     break;
   case OP_CREF:
-    printf("OP_CREF\t%d\t%d\n", c.u.r.depth, c.u.r.idx);
+    printf("OP_CREF\t%d\n", c.u.i);
+    break;
+  case OP_BOX:
+    printf("OP_BOX\t%d\n", c.u.i);
+    break;
+  case OP_UNBOX:
+    puts("OP_UNBOX");
     break;
-  case OP_CSET:
-    printf("OP_CSET\t%d\t%d\n", c.u.r.depth, c.u.r.idx);
+  case OP_SETBOX:
+    puts("OP_SETBOX");
     break;
   case OP_JMP:
     printf("OP_JMP\t%d\n", c.u.i);
@@ -1532,9 +2939,24 @@ print_code(pic_state *pic, struct pic_code c)
   case OP_TAILCALL:
     printf("OP_TAILCALL\t%d\n", c.u.i);
     break;
+  case OP_GCALL:
+    printf("OP_GCALL\t%d\n", c.u.i);
+    break;
+  case OP_GTAILCALL:
+    printf("OP_GTAILCALL\t%d\n", c.u.i);
+    break;
+  case OP_CALLV:
+    puts("OP_CALLV");
+    break;
+  case OP_TAILCALLV:
+    puts("OP_TAILCALLV");
+    break;
   case OP_RET:
     puts("OP_RET");
     break;
+  case OP_VALUES:
+    printf("OP_VALUES\t%d\n", c.u.i);
+    break;
   case OP_LAMBDA:
     printf("OP_LAMBDA\t%d\n", c.u.i);
     break;
@@ -1574,6 +2996,24 @@ print_code(pic_state *pic, struct pic_code c)
   case OP_LE:
     puts("OP_LE");
     break;
+  case OP_LREF2:
+    printf("OP_LREF2\t%d\n", c.u.i);
+    break;
+  case OP_LREFADDI:
+    printf("OP_LREFADDI\t%d\n", c.u.i);
+    break;
+  case OP_LREFSUBI:
+    printf("OP_LREFSUBI\t%d\n", c.u.i);
+    break;
+  case OP_EQJMPIF:
+    puts("OP_EQJMPIF");
+    break;
+  case OP_LTJMPIF:
+    puts("OP_LTJMPIF");
+    break;
+  case OP_LEJMPIF:
+    puts("OP_LEJMPIF");
+    break;
   case OP_STOP:
     puts("OP_STOP");
     break;
@@ -1589,7 +3029,11 @@ pic_dump_irep(pic_state *pic, struct pic_irep *irep)
   printf("[clen = %zd, argc = %d, localc = %d]\n", irep->clen, irep->argc, irep->localc);
   printf(":: cv_num = %d\n", irep->cv_num);
   for (i = 0; i < irep->cv_num; ++i) {
-    printf(": %d -> %d\n", irep->cv_tbl[i], i);
+    if (irep->cv_tbl[i] >= 0) {
+      printf(": %d -> %d\n", irep->cv_tbl[i], i);
+    } else {
+      printf(": cv %d -> %d\n", ~irep->cv_tbl[i], i);
+    }
   }
   for (i = 0; i < irep->clen; ++i) {
     print_code(pic, irep->code[i]);
@@ -26,6 +26,19 @@ native_stack_length(pic_state *pic, pic_value **pos)
     : (size_t)(&t - pic->native_stack_start + 1);
 }
 
+/* the VM stack moves when it grows, so saved frames point into the copy */
+static void
+rebase_frames(pic_callinfo *ci, size_t n, pic_value *from, pic_value *to)
+{
+  size_t i;
+
+  for (i = 0; i <= n; ++i) {
+    if (ci[i].fp != NULL) {
+      ci[i].fp = to + (ci[i].fp - from);
+    }
+  }
+}
+
 static void
 save_cont(pic_state *pic, struct pic_cont **c)
 {
@@ -51,6 +64,7 @@ save_cont(pic_state *pic, struct pic_cont **c)
   cont->ci_len = pic->ciend - pic->cibase;
   cont->ci_ptr = (pic_callinfo *)pic_alloc(pic, sizeof(pic_callinfo) * cont->ci_len);
   memcpy(cont->ci_ptr, pic->cibase, sizeof(pic_callinfo) * cont->ci_len);
+  rebase_frames(cont->ci_ptr, cont->ci_offset, pic->stbase, cont->st_ptr);
 
   cont->ridx = pic->ridx;
   cont->rlen = pic->rlen;
@@ -77,6 +91,7 @@ restore_cont(pic_state *pic, struct pic_cont *cont)
 {
   pic_value v;
   struct pic_cont *tmp = cont;
+  struct pic_vector *vec;
 
   if (&v < pic->native_stack_start) {
     if (&v > cont->stk_pos) native_stack_extend(pic, cont);
@@ -98,6 +113,7 @@ restore_cont(pic_state *pic, struct pic_cont *cont)
   memcpy(pic->cibase, cont->ci_ptr, sizeof(pic_callinfo) * cont->ci_len);
   pic->ci = pic->cibase + cont->ci_offset;
   pic->ciend = pic->cibase + cont->ci_len;
+  rebase_frames(pic->cibase, cont->ci_offset, cont->st_ptr, pic->stbase);
 
   pic->rescue = (struct pic_proc **)pic_realloc(pic, pic->rescue, sizeof(struct pic_proc *) * cont->rlen);
   memcpy(pic->rescue, cont->rescue, sizeof(struct pic_object *) * cont->rlen);
@@ -107,6 +123,11 @@ restore_cont(pic_state *pic, struct pic_cont *cont)
   memcpy(pic->arena, cont->arena, sizeof(struct pic_object *) * PIC_ARENA_SIZE);
   pic->arena_idx = cont->arena_idx;
 
+  /* locals of pic_callcc may be stale, so return the values from here */
+  vec = pic_vec_ptr(cont->result);
+  cont->result = pic_values(pic, vec->len, vec->data);
+  pic_gc_write_barrier(pic, (struct pic_object *)cont);
+
   memcpy(cont->stk_pos, cont->stk_ptr, sizeof(pic_value) * cont->stk_len);
 
   longjmp(tmp->jmp, 1);
@@ -132,14 +153,22 @@ NORETURN static pic_value
 cont_call(pic_state *pic)
 {
   struct pic_proc *proc;
-  pic_value v;
+  size_t argc, i;
+  pic_value *argv;
+  struct pic_vector *vec;
   struct pic_cont *cont;
 
   proc = pic_get_proc(pic);
-  pic_get_args(pic, "o", &v);
+  pic_get_args(pic, "*", &argc, &argv);
+
+  vec = pic_vec_new(pic, argc);
+  for (i = 0; i < argc; ++i) {
+    vec->data[i] = argv[i];
+  }
 
   cont = (struct pic_cont *)pic_ptr(proc->env->values[0]);
-  cont->result = v;
+  cont->result = pic_obj_value(vec);
+  pic_gc_write_barrier(pic, (struct pic_object *)cont);
 
   /* execute guard handlers */
   walk_to_block(pic, pic->blk, cont->blk);
@@ -165,7 +194,10 @@ pic_callcc(pic_state *pic, struct pic_proc *proc)
     pic_proc_cv_init(pic, c, 1);
     pic_proc_cv_set(pic, c, 0, pic_obj_value(cont));
 
-    return pic_apply_argv(pic, proc, 1, pic_obj_value(c));
+    pic_apply_argv(pic, proc, 1, pic_obj_value(c));
+
+    /* pass on the values of proc */
+    return pic_values(pic, pic->ci[1].retc, pic->ci[1].fp);
   }
 }
 
@@ -183,7 +215,7 @@ static pic_value
 pic_cont_dynamic_wind(pic_state *pic)
 {
   struct pic_proc *in, *thunk, *out;
-  pic_value v;
+  int retc;
 
   pic_get_args(pic, "lll", &in, &thunk, &out);
 
@@ -201,7 +233,11 @@ pic_cont_dynamic_wind(pic_state *pic)
     pic->blk->refcnt = 1;
     PIC_BLK_INCREF(pic, here);
 
-    v = pic_apply_argv(pic, thunk, 0);
+    pic_apply_argv(pic, thunk, 0);
+
+    /* the values are right above the stack top; keep them under it */
+    retc = pic->ci[1].retc;
+    pic->sp += retc;
 
     PIC_BLK_DECREF(pic, pic->blk);
     pic->blk = here;
@@ -209,7 +245,8 @@ pic_cont_dynamic_wind(pic_state *pic)
   /* exit */
   pic_apply_argv(pic, out, 0);
 
-  return v;
+  pic->sp -= retc;
+  return pic_values(pic, retc, pic->sp);
 }
 
 void
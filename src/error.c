@@ -19,7 +19,7 @@ pic_error(pic_state *pic, const char *msg)
     puts(msg);
     abort();
   }
-  longjmp(*pic->jmp, 1);
+  PIC_LONGJMP(*pic->jmp, 1);
 }
 
 void
@@ -69,7 +69,6 @@ static pic_value
 pic_error_with_exception_handler(pic_state *pic)
 {
   struct pic_proc *handler, *thunk;
-  pic_value v;
 
   pic_get_args(pic, "ll", &handler, &thunk);
 
@@ -84,9 +83,11 @@ pic_error_with_exception_handler(pic_state *pic)
   }
   pic->rescue[pic->ridx++] = handler;
 
-  v = pic_apply_argv(pic, thunk, 0);
+  pic_apply_argv(pic, thunk, 0);
   pic->ridx--;
-  return v;
+
+  /* pass on the values of thunk */
+  return pic_values(pic, pic->ci[1].retc, pic->ci[1].fp);
 }
 
 NORETURN static pic_value
@@ -133,6 +134,7 @@ pic_error_error(pic_state *pic)
   e->type = PIC_ERROR_OTHER;
   e->msg = pic_strdup(pic, str);
   e->irrs = pic_list_from_array(pic, argc, argv);
+  pic_gc_write_barrier(pic, (struct pic_object *)e);
 
   pic_raise(pic, pic_obj_value(e));
 }
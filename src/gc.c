@@ -2,7 +2,16 @@
  * See Copyright Notice in picrin.h
  */
 
+/* MAP_ANONYMOUS is not part of strict C99/POSIX */
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include "picrin.h"
 #include "picrin/gc.h"
@@ -15,59 +24,265 @@
 #include "picrin/macro.h"
 #include "picrin/lib.h"
 #include "picrin/var.h"
+#include "picrin/pair.h"
+#include "picrin/weak.h"
+#include "picrin/jit.h"
 #include "xhash/xhash.h"
 
+#if PIC_ENABLE_PARALLEL_MARK
+# include <pthread.h>
+# include <sched.h>
+#endif
+
 #if GC_DEBUG
-# include <string.h>
 # include <stdio.h>
 # include <assert.h>
 #endif
 
+#if PIC_ENABLE_PARALLEL_MARK
+static struct gc_markers *gc_markers_new(int);
+static void gc_markers_free(struct gc_markers *);
+#endif
+
 void
-init_heap(struct pic_heap *heap)
+init_heap(struct pic_heap *heap, int nthreads)
 {
+  size_t i;
+
   heap->base.s.ptr = &heap->base;
   heap->base.s.size = 0; /* not 1, since it must never be used for allocation */
-  heap->base.s.mark = PIC_GC_UNMARK;
 
   heap->freep = &heap->base;
   heap->pages = NULL;
+  heap->large_size = 0;
+  heap->lab = heap->lab_end = NULL;
+  heap->huge = NULL;
+
+  for (i = 0; i <= PIC_HEAP_CLASS_MAX; ++i) {
+    heap->classes[i].nunits = i;
+    heap->classes[i].freep = NULL;
+    heap->classes[i].pages = NULL;
+    heap->classes[i].sweep = NULL;
+    heap->classes[i].size = 0;
+  }
+
+  heap->young = NULL;
+  heap->young_size = 0;
+
+  heap->remset = NULL;
+  heap->rslen = heap->rscapa = 0;
+
+  heap->mstack = NULL;
+  heap->mslen = heap->mscapa = 0;
+  heap->mark_overflow = false;
+
+  heap->ephemerons = NULL;
+  heap->ephlen = heap->ephcapa = 0;
+
+  heap->ccireps = NULL;
+  heap->cclen = heap->cccapa = 0;
+
+  heap->markers = NULL;
+#if PIC_ENABLE_PARALLEL_MARK
+  if (nthreads > 1) {
+    heap->markers = gc_markers_new(nthreads);
+  }
+#else
+  (void)nthreads;
+#endif
+
+  heap->old_size = heap->marked_size = 0;
+  heap->major_threshold = PIC_NURSERY_SIZE / sizeof(union header);
+  heap->alloc_trigger = PIC_NURSERY_SIZE / sizeof(union header);
+  heap->heap_size = heap->target_size = 0;
+  heap->minor = false;
+
+  heap->phase = PIC_GC_PHASE_NONE;
+  heap->pause_target = 0;
+  memset(&heap->stats, 0, sizeof heap->stats);
+  heap->hook = NULL;
+  heap->hook_data = NULL;
+  heap->hook_proc = NULL;
+  heap->hook_pending = false;
 
 #if GC_DEBUG
   printf("freep = %p\n", (void *)heap->freep);
 #endif
 }
 
+#define GC_PAGE_ALIGN PIC_HEAP_PAGE_MAX
+#define GC_MARK_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+/* objects above this many units get a page of their own */
+#define GC_HUGE_UNITS (GC_PAGE_ALIGN / 2 / sizeof(union header))
+
+/* pages are aligned to GC_PAGE_ALIGN and objects only start in the first
+   GC_PAGE_ALIGN bytes of one, so masking a header finds its page */
+static struct heap_page *
+gc_page_of(union header *p)
+{
+  return (struct heap_page *)((uintptr_t)p & ~(uintptr_t)(GC_PAGE_ALIGN - 1));
+}
+
+/* bytes taken by the page descriptor and the mark bitmap, at most */
+static size_t
+gc_page_overhead(size_t size)
+{
+  size_t nbits;
+
+  nbits = (size < GC_PAGE_ALIGN ? size : GC_PAGE_ALIGN) / sizeof(union header);
+
+  return sizeof(struct heap_page) + (nbits + GC_MARK_BITS - 1) / GC_MARK_BITS * sizeof(unsigned long) + sizeof(union header);
+}
+
+static struct heap_page *
+gc_page_map(pic_state *pic, size_t size)
+{
+  struct heap_page *page;
+  size_t nbits;
+  char *ptr, *mem;
+
+  /* round up to whole OS pages so that unmapping gives memory back */
+  size = (size + 4095) & ~(size_t)4095;
+
+#if defined(MAP_ANONYMOUS)
+  mem = mmap(NULL, size + GC_PAGE_ALIGN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    pic_abort(pic, "memory exhausted");
+  }
+  ptr = (char *)(((uintptr_t)mem + GC_PAGE_ALIGN - 1) & ~(uintptr_t)(GC_PAGE_ALIGN - 1));
+
+  /* trim the slack around the aligned part */
+  if (ptr != mem) {
+    munmap(mem, ptr - mem);
+  }
+  if (ptr + size != mem + size + GC_PAGE_ALIGN) {
+    munmap(ptr + size, (mem + size + GC_PAGE_ALIGN) - (ptr + size));
+  }
+  mem = ptr;
+#else
+  mem = pic_calloc(pic, 1, size + GC_PAGE_ALIGN);
+  ptr = (char *)(((uintptr_t)mem + GC_PAGE_ALIGN - 1) & ~(uintptr_t)(GC_PAGE_ALIGN - 1));
+#endif
+
+  /* the mark bitmap follows the page descriptor */
+  nbits = (size < GC_PAGE_ALIGN ? size : GC_PAGE_ALIGN) / sizeof(union header);
+
+  page = (struct heap_page *)ptr;
+  page->mem = mem;
+  page->size = size;
+  page->marks = (unsigned long *)(page + 1);
+  page->basep = (union header *)(page->marks + (nbits + GC_MARK_BITS - 1) / GC_MARK_BITS);
+  page->basep = (union header *)(((uintptr_t)page->basep + sizeof(union header) - 1) & ~(uintptr_t)(sizeof(union header) - 1));
+  page->endp = page->basep;
+
+  pic->heap->heap_size += size;
+  pic->heap->stats.pages++;
+  return page;
+}
+
+/* units available from basep to the end of the page */
+static size_t
+gc_page_units(struct heap_page *page)
+{
+  return ((char *)page + page->size - (char *)page->basep) / sizeof(union header);
+}
+
+static void
+gc_page_unmap(struct pic_heap *heap, struct heap_page *page)
+{
+  heap->heap_size -= page->size;
+  heap->stats.pages--;
+
+#if defined(MAP_ANONYMOUS)
+  munmap(page->mem, page->size);
+#else
+  free(page->mem);
+#endif
+}
+
+/* the next page of a space grows geometrically with the space itself */
+static size_t
+gc_page_size(size_t current)
+{
+  size_t size;
+
+  size = current / 100 * PIC_HEAP_GROWTH;
+  if (size < PIC_HEAP_PAGE_SIZE) {
+    size = PIC_HEAP_PAGE_SIZE;
+  }
+  if (size > PIC_HEAP_PAGE_MAX) {
+    size = PIC_HEAP_PAGE_MAX;
+  }
+  return size;
+}
+
+/* whether an empty page of this size can be given back to the OS */
+static bool
+gc_page_releasable(struct pic_heap *heap, struct heap_page *page)
+{
+  return heap->heap_size - page->size >= heap->target_size;
+}
+
+static void
+free_heap_pages(struct pic_heap *heap, struct heap_page *pages)
+{
+  struct heap_page *page;
+
+  while (pages) {
+    page = pages;
+    pages = pages->next;
+    gc_page_unmap(heap, page);
+  }
+}
+
 void
 finalize_heap(struct pic_heap *heap)
 {
-  struct heap_page *page;
+  size_t i;
 
-  while (heap->pages) {
-    page = heap->pages;
-    heap->pages = heap->pages->next;
-    free(page);
+  free_heap_pages(heap, heap->pages);
+  free_heap_pages(heap, heap->huge);
+  for (i = 0; i <= PIC_HEAP_CLASS_MAX; ++i) {
+    free_heap_pages(heap, heap->classes[i].pages);
   }
+  free(heap->remset);
+  free(heap->mstack);
+  free(heap->ephemerons);
+  free(heap->ccireps);
+
+#if PIC_ENABLE_PARALLEL_MARK
+  if (heap->markers) {
+    gc_markers_free(heap->markers);
+  }
+#endif
 }
 
 static void gc_free(pic_state *, union header *);
 
 static void
-add_heap_page(pic_state *pic)
+add_heap_page(pic_state *pic, size_t nunits)
 {
+  struct pic_heap *heap = pic->heap;
   union header *up, *np;
   struct heap_page *page;
-  size_t nu;
+  size_t size, nu;
 
 #if GC_DEBUG
   puts("adding heap page!");
 #endif
 
-  nu = (PIC_HEAP_PAGE_SIZE + sizeof(union header) - 1) / sizeof(union header) + 1;
+  /* one unit for the sentinel and one spare unit keeping pages apart */
+  size = gc_page_size(heap->large_size);
+  if (size < gc_page_overhead(GC_PAGE_ALIGN) + (nunits + 2) * sizeof(union header)) {
+    size = gc_page_overhead(GC_PAGE_ALIGN) + (nunits + 2) * sizeof(union header);
+  }
+  page = gc_page_map(pic, size);
+  nu = gc_page_units(page) - 2;
+  heap->large_size += page->size;
 
-  up = (union header *)pic_calloc(pic, 1 + nu + 1, sizeof(union header));
+  up = page->basep;
   up->s.size = nu + 1;
-  up->s.mark = PIC_GC_UNMARK;
   gc_free(pic, up);
 
   np = up + 1;
@@ -76,12 +291,38 @@ add_heap_page(pic_state *pic)
   up->s.size = 1;
   up->s.ptr = np;
 
-  page = (struct heap_page *)pic_alloc(pic, sizeof(struct heap_page));
-  page->basep = up;
   page->endp = up + nu + 1;
-  page->next = pic->heap->pages;
+  page->next = heap->pages;
+  heap->pages = page;
+}
+
+static void
+add_class_page(pic_state *pic, struct heap_class *cls)
+{
+  union header *p;
+  struct heap_page *page;
+  size_t nslots, i;
+
+#if GC_DEBUG
+  printf("adding class page! (%d units)\n", (int)cls->nunits);
+#endif
+
+  page = gc_page_map(pic, gc_page_size(cls->size));
+  cls->size += page->size;
+
+  nslots = gc_page_units(page) / cls->nunits;
 
-  pic->heap->pages = page;
+  page->endp = page->basep + nslots * cls->nunits;
+  page->next = cls->pages;
+  cls->pages = page;
+
+  /* thread every slot onto the free list, lowest address first */
+  for (i = nslots; i > 0; --i) {
+    p = page->basep + (i - 1) * cls->nunits;
+    p->s.size = 0;              /* free slot */
+    p->s.ptr = cls->freep;
+    cls->freep = p;
+  }
 }
 
 void *
@@ -160,68 +401,177 @@ pic_gc_arena_restore(pic_state *pic, int state)
   pic->arena_idx = state;
 }
 
-static void *
-gc_alloc(pic_state *pic, size_t size)
+static void
+gc_retire_lab(pic_state *pic)
 {
-  union header *freep, *p, *prevp;
-  size_t nunits;
+  struct pic_heap *heap = pic->heap;
+  union header *rest;
 
-#if GC_DEBUG
-  assert(size > 0);
-#endif
+  if (heap->lab == NULL)
+    return;
 
-  nunits = (size + sizeof(union header) - 1) / sizeof(union header) + 1;
+  /* give the unused tail back to the free list */
+  if (heap->lab != heap->lab_end) {
+    rest = heap->lab;
+    rest->s.size = heap->lab_end - heap->lab;
+    gc_free(pic, rest);
+  }
+
+  heap->lab = heap->lab_end = NULL;
+}
+
+static bool
+gc_refill_lab(pic_state *pic, size_t nunits)
+{
+  struct pic_heap *heap = pic->heap;
+  union header *freep, *p, *prevp;
+
+  gc_retire_lab(pic);
 
-  prevp = freep = pic->heap->freep;
+  /* grab a whole free block and turn it into a bump allocation buffer */
+  prevp = freep = heap->freep;
   for (p = prevp->s.ptr; ; prevp = p, p = p->s.ptr) {
     if (p->s.size >= nunits)
       break;
     if (p == freep) {
-      return NULL;
+      return false;
     }
   }
+  prevp->s.ptr = p->s.ptr;
+  heap->freep = prevp;
 
-#if GC_DEBUG
-  {
-    int i, j;
-    unsigned char *c;
-    size_t s;
-    if (p->s.size == nunits) {
-      c = (unsigned char *)(p + p->s.size - nunits + 1);
-      s = nunits - 1;
-    } else {
-      c = (unsigned char *)(p + p->s.size - nunits);
-      s = nunits;
-    }
+  heap->lab = p;
+  heap->lab_end = p + p->s.size;
+  return true;
+}
 
-    for (i = 0; i < s; ++i) {
-      for (j = 0; j < sizeof(union header); ++j) {
-	assert(c[i * sizeof(union header) + j] == 0xAA);
-      }
+static union header *
+gc_alloc_large(pic_state *pic, size_t nunits)
+{
+  struct pic_heap *heap = pic->heap;
+  union header *p;
+  size_t rest;
+
+  if (heap->lab == NULL || (size_t)(heap->lab_end - heap->lab) < nunits) {
+    if (! gc_refill_lab(pic, nunits)) {
+      return NULL;
     }
   }
+
+  /* a free block needs at least two units; never leave a single-unit tail */
+  rest = (heap->lab_end - heap->lab) - nunits;
+  if (rest == 1) {
+    nunits++;
+  }
+
+  p = heap->lab;
+  heap->lab += nunits;
+  p->s.size = nunits;
+  return p;
+}
+
+/* huge objects bypass the free list and are unmapped as soon as they die */
+static union header *
+gc_alloc_huge(pic_state *pic, size_t nunits)
+{
+  struct heap_page *page;
+  union header *p;
+
+  page = gc_page_map(pic, gc_page_overhead(GC_PAGE_ALIGN) + nunits * sizeof(union header));
+  page->endp = page->basep + nunits;
+  page->next = pic->heap->huge;
+  pic->heap->huge = page;
+
+  p = page->basep;
+  p->s.size = nunits;
+  return p;
+}
+
+static void
+gc_free_huge(pic_state *pic, union header *p)
+{
+  struct heap_page *page = gc_page_of(p), **link;
+
+  for (link = &pic->heap->huge; *link != page; link = &(*link)->next)
+    ;
+  *link = page->next;
+  gc_page_unmap(pic->heap, page);
+}
+
+static void gc_sweep_next_class_page(pic_state *, struct heap_class *);
+
+static union header *
+gc_alloc_small(pic_state *pic, struct heap_class *cls)
+{
+  union header *p;
+
+  /* sweep pages left over from the last major collection on demand */
+  while (cls->freep == NULL && cls->sweep != NULL) {
+    gc_sweep_next_class_page(pic, cls);
+  }
+
+  if ((p = cls->freep) == NULL) {
+    return NULL;
+  }
+  cls->freep = p->s.ptr;
+  p->s.size = cls->nunits;
+  return p;
+}
+
+/* allocate a young object, either from a size class or the large object heap */
+static void *
+gc_alloc(pic_state *pic, size_t size)
+{
+  struct pic_heap *heap = pic->heap;
+  union header *p;
+  size_t nunits;
+
+#if GC_DEBUG
+  assert(size > 0);
 #endif
 
-  if (p->s.size == nunits) {
-    prevp->s.ptr = p->s.ptr;
+  nunits = (size + sizeof(union header) - 1) / sizeof(union header) + 1;
+
+  if (nunits <= PIC_HEAP_CLASS_MAX) {
+    p = gc_alloc_small(pic, &heap->classes[nunits]);
+  } else if (nunits <= GC_HUGE_UNITS) {
+    p = gc_alloc_large(pic, nunits);
+  } else {
+    p = gc_alloc_huge(pic, nunits);
   }
-  else {
-    p->s.size -= nunits;
-    p += p->s.size;
-    p->s.size = nunits;
+  if (p == NULL) {
+    return NULL;
   }
-  pic->heap->freep = prevp;
 
-  p->s.mark = PIC_GC_UNMARK;
+  p->s.old = 0;
+  p->s.remembered = 0;
+
+  p->s.ptr = heap->young;
+  heap->young = p;
+  heap->young_size += p->s.size;
+  heap->stats.allocated += p->s.size * sizeof(union header);
 
 #if GC_DEBUG
-  memset(p+1, 0, sizeof(union header) * (nunits - 1));
-  p->s.ptr = (union header *)0xcafebabe;
+  memset(p+1, 0, sizeof(union header) * (p->s.size - 1));
 #endif
 
   return (void *)(p + 1);
 }
 
+static void
+gc_add_page(pic_state *pic, size_t size)
+{
+  size_t nunits;
+
+  nunits = (size + sizeof(union header) - 1) / sizeof(union header) + 1;
+
+  if (nunits <= PIC_HEAP_CLASS_MAX) {
+    add_class_page(pic, &pic->heap->classes[nunits]);
+  } else {
+    add_heap_page(pic, nunits);
+  }
+}
+
 static void
 gc_free(pic_state *pic, union header *bp)
 {
@@ -267,8 +617,34 @@ gc_free(pic_state *pic, union header *bp)
   pic->heap->freep = p;
 }
 
+static void
+gc_release(pic_state *pic, union header *p)
+{
+  struct heap_class *cls;
+
+  if (p->s.size > GC_HUGE_UNITS) {
+    gc_free_huge(pic, p);
+    return;
+  }
+  if (p->s.size > PIC_HEAP_CLASS_MAX) {
+    gc_free(pic, p);
+    return;
+  }
+
+  cls = &pic->heap->classes[p->s.size];
+
+#if GC_DEBUG
+  memset(p + 1, 0xAA, (cls->nunits - 1) * sizeof(union header));
+#endif
+
+  p->s.size = 0;
+  p->s.ptr = cls->freep;
+  cls->freep = p;
+}
+
 static void gc_mark(pic_state *, pic_value);
 static void gc_mark_object(pic_state *pic, struct pic_object *obj);
+static void gc_mark_children(pic_state *pic, struct pic_object *obj);
 
 static void
 gc_mark_block(pic_state *pic, struct pic_block *blk)
@@ -282,33 +658,221 @@ gc_mark_block(pic_state *pic, struct pic_block *blk)
   }
 }
 
+/* parallel markers set mark bits with atomic ors, so they are read atomically too */
+static unsigned long
+gc_mark_word(unsigned long *word)
+{
+#if PIC_ENABLE_PARALLEL_MARK
+  return __atomic_load_n(word, __ATOMIC_RELAXED);
+#else
+  return *word;
+#endif
+}
+
 static bool
 gc_is_marked(union header *p)
 {
-  return p->s.mark == PIC_GC_MARK;
+  struct heap_page *page = gc_page_of(p);
+  size_t i = p - page->basep;
+
+  return (gc_mark_word(&page->marks[i / GC_MARK_BITS]) >> (i % GC_MARK_BITS)) & 1;
+}
+
+/* survivors of the last major collection still waiting for the lazy sweep
+   keep their mark bit instead of the old bit */
+static bool
+gc_is_old(union header *p)
+{
+  return p->s.old || gc_is_marked(p);
 }
 
 static void
 gc_unmark(union header *p)
 {
-  p->s.mark = PIC_GC_UNMARK;
+  struct heap_page *page = gc_page_of(p);
+  size_t i = p - page->basep;
+
+  page->marks[i / GC_MARK_BITS] &= ~(1UL << (i % GC_MARK_BITS));
+}
+
+#if PIC_ENABLE_PARALLEL_MARK
+
+/* per-thread state of a parallel marker */
+struct gc_marker {
+  struct pic_object **stack;    /* private, popped without locking */
+  size_t len, capa;
+  struct pic_object **shared;   /* may be stolen by the other markers */
+  size_t slen, scapa;
+  pthread_mutex_t lock;         /* guards shared and slen */
+  size_t marked_size;           /* in units, summed up after marking */
+  struct gc_markers *owner;
+};
+
+struct gc_markers {
+  pic_state *pic;               /* state being marked */
+  int n;                        /* markers, including the collecting thread */
+  struct gc_marker *markers;
+  pthread_t *threads;           /* n - 1 workers */
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+  unsigned long generation;     /* bumped to start a marking round */
+  int running;                  /* workers still in the current round */
+  int idle;                     /* markers out of work; updated atomically */
+  bool shutdown;
+};
+
+/* the marker of the current thread, or NULL when marking sequentially */
+static __thread struct gc_marker *gc_marker;
+
+#endif
+
+static void
+gc_mark_push(pic_state *pic, struct pic_object *obj)
+{
+  struct pic_heap *heap = pic->heap;
+  struct pic_object ***stack, **mstack;
+  size_t *len, *capa, mscapa;
+
+  stack = &heap->mstack;
+  len = &heap->mslen;
+  capa = &heap->mscapa;
+#if PIC_ENABLE_PARALLEL_MARK
+  if (gc_marker != NULL) {
+    stack = &gc_marker->stack;
+    len = &gc_marker->len;
+    capa = &gc_marker->capa;
+  }
+#endif
+
+  if (*len >= *capa) {
+    mscapa = *capa ? *capa * 2 : 1024;
+    if (mscapa > PIC_MARK_STACK_SIZE
+        || (mstack = realloc(*stack, sizeof(struct pic_object *) * mscapa)) == NULL) {
+      /* leave it marked but unscanned; gc_mark_rescan will pick it up */
+#if PIC_ENABLE_PARALLEL_MARK
+      __atomic_store_n(&heap->mark_overflow, true, __ATOMIC_RELAXED);
+#else
+      heap->mark_overflow = true;
+#endif
+      return;
+    }
+    *stack = mstack;
+    *capa = mscapa;
+  }
+  (*stack)[(*len)++] = obj;
+}
+
+/* set the mark bit; false if the object is already marked or out of scope */
+static bool
+gc_mark_set(pic_state *pic, union header *p)
+{
+  struct heap_page *page = gc_page_of(p);
+  size_t i = p - page->basep;
+  unsigned long *word, bit;
+
+  word = &page->marks[i / GC_MARK_BITS];
+  bit = 1UL << (i % GC_MARK_BITS);
+
+  if (gc_mark_word(word) & bit)
+    return false;
+  if (pic->heap->minor && p->s.old)
+    return false;
+
+#if PIC_ENABLE_PARALLEL_MARK
+  if (gc_marker != NULL) {
+    if (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit)
+      return false;             /* another marker won the race */
+    gc_marker->marked_size += p->s.size;
+    return true;
+  }
+#endif
+
+  *word |= bit;
+  pic->heap->marked_size += p->s.size;
+  return true;
 }
 
 static void
 gc_mark_object(pic_state *pic, struct pic_object *obj)
 {
-  union header *p;
+  if (gc_mark_set(pic, ((union header *)obj) - 1)) {
+    gc_mark_push(pic, obj);
+  }
+}
 
-  p = ((union header *)obj) - 1;
+/* an ephemeron's fields are left to gc_mark_ephemerons */
+static void
+gc_ephemeron_push(pic_state *pic, struct pic_ephemeron *e)
+{
+  struct pic_heap *heap = pic->heap;
 
-  if (gc_is_marked(p))
-    return;
-  p->s.mark = PIC_GC_MARK;
+#if PIC_ENABLE_PARALLEL_MARK
+  if (gc_marker != NULL) {
+    pthread_mutex_lock(&heap->markers->lock);
+  }
+#endif
+
+  if (heap->ephlen >= heap->ephcapa) {
+    heap->ephcapa = heap->ephcapa * 2 + 32;
+    heap->ephemerons = pic_realloc(pic, heap->ephemerons, sizeof(struct pic_ephemeron *) * heap->ephcapa);
+  }
+  heap->ephemerons[heap->ephlen++] = e;
+
+#if PIC_ENABLE_PARALLEL_MARK
+  if (gc_marker != NULL) {
+    pthread_mutex_unlock(&heap->markers->lock);
+  }
+#endif
+}
+
+/* the callees in an irep's caches are left to gc_clear_callcache */
+static void
+gc_callcache_push(pic_state *pic, struct pic_irep *irep)
+{
+  struct pic_heap *heap = pic->heap;
+
+#if PIC_ENABLE_PARALLEL_MARK
+  if (gc_marker != NULL) {
+    pthread_mutex_lock(&heap->markers->lock);
+  }
+#endif
+
+  if (heap->cclen >= heap->cccapa) {
+    heap->cccapa = heap->cccapa * 2 + 32;
+    heap->ccireps = pic_realloc(pic, heap->ccireps, sizeof(struct pic_irep *) * heap->cccapa);
+  }
+  heap->ccireps[heap->cclen++] = irep;
+
+#if PIC_ENABLE_PARALLEL_MARK
+  if (gc_marker != NULL) {
+    pthread_mutex_unlock(&heap->markers->lock);
+  }
+#endif
+}
 
+static void
+gc_mark_children(pic_state *pic, struct pic_object *obj)
+{
   switch (obj->tt) {
   case PIC_TT_PAIR: {
-    gc_mark(pic, ((struct pic_pair *)obj)->car);
-    gc_mark(pic, ((struct pic_pair *)obj)->cdr);
+    struct pic_pair *pair = (struct pic_pair *)obj;
+    int n = 0;
+
+    /* walk down the cdr in place so that long lists use no stack */
+    while (1) {
+      gc_mark(pic, pair->car);
+      if (! pic_pair_p(pair->cdr)) {
+        gc_mark(pic, pair->cdr);
+        break;
+      }
+      pair = pic_pair_ptr(pair->cdr);
+      if (! gc_mark_set(pic, ((union header *)pair) - 1))
+        break;
+      if (++n == 256) {         /* keep incremental steps short */
+        gc_mark_push(pic, (struct pic_object *)pair);
+        break;
+      }
+    }
     break;
   }
   case PIC_TT_ENV: {
@@ -318,9 +882,6 @@ gc_mark_object(pic_state *pic, struct pic_object *obj)
     for (i = 0; i < env->valuec; ++i) {
       gc_mark(pic, env->values[i]);
     }
-    if (env->up) {
-      gc_mark_object(pic, (struct pic_object *)env->up);
-    }
     break;
   }
   case PIC_TT_PROC: {
@@ -434,6 +995,21 @@ gc_mark_object(pic_state *pic, struct pic_object *obj)
     }
     break;
   }
+  case PIC_TT_EPHEMERON: {
+    gc_ephemeron_push(pic, (struct pic_ephemeron *)obj);
+    break;
+  }
+  case PIC_TT_WTABLE: {
+    struct pic_wtable *tbl = (struct pic_wtable *)obj;
+    size_t i;
+
+    for (i = 0; i < tbl->capa; ++i) {
+      if (tbl->slots[i]) {
+        gc_mark_object(pic, (struct pic_object *)tbl->slots[i]);
+      }
+    }
+    break;
+  }
   case PIC_TT_IREP: {
     struct pic_irep *irep = (struct pic_irep *)obj;
     size_t i;
@@ -444,6 +1020,9 @@ gc_mark_object(pic_state *pic, struct pic_object *obj)
     for (i = 0; i < irep->plen; ++i) {
       gc_mark(pic, irep->pool[i]);
     }
+    if (irep->cclen > 0) {
+      gc_callcache_push(pic, irep);
+    }
     break;
   }
   case PIC_TT_NIL:
@@ -471,9 +1050,348 @@ gc_mark(pic_state *pic, pic_value v)
 }
 
 static void
-gc_mark_phase(pic_state *pic)
+gc_mark_drain(pic_state *pic)
 {
-  pic_value *stack;
+  struct pic_heap *heap = pic->heap;
+
+  while (heap->mslen > 0) {
+    gc_mark_children(pic, heap->mstack[--heap->mslen]);
+  }
+}
+
+#if PIC_ENABLE_PARALLEL_MARK
+
+#define GC_SHARE_THRESHOLD 64   /* private entries kept before sharing */
+
+/* move the older half of the private stack where others can steal it */
+static void
+gc_marker_share(struct gc_marker *m)
+{
+  size_t n = m->len / 2, capa;
+  struct pic_object **shared;
+
+  pthread_mutex_lock(&m->lock);
+  if (m->slen == 0) {
+    if (n > m->scapa) {
+      capa = n * 2;
+      if ((shared = realloc(m->shared, sizeof(struct pic_object *) * capa)) == NULL) {
+        pthread_mutex_unlock(&m->lock);
+        return;
+      }
+      m->shared = shared;
+      m->scapa = capa;
+    }
+    memcpy(m->shared, m->stack, sizeof(struct pic_object *) * n);
+    memmove(m->stack, m->stack + n, sizeof(struct pic_object *) * (m->len - n));
+    m->len -= n;
+    __atomic_store_n(&m->slen, n, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&m->lock);
+}
+
+/* take all the shared entries of some marker, looking at our own first */
+static bool
+gc_marker_steal(struct gc_markers *ms, struct gc_marker *m)
+{
+  struct gc_marker *victim;
+  size_t n, capa;
+  struct pic_object **stack;
+  int i;
+
+  for (i = 0; i < ms->n; ++i) {
+    victim = &ms->markers[((m - ms->markers) + i) % ms->n];
+    if (__atomic_load_n(&victim->slen, __ATOMIC_ACQUIRE) == 0)
+      continue;
+
+    pthread_mutex_lock(&victim->lock);
+    n = victim->slen;
+    if (m->len + n > m->capa) {
+      capa = m->len + n + 1024;
+      if ((stack = realloc(m->stack, sizeof(struct pic_object *) * capa)) == NULL) {
+        pthread_mutex_unlock(&victim->lock);
+        continue;
+      }
+      m->stack = stack;
+      m->capa = capa;
+    }
+    memcpy(m->stack + m->len, victim->shared, sizeof(struct pic_object *) * n);
+    m->len += n;
+    __atomic_store_n(&victim->slen, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&victim->lock);
+
+    if (n > 0)
+      return true;
+  }
+  return false;
+}
+
+static bool
+gc_markers_have_work(struct gc_markers *ms)
+{
+  int i;
+
+  for (i = 0; i < ms->n; ++i) {
+    if (__atomic_load_n(&ms->markers[i].slen, __ATOMIC_ACQUIRE) != 0)
+      return true;
+  }
+  return false;
+}
+
+/* drain until every marker runs dry; a marker only goes idle with both its
+   stacks empty, so all markers idle at once means marking is complete */
+static void
+gc_marker_drain(struct gc_markers *ms, struct gc_marker *m)
+{
+  pic_state *pic = ms->pic;
+
+  gc_marker = m;
+  while (1) {
+    while (m->len > 0) {
+      gc_mark_children(pic, m->stack[--m->len]);
+      if (m->len > GC_SHARE_THRESHOLD && __atomic_load_n(&m->slen, __ATOMIC_RELAXED) == 0) {
+        gc_marker_share(m);
+      }
+    }
+    if (gc_marker_steal(ms, m))
+      continue;
+
+    __atomic_add_fetch(&ms->idle, 1, __ATOMIC_ACQ_REL);
+    while (1) {
+      if (gc_markers_have_work(ms)) {
+        __atomic_sub_fetch(&ms->idle, 1, __ATOMIC_ACQ_REL);
+        if (gc_marker_steal(ms, m))
+          break;
+        __atomic_add_fetch(&ms->idle, 1, __ATOMIC_ACQ_REL);
+        continue;
+      }
+      if (__atomic_load_n(&ms->idle, __ATOMIC_ACQUIRE) == ms->n) {
+        gc_marker = NULL;
+        return;
+      }
+      sched_yield();
+    }
+  }
+}
+
+static void *
+gc_marker_main(void *arg)
+{
+  struct gc_marker *m = (struct gc_marker *)arg;
+  struct gc_markers *ms = m->owner;
+  unsigned long generation = 0;
+
+  while (1) {
+    pthread_mutex_lock(&ms->lock);
+    while (! ms->shutdown && ms->generation == generation) {
+      pthread_cond_wait(&ms->start, &ms->lock);
+    }
+    if (ms->shutdown) {
+      pthread_mutex_unlock(&ms->lock);
+      return NULL;
+    }
+    generation = ms->generation;
+    pthread_mutex_unlock(&ms->lock);
+
+    gc_marker_drain(ms, m);
+
+    pthread_mutex_lock(&ms->lock);
+    if (--ms->running == 0) {
+      pthread_cond_signal(&ms->done);
+    }
+    pthread_mutex_unlock(&ms->lock);
+  }
+}
+
+static struct gc_markers *
+gc_markers_new(int n)
+{
+  struct gc_markers *ms;
+  int i;
+
+  ms = (struct gc_markers *)calloc(1, sizeof(struct gc_markers));
+  ms->markers = (struct gc_marker *)calloc(n, sizeof(struct gc_marker));
+  ms->threads = (pthread_t *)calloc(n, sizeof(pthread_t));
+  pthread_mutex_init(&ms->lock, NULL);
+  pthread_cond_init(&ms->start, NULL);
+  pthread_cond_init(&ms->done, NULL);
+
+  for (i = 0; i < n; ++i) {
+    ms->markers[i].owner = ms;
+    pthread_mutex_init(&ms->markers[i].lock, NULL);
+  }
+
+  /* the collecting thread is marker 0 */
+  ms->n = 1;
+  for (i = 1; i < n; ++i) {
+    if (pthread_create(&ms->threads[i], NULL, gc_marker_main, &ms->markers[i]) != 0)
+      break;
+    ms->n++;
+  }
+  return ms;
+}
+
+static void
+gc_markers_free(struct gc_markers *ms)
+{
+  int i;
+
+  pthread_mutex_lock(&ms->lock);
+  ms->shutdown = true;
+  pthread_cond_broadcast(&ms->start);
+  pthread_mutex_unlock(&ms->lock);
+
+  for (i = 1; i < ms->n; ++i) {
+    pthread_join(ms->threads[i], NULL);
+  }
+  for (i = 0; i < ms->n; ++i) {
+    pthread_mutex_destroy(&ms->markers[i].lock);
+    free(ms->markers[i].stack);
+    free(ms->markers[i].shared);
+  }
+  pthread_mutex_destroy(&ms->lock);
+  pthread_cond_destroy(&ms->start);
+  pthread_cond_destroy(&ms->done);
+  free(ms->markers);
+  free(ms->threads);
+  free(ms);
+}
+
+/* drain the mark stack with all the markers */
+static void
+gc_markers_run(pic_state *pic)
+{
+  struct pic_heap *heap = pic->heap;
+  struct gc_markers *ms = heap->markers;
+  struct gc_marker *m = &ms->markers[0];
+  struct pic_object **stack;
+  size_t len, capa;
+  int i;
+
+  /* hand the grey objects over to the first marker */
+  stack = m->stack, len = m->len, capa = m->capa;
+  m->stack = heap->mstack, m->len = heap->mslen, m->capa = heap->mscapa;
+  heap->mstack = stack, heap->mslen = len, heap->mscapa = capa;
+
+  ms->pic = pic;
+  ms->idle = 0;
+  for (i = 0; i < ms->n; ++i) {
+    ms->markers[i].marked_size = 0;
+  }
+
+  pthread_mutex_lock(&ms->lock);
+  ms->generation++;
+  ms->running = ms->n - 1;
+  pthread_cond_broadcast(&ms->start);
+  pthread_mutex_unlock(&ms->lock);
+
+  gc_marker_drain(ms, m);
+
+  pthread_mutex_lock(&ms->lock);
+  while (ms->running > 0) {
+    pthread_cond_wait(&ms->done, &ms->lock);
+  }
+  pthread_mutex_unlock(&ms->lock);
+
+  for (i = 0; i < ms->n; ++i) {
+    heap->marked_size += ms->markers[i].marked_size;
+  }
+}
+
+#endif
+
+static void
+gc_mark_rescan_page(pic_state *pic, struct heap_page *page)
+{
+  struct pic_heap *heap = pic->heap;
+  union header *bp, *p;
+
+  for (bp = page->basep; ; bp = bp->s.ptr) {
+    for (p = bp + bp->s.size; p != bp->s.ptr; p += p->s.size) {
+      /* the unused tail of an active lab has no headers yet */
+      if (p == heap->lab && heap->lab != heap->lab_end) {
+        p = heap->lab_end;
+        if (p == bp->s.ptr) {
+          break;
+        }
+      }
+      if (p == page->endp) {
+	return;
+      }
+      if (gc_is_marked(p)) {
+        gc_mark_children(pic, (struct pic_object *)(p + 1));
+        gc_mark_drain(pic);
+      }
+    }
+  }
+}
+
+/* the mark stack overflowed: rescan every marked object in the heap */
+static void
+gc_mark_rescan(pic_state *pic)
+{
+  struct pic_heap *heap = pic->heap;
+  struct heap_class *cls;
+  struct heap_page *page;
+  union header *p;
+  size_t i;
+
+  if (heap->minor) {
+    for (p = heap->young; p != NULL; p = p->s.ptr) {
+      if (gc_is_marked(p)) {
+        gc_mark_children(pic, (struct pic_object *)(p + 1));
+        gc_mark_drain(pic);
+      }
+    }
+    return;
+  }
+
+  for (page = heap->pages; page; page = page->next) {
+    gc_mark_rescan_page(pic, page);
+  }
+  for (page = heap->huge; page; page = page->next) {
+    if (gc_is_marked(page->basep)) {
+      gc_mark_children(pic, (struct pic_object *)(page->basep + 1));
+      gc_mark_drain(pic);
+    }
+  }
+  for (i = 1; i <= PIC_HEAP_CLASS_MAX; ++i) {
+    cls = &heap->classes[i];
+    for (page = cls->pages; page; page = page->next) {
+      for (p = page->basep; p != page->endp; p += cls->nunits) {
+        if (p->s.size != 0 && gc_is_marked(p)) {
+          gc_mark_children(pic, (struct pic_object *)(p + 1));
+          gc_mark_drain(pic);
+        }
+      }
+    }
+  }
+}
+
+static void
+gc_mark_remembered(pic_state *pic)
+{
+  struct pic_heap *heap = pic->heap;
+  struct pic_object *obj;
+  size_t i;
+
+  for (i = 0; i < heap->rslen; ++i) {
+    obj = heap->remset[i];
+    (((union header *)obj) - 1)->s.remembered = 0;
+
+    if (heap->minor) {
+      gc_mark_children(pic, obj);
+    }
+    else if (heap->phase == PIC_GC_PHASE_MARK && gc_is_marked(((union header *)obj) - 1)) {
+      gc_mark_children(pic, obj);
+    }
+  }
+  heap->rslen = 0;
+}
+
+static void
+gc_mark_roots(pic_state *pic)
+{
+  pic_value *stack;
   pic_callinfo *ci;
   size_t i;
   int j;
@@ -500,7 +1418,13 @@ gc_mark_phase(pic_state *pic)
 
   /* arena */
   for (j = 0; j < pic->arena_idx; ++j) {
-    gc_mark_object(pic, pic->arena[j]);
+    /* objects in the arena may still be under construction, and their
+       fields are filled without the write barrier even if promoted */
+    if (pic->heap->minor && gc_is_old(((union header *)pic->arena[j]) - 1)) {
+      gc_mark_children(pic, pic->arena[j]);
+    } else {
+      gc_mark_object(pic, pic->arena[j]);
+    }
   }
 
   /* global variables */
@@ -510,6 +1434,101 @@ gc_mark_phase(pic_state *pic)
 
   /* library table */
   gc_mark(pic, pic->lib_tbl);
+
+  /* scheme-level gc hook */
+  if (pic->heap->hook_proc) {
+    gc_mark_object(pic, (struct pic_object *)pic->heap->hook_proc);
+  }
+}
+
+/* whether v survives the collection in progress */
+static bool
+gc_is_live(pic_state *pic, pic_value v)
+{
+  union header *p;
+
+  if (pic_vtype(v) != PIC_VTYPE_HEAP)
+    return true;
+  p = ((union header *)pic_obj_ptr(v)) - 1;
+
+  return pic->heap->minor ? gc_is_old(p) : gc_is_marked(p);
+}
+
+/* mark the values of ephemerons whose keys turned out live, until no more
+   keys become live, then break the rest */
+static void
+gc_mark_ephemerons(pic_state *pic)
+{
+  struct pic_heap *heap = pic->heap;
+  struct pic_ephemeron *e;
+  bool progress = true;
+  size_t i;
+
+  while (progress) {
+    progress = false;
+    for (i = 0; i < heap->ephlen; ++i) {
+      e = heap->ephemerons[i];
+      if (gc_is_live(pic, e->key)) {
+        heap->ephemerons[i--] = heap->ephemerons[--heap->ephlen];
+        gc_mark(pic, e->value);
+        progress = true;
+      }
+    }
+
+    gc_mark_drain(pic);
+    while (heap->mark_overflow) {
+      heap->mark_overflow = false;
+      gc_mark_rescan(pic);
+    }
+  }
+
+  for (i = 0; i < heap->ephlen; ++i) {
+    e = heap->ephemerons[i];
+    e->key = e->value = pic_false_value();
+    e->broken = true;
+  }
+  heap->ephlen = 0;
+}
+
+/* inline caches hold their callees weakly; a dead one may be reused at the
+   same address by another procedure. Caches of dead ireps go with them. */
+static void
+gc_clear_callcache(pic_state *pic)
+{
+  struct pic_heap *heap = pic->heap;
+  struct pic_callcache *cc;
+  size_t i, j;
+
+  for (i = 0; i < heap->cclen; ++i) {
+    for (j = 0; j < heap->ccireps[i]->cclen; ++j) {
+      cc = pic_irep_callcache(heap->ccireps[i], j);
+      if (cc->proc && ! gc_is_live(pic, pic_obj_value(cc->proc))) {
+        cc->proc = NULL;
+      }
+    }
+  }
+  heap->cclen = 0;
+}
+
+static void
+gc_mark_phase(pic_state *pic)
+{
+  gc_mark_remembered(pic);
+  gc_mark_roots(pic);
+
+#if PIC_ENABLE_PARALLEL_MARK
+  if (pic->heap->markers && ! pic->heap->minor) {
+    gc_markers_run(pic);
+  }
+#endif
+  gc_mark_drain(pic);
+  while (pic->heap->mark_overflow) {
+    pic->heap->mark_overflow = false;
+    gc_mark_rescan(pic);
+  }
+
+  gc_mark_ephemerons(pic);
+  gc_clear_callcache(pic);
 }
 
 static void
@@ -526,7 +1545,6 @@ gc_finalize_object(pic_state *pic, struct pic_object *obj)
     break;
   }
   case PIC_TT_ENV: {
-    pic_free(pic, ((struct pic_env *)obj)->values);
     break;
   }
   case PIC_TT_PROC: {
@@ -581,12 +1599,22 @@ gc_finalize_object(pic_state *pic, struct pic_object *obj)
   case PIC_TT_VAR: {
     break;
   }
+  case PIC_TT_EPHEMERON: {
+    break;
+  }
+  case PIC_TT_WTABLE: {
+    pic_free(pic, ((struct pic_wtable *)obj)->slots);
+    break;
+  }
   case PIC_TT_IREP: {
     struct pic_irep *irep = (struct pic_irep *)obj;
     pic_free(pic, irep->code);
     pic_free(pic, irep->cv_tbl);
     pic_free(pic, irep->irep);
     pic_free(pic, irep->pool);
+#if PIC_ENABLE_JIT
+    pic_jit_free(pic, irep);
+#endif
     break;
   }
   case PIC_TT_NIL:
@@ -601,6 +1629,15 @@ gc_finalize_object(pic_state *pic, struct pic_object *obj)
   }
 }
 
+/* p survived and is now old */
+static void
+gc_promote(struct pic_heap *heap, union header *p)
+{
+  gc_unmark(p);
+  p->s.old = 1;
+  heap->stats.objects[((struct pic_object *)(p + 1))->tt]++;
+}
+
 static void
 gc_sweep_page(pic_state *pic, struct heap_page *page)
 {
@@ -630,7 +1667,9 @@ gc_sweep_page(pic_state *pic, struct heap_page *page)
 	t = p;
 	t->s.ptr = NIL; /* For dead objects we can safely reuse ptr field */
       }
-      gc_unmark(p);
+      else {
+        gc_promote(pic->heap, p);
+      }
     }
   }
  escape:
@@ -652,33 +1691,204 @@ gc_sweep_page(pic_state *pic, struct heap_page *page)
 #endif
 }
 
+/* rebuilds the page's share of the free list: free slots and dead objects.
+   returns false if the page turned out empty and is to be released */
+static bool
+gc_sweep_class_page(pic_state *pic, struct heap_class *cls, struct heap_page *page)
+{
+  union header *p, *freep = NULL, *tail = NULL;
+  size_t live = 0;
+
+  for (p = page->basep; p != page->endp; p += cls->nunits) {
+    if (p->s.size != 0) {
+      if (gc_is_marked(p)) {
+        gc_promote(pic->heap, p);
+        live++;
+        continue;
+      }
+      gc_finalize_object(pic, (struct pic_object *)(p + 1));
+#if GC_DEBUG
+      memset(p + 1, 0xAA, (cls->nunits - 1) * sizeof(union header));
+#endif
+      p->s.size = 0;
+    }
+    if (tail == NULL) {
+      tail = p;
+    }
+    p->s.ptr = freep;
+    freep = p;
+  }
+
+  if (live == 0 && gc_page_releasable(pic->heap, page)) {
+    return false;
+  }
+  if (tail != NULL) {
+    tail->s.ptr = cls->freep;
+    cls->freep = freep;
+  }
+  return true;
+}
+
+static void
+gc_sweep_next_class_page(pic_state *pic, struct heap_class *cls)
+{
+  struct heap_page *page = *cls->sweep;
+
+  if (gc_sweep_class_page(pic, cls, page)) {
+    cls->sweep = &page->next;
+  }
+  else {
+    *cls->sweep = page->next;
+    cls->size -= page->size;
+    gc_page_unmap(pic->heap, page);
+  }
+  if (*cls->sweep == NULL) {
+    cls->sweep = NULL;
+  }
+}
+
+/* unlink a completely free large-object page from the free list */
+static bool
+gc_release_heap_page(pic_state *pic, struct heap_page *page)
+{
+  struct pic_heap *heap = pic->heap;
+  union header *up = page->basep, *p;
+
+  if (up->s.ptr != up + 1 || (up + 1)->s.size != (size_t)(page->endp - up - 1))
+    return false;
+  if (! gc_page_releasable(heap, page))
+    return false;
+
+  for (p = heap->freep; p->s.ptr != up; p = p->s.ptr)
+    ;
+  p->s.ptr = (up + 1)->s.ptr;
+  heap->freep = p;
+  return true;
+}
+
 static void
 gc_sweep_phase(pic_state *pic)
 {
-  struct heap_page *page = pic->heap->pages;
+  struct heap_page *page, **link;
+  struct heap_class *cls;
+  size_t i;
 
-  while (page) {
+  /* large objects are few; sweep them now */
+  link = &pic->heap->pages;
+  while ((page = *link) != NULL) {
     gc_sweep_page(pic, page);
-    page = page->next;
+    if (gc_release_heap_page(pic, page)) {
+      *link = page->next;
+      pic->heap->large_size -= page->size;
+      gc_page_unmap(pic->heap, page);
+    }
+    else {
+      link = &page->next;
+    }
+  }
+
+  link = &pic->heap->huge;
+  while ((page = *link) != NULL) {
+    if (gc_is_marked(page->basep)) {
+      gc_promote(pic->heap, page->basep);
+      link = &page->next;
+    }
+    else {
+      gc_finalize_object(pic, (struct pic_object *)(page->basep + 1));
+      *link = page->next;
+      gc_page_unmap(pic->heap, page);
+    }
+  }
+
+  /* slab pages are swept lazily by gc_alloc_small */
+  for (i = 1; i <= PIC_HEAP_CLASS_MAX; ++i) {
+    cls = &pic->heap->classes[i];
+    cls->freep = NULL;
+    cls->sweep = cls->pages ? &cls->pages : NULL;
   }
 }
 
-void
-pic_gc_run(pic_state *pic)
+static void
+gc_sweep_finish(pic_state *pic)
 {
-#if GC_DEBUG
-  struct heap_page *page;
-#endif
+  struct heap_class *cls;
+  size_t i;
+
+  for (i = 1; i <= PIC_HEAP_CLASS_MAX; ++i) {
+    cls = &pic->heap->classes[i];
+    while (cls->sweep != NULL) {
+      gc_sweep_next_class_page(pic, cls);
+    }
+  }
+}
 
+static void
+gc_sweep_young(pic_state *pic)
+{
+  struct pic_heap *heap = pic->heap;
+  union header *p, *next;
+
+  for (p = heap->young; p != NULL; p = next) {
+    next = p->s.ptr;
+    if (! gc_is_marked(p)) {
+      gc_finalize_object(pic, (struct pic_object *)(p + 1));
+      gc_release(pic, p);
+    }
+    else {
+      gc_promote(heap, p);
+      heap->old_size += p->s.size;
+    }
+  }
+  heap->young = NULL;
+  heap->young_size = 0;
+}
+
+static void
+gc_minor(pic_state *pic)
+{
 #if DEBUG
-  puts("gc run!");
+  puts("minor gc run!");
 #endif
 
+  gc_retire_lab(pic);
+
+  pic->heap->minor = true;
   gc_mark_phase(pic);
+  pic->heap->minor = false;
+
+  gc_sweep_young(pic);
+
+  pic->heap->stats.live = pic->heap->old_size * sizeof(union header);
+}
+
+static void
+gc_major_finish(pic_state *pic)
+{
+  struct pic_heap *heap = pic->heap;
+#if GC_DEBUG
+  struct heap_page *page;
+#endif
+
+  gc_retire_lab(pic);
+
+  /* size the heap for the target occupancy; empty pages beyond it are unmapped */
+  heap->old_size = heap->marked_size;
+  heap->major_threshold = heap->old_size * 100 / PIC_HEAP_OCCUPANCY + PIC_NURSERY_SIZE / sizeof(union header);
+  heap->target_size = heap->major_threshold * sizeof(union header);
+
+  /* survivors are counted again as their pages get swept */
+  heap->stats.live = heap->marked_size * sizeof(union header);
+  memset(heap->stats.objects, 0, sizeof heap->stats.objects);
+
   gc_sweep_phase(pic);
 
+  /* every survivor has been promoted */
+  heap->young = NULL;
+  heap->young_size = 0;
+  heap->phase = PIC_GC_PHASE_NONE;
+
 #if GC_DEBUG
-  for (page = pic->heap->pages; page; page = page->next) {
+  for (page = heap->pages; page; page = page->next) {
     union header *bp, *p;
     unsigned char *c;
 
@@ -691,7 +1901,7 @@ pic_gc_run(pic_state *pic)
 	  /* if (page->next) */
 	  /*   assert(bp->s.ptr == page->next->basep); */
 	  /* else */
-	  /*   assert(bp->s.ptr == &pic->heap->base); */
+	  /*   assert(bp->s.ptr == &heap->base); */
 	  goto escape;
 	}
 	assert(! gc_is_marked(p));
@@ -705,6 +1915,215 @@ pic_gc_run(pic_state *pic)
 #endif
 }
 
+static void
+gc_major(pic_state *pic)
+{
+#if DEBUG
+  puts("gc run!");
+#endif
+
+  gc_sweep_finish(pic);
+  gc_retire_lab(pic);
+
+  pic->heap->marked_size = 0;
+  gc_mark_phase(pic);
+  gc_major_finish(pic);
+}
+
+/* incremental marking: grey the roots and let allocation drive the rest */
+static void
+gc_mark_start(pic_state *pic)
+{
+#if DEBUG
+  puts("incremental gc start!");
+#endif
+
+  gc_sweep_finish(pic);
+
+  pic->heap->phase = PIC_GC_PHASE_MARK;
+  pic->heap->marked_size = 0;
+  gc_mark_roots(pic);
+}
+
+static void
+gc_mark_step(pic_state *pic, clock_t start)
+{
+  struct pic_heap *heap = pic->heap;
+  clock_t budget;
+  int n = 0;
+
+  budget = (clock_t)((double)heap->pause_target * CLOCKS_PER_SEC / 1000000);
+
+  while (heap->mslen > 0) {
+    gc_mark_children(pic, heap->mstack[--heap->mslen]);
+    if (++n % 64 == 0 && clock() - start >= budget)
+      return;
+  }
+
+  /* grey set exhausted; roots and barriered objects are rescanned atomically */
+  gc_mark_phase(pic);
+  gc_major_finish(pic);
+}
+
+static void
+gc_record_pause(pic_state *pic, clock_t start)
+{
+  struct pic_gc_stats *stats = &pic->heap->stats;
+  unsigned long pause;
+
+  pause = (unsigned long)((double)(clock() - start) * 1000000 / CLOCKS_PER_SEC);
+
+  stats->total_pause += pause;
+  if (stats->max_pause < pause) {
+    stats->max_pause = pause;
+  }
+}
+
+static void
+gc_event(pic_state *pic, enum pic_gc_event event)
+{
+  if (pic->heap->hook) {
+    pic->heap->hook(pic, event, pic->heap->hook_data);
+  }
+}
+
+void
+pic_gc_run(pic_state *pic)
+{
+  clock_t start;
+
+  gc_event(pic, PIC_GC_START);
+  start = clock();
+
+  if (pic->heap->phase == PIC_GC_PHASE_MARK) {
+    gc_mark_phase(pic);
+    gc_major_finish(pic);
+    pic->heap->stats.collections++;
+  }
+  gc_major(pic);
+  gc_sweep_finish(pic);
+  pic->heap->stats.collections++;
+
+  gc_record_pause(pic, start);
+  gc_event(pic, PIC_GC_END);
+}
+
+static void
+gc_collect(pic_state *pic)
+{
+  struct pic_heap *heap = pic->heap;
+  clock_t start;
+
+  gc_event(pic, PIC_GC_START);
+  start = clock();
+
+  if (heap->phase == PIC_GC_PHASE_MARK) {
+    gc_mark_step(pic, start);
+    if (heap->phase == PIC_GC_PHASE_NONE) {
+      heap->stats.collections++;
+    }
+  }
+  else if (heap->old_size >= heap->major_threshold) {
+    if (heap->pause_target > 0) {
+      gc_mark_start(pic);
+    }
+    else {
+      gc_major(pic);
+      heap->stats.collections++;
+    }
+  }
+  else {
+    gc_minor(pic);
+    heap->stats.collections++;
+  }
+
+  /* during incremental marking, step again after the next quantum */
+  if (heap->phase == PIC_GC_PHASE_MARK) {
+    heap->alloc_trigger = heap->young_size + PIC_GC_STEP_SIZE / sizeof(union header);
+  }
+  else {
+    heap->alloc_trigger = PIC_NURSERY_SIZE / sizeof(union header);
+  }
+
+  gc_record_pause(pic, start);
+  gc_event(pic, PIC_GC_END);
+}
+
+void
+pic_gc_set_pause_target(pic_state *pic, unsigned long usec)
+{
+  pic->heap->pause_target = usec;
+}
+
+void
+pic_gc_stats(pic_state *pic, struct pic_gc_stats *stats)
+{
+  /* finish the lazy sweep so that the object counts are exact */
+  gc_sweep_finish(pic);
+
+  *stats = pic->heap->stats;
+}
+
+void
+pic_gc_set_hook(pic_state *pic, pic_gc_hook_t hook, void *data)
+{
+  pic->heap->hook = hook;
+  pic->heap->hook_data = data;
+}
+
+static void
+gc_scheme_hook(pic_state *pic, enum pic_gc_event event, void *data)
+{
+  UNUSED(data);
+
+  if (event == PIC_GC_END) {
+    pic->heap->hook_pending = true;
+  }
+}
+
+/* Scheme code cannot run inside a pause, nor wherever the VM holds values
+   off its stack; this is called from safe points instead */
+void
+pic_gc_run_hook(pic_state *pic)
+{
+  int ai;
+
+  pic->heap->hook_pending = false;
+
+  ai = pic_gc_arena_preserve(pic);
+  pic_apply(pic, pic->heap->hook_proc, pic_nil_value());
+  pic_gc_arena_restore(pic, ai);
+}
+
+void
+pic_gc_write_barrier(pic_state *pic, struct pic_object *obj)
+{
+  struct pic_heap *heap = pic->heap;
+  union header *p;
+
+  p = ((union header *)obj) - 1;
+
+  if (p->s.remembered)
+    return;
+
+  /* a scanned object got a new field: remember it once, and the final
+     mark rescans it; everything marked is promoted after that anyway */
+  if (heap->phase == PIC_GC_PHASE_MARK) {
+    if (! gc_is_marked(p))
+      return;
+  }
+  else if (! gc_is_old(p)) {
+    return;
+  }
+
+  if (heap->rslen >= heap->rscapa) {
+    heap->rscapa = heap->rscapa * 2 + 32;
+    heap->remset = pic_realloc(pic, heap->remset, sizeof(struct pic_object *) * heap->rscapa);
+  }
+  heap->remset[heap->rslen++] = obj;
+  p->s.remembered = 1;
+}
+
 struct pic_object *
 pic_obj_alloc_unsafe(pic_state *pic, size_t size, enum pic_tt tt)
 {
@@ -715,19 +2134,20 @@ pic_obj_alloc_unsafe(pic_state *pic, size_t size, enum pic_tt tt)
 #endif
 
 #if GC_STRESS
-  pic_gc_run(pic);
+  gc_collect(pic);
+#else
+  if (pic->heap->young_size >= pic->heap->alloc_trigger) {
+    gc_collect(pic);
+  }
 #endif
 
   obj = (struct pic_object *)gc_alloc(pic, size);
   if (obj == NULL) {
-    pic_gc_run(pic);
+    /* collections are paced by the nursery budget; just grow the heap */
+    gc_add_page(pic, size);
     obj = (struct pic_object *)gc_alloc(pic, size);
-    if (obj == NULL) {
-      add_heap_page(pic);
-      obj = (struct pic_object *)gc_alloc(pic, size);
-      if (obj == NULL)
-	pic_abort(pic, "GC memory exhausted");
-    }
+    if (obj == NULL)
+      pic_abort(pic, "GC memory exhausted");
   }
   obj->tt = tt;
 
@@ -744,3 +2164,91 @@ pic_obj_alloc(pic_state *pic, size_t size, enum pic_tt tt)
   gc_protect(pic, obj);
   return obj;
 }
+
+static pic_value
+gc_size_value(size_t n)
+{
+  if (n > INT_MAX) {
+    return pic_float_value((double)n);
+  }
+  return pic_int_value((int)n);
+}
+
+static pic_value
+pic_gc_gc_run(pic_state *pic)
+{
+  pic_get_args(pic, "");
+
+  pic_gc_run(pic);
+
+  if (pic->heap->hook_pending) {
+    pic_gc_run_hook(pic);
+  }
+
+  return pic_none_value();
+}
+
+static pic_value
+pic_gc_gc_stats(pic_state *pic)
+{
+  struct pic_gc_stats stats;
+  pic_value objs = pic_nil_value(), alist = pic_nil_value();
+  int tt, ai;
+
+  pic_get_args(pic, "");
+
+  pic_gc_stats(pic, &stats);
+
+  ai = pic_gc_arena_preserve(pic);
+  for (tt = PIC_TT_IREP; tt >= PIC_TT_PAIR; --tt) {
+    objs = pic_acons(pic, pic_symbol_value(pic_intern_cstr(pic, pic_type_repr(tt))), gc_size_value(stats.objects[tt]), objs);
+    pic_gc_arena_restore(pic, ai);
+    pic_gc_protect(pic, objs);
+  }
+
+#define PUSH_STAT(name, val)                                            \
+  alist = pic_acons(pic, pic_symbol_value(pic_intern_cstr(pic, name)), val, alist)
+
+  PUSH_STAT("objects", objs);
+  PUSH_STAT("pages", gc_size_value(stats.pages));
+  PUSH_STAT("live", gc_size_value(stats.live));
+  PUSH_STAT("allocated", gc_size_value(stats.allocated));
+  PUSH_STAT("max-pause", gc_size_value(stats.max_pause));
+  PUSH_STAT("total-pause", gc_size_value(stats.total_pause));
+  PUSH_STAT("collections", gc_size_value(stats.collections));
+
+  return alist;
+}
+
+static pic_value
+pic_gc_gc_set_hook(pic_state *pic)
+{
+  pic_value proc;
+
+  pic_get_args(pic, "o", &proc);
+
+  if (pic_false_p(proc)) {
+    pic->heap->hook_proc = NULL;
+    pic_gc_set_hook(pic, NULL, NULL);
+  }
+  else if (pic_proc_p(proc)) {
+    pic->heap->hook_proc = pic_proc_ptr(proc);
+    pic_gc_set_hook(pic, gc_scheme_hook, NULL);
+  }
+  else {
+    pic_error(pic, "expected procedure or #f");
+  }
+  pic->heap->hook_pending = false;
+
+  return pic_none_value();
+}
+
+void
+pic_init_gc(pic_state *pic)
+{
+  pic_deflibrary ("(picrin gc)") {
+    pic_defun(pic, "gc-run", pic_gc_gc_run);
+    pic_defun(pic, "gc-stats", pic_gc_gc_stats);
+    pic_defun(pic, "gc-set-hook!", pic_gc_gc_set_hook);
+  }
+}
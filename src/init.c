@@ -30,6 +30,8 @@ void pic_init_macro(pic_state *);
 void pic_init_var(pic_state *);
 void pic_init_load(pic_state *);
 void pic_init_write(pic_state *);
+void pic_init_gc(pic_state *);
+void pic_init_weak(pic_state *);
 
 void
 pic_load_stdlib(pic_state *pic)
@@ -37,7 +39,7 @@ pic_load_stdlib(pic_state *pic)
   static const char *filename = "piclib/built-in.scm";
   jmp_buf jmp, *prev_jmp = pic->jmp;
 
-  if (setjmp(jmp) == 0) {
+  if (PIC_SETJMP(jmp) == 0) {
     pic->jmp = &jmp;
   }
   else {
@@ -86,6 +88,7 @@ pic_init_core(pic_state *pic)
 
   /* load core syntaces */
   pic->lib->senv = pic_core_syntactic_env(pic);
+  pic_gc_write_barrier(pic, (struct pic_object *)pic->lib);
   pic_export(pic, pic_intern_cstr(pic, "define"));
   pic_export(pic, pic_intern_cstr(pic, "set!"));
   pic_export(pic, pic_intern_cstr(pic, "quote"));
@@ -114,6 +117,8 @@ pic_init_core(pic_state *pic)
   pic_init_var(pic); DONE;
   pic_init_load(pic); DONE;
   pic_init_write(pic); DONE;
+  pic_init_gc(pic); DONE;
+  pic_init_weak(pic); DONE;
 
   pic_load_stdlib(pic); DONE;
 
@@ -0,0 +1,548 @@
+/**
+ * See Copyright Notice in picrin.h
+ */
+
+#include "picrin.h"
+
+#if PIC_ENABLE_JIT
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "picrin/irep.h"
+#include "picrin/pair.h"
+#include "picrin/proc.h"
+#include "picrin/jit.h"
+
+/**
+ * Each instruction of an irep is translated into a template of x86-64
+ * code that handles its common case only. Anything else, including
+ * calls, returns and allocation, leaves the native code with the
+ * instruction still to do, and the interpreter carries on from there.
+ *
+ * While native code runs:
+ *   rbx = pic, r12 = pic->sp, r13 = pic->ci->fp, r14 = pic->stend
+ */
+
+enum {
+  RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+  R12 = 12, R13 = 13, R14 = 14
+};
+
+enum {
+  CC_O = 0x0, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+  CC_L = 0xc, CC_LE = 0xe
+};
+
+/* values are copied as two quadwords */
+typedef char jit_value_layout_check[sizeof(pic_value) == 16 && offsetof(pic_value, u) == 8 ? 1 : -1];
+
+#define VSIZE 16
+#define VDATA 8
+
+struct jit_fixup {
+  size_t at;                    /* offset of a rel32 */
+  size_t slot;
+  bool exit;                    /* to the exit trampoline of slot */
+};
+
+typedef struct {
+  pic_state *pic;
+  struct pic_irep *irep;
+
+  unsigned char *buf;
+  size_t len, capa;
+
+  struct jit_fixup *fix;
+  size_t flen, fcapa;
+
+  size_t exit;                  /* offset of the exit stub */
+  size_t *ofs, *exits;          /* offsets of each slot and its trampoline */
+} jit_state;
+
+static void
+emit_byte(jit_state *j, unsigned char b)
+{
+  if (j->len >= j->capa) {
+    j->capa *= 2;
+    j->buf = (unsigned char *)pic_realloc(j->pic, j->buf, j->capa);
+  }
+  j->buf[j->len++] = b;
+}
+
+static void
+emit_u32(jit_state *j, uint32_t x)
+{
+  int i;
+
+  for (i = 0; i < 4; ++i) {
+    emit_byte(j, (x >> (i * 8)) & 0xff);
+  }
+}
+
+static void
+emit_u64(jit_state *j, uint64_t x)
+{
+  emit_u32(j, (uint32_t)x);
+  emit_u32(j, (uint32_t)(x >> 32));
+}
+
+static void
+emit_rex(jit_state *j, int w, int reg, int base)
+{
+  int rex = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | ((base >> 3) & 1);
+
+  if (rex != 0x40) {
+    emit_byte(j, rex);
+  }
+}
+
+/* op reg, [base + disp] */
+static void
+emit_rm(jit_state *j, int w, int op, int reg, int base, int disp)
+{
+  int mod;
+
+  emit_rex(j, w, reg, base);
+  if (op > 0xff) {
+    emit_byte(j, op >> 8);
+  }
+  emit_byte(j, op & 0xff);
+
+  if (disp == 0 && (base & 7) != RBP) {
+    mod = 0;
+  }
+  else if (-128 <= disp && disp <= 127) {
+    mod = 1;
+  }
+  else {
+    mod = 2;
+  }
+  emit_byte(j, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) {
+    emit_byte(j, 0x24);
+  }
+  if (mod == 1) {
+    emit_byte(j, disp & 0xff);
+  }
+  else if (mod == 2) {
+    emit_u32(j, (uint32_t)disp);
+  }
+}
+
+/* op reg, rm where both are registers */
+static void
+emit_rr(jit_state *j, int w, int op, int reg, int rm)
+{
+  emit_rex(j, w, reg, rm);
+  if (op > 0xff) {
+    emit_byte(j, op >> 8);
+  }
+  emit_byte(j, op & 0xff);
+  emit_byte(j, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+#define MOV_LOAD 0x8b
+#define MOV_STORE 0x89
+#define ADD_LOAD 0x03
+#define SUB_LOAD 0x2b
+#define CMP_LOAD 0x3b
+#define IMUL_LOAD 0x0faf
+#define CMP_STORE 0x39
+#define LEA 0x8d
+
+static void
+emit_mov_imm(jit_state *j, int reg, uint64_t imm)
+{
+  emit_rex(j, imm > UINT32_MAX, 0, reg);
+  emit_byte(j, 0xb8 | (reg & 7));
+  if (imm > UINT32_MAX) {
+    emit_u64(j, imm);
+  }
+  else {
+    emit_u32(j, (uint32_t)imm);   /* zero-extended */
+  }
+}
+
+/* mov dword/qword [base + disp], imm32 */
+static void
+emit_store_imm(jit_state *j, int w, int base, int disp, uint32_t imm)
+{
+  emit_rm(j, w, 0xc7, 0, base, disp);
+  emit_u32(j, imm);
+}
+
+/* cmp dword [base + disp], imm8 */
+static void
+emit_cmp_imm(jit_state *j, int base, int disp, int imm)
+{
+  emit_rm(j, 0, 0x83, 7, base, disp);
+  emit_byte(j, imm & 0xff);
+}
+
+/* add or sub (ext = 0 or 5) reg, imm32 */
+static void
+emit_alu_imm(jit_state *j, int w, int ext, int reg, uint32_t imm)
+{
+  emit_rr(j, w, 0x81, ext, reg);
+  emit_u32(j, imm);
+}
+
+static void
+emit_label(jit_state *j, size_t slot, bool exit)
+{
+  if (j->flen >= j->fcapa) {
+    j->fcapa *= 2;
+    j->fix = (struct jit_fixup *)pic_realloc(j->pic, j->fix, sizeof(struct jit_fixup) * j->fcapa);
+  }
+  j->fix[j->flen].at = j->len;
+  j->fix[j->flen].slot = slot;
+  j->fix[j->flen].exit = exit;
+  j->flen++;
+  emit_u32(j, 0);
+}
+
+static void
+emit_jmp(jit_state *j, size_t slot, bool exit)
+{
+  emit_byte(j, 0xe9);
+  emit_label(j, slot, exit);
+}
+
+static void
+emit_jcc(jit_state *j, int cc, size_t slot, bool exit)
+{
+  emit_byte(j, 0x0f);
+  emit_byte(j, 0x80 | cc);
+  emit_label(j, slot, exit);
+}
+
+/* leave to the interpreter at slot i unless n more values fit the stack */
+static void
+emit_check_push(jit_state *j, size_t i, int n)
+{
+  if (n == 1) {
+    emit_rr(j, 1, CMP_STORE, R14, R12);
+    emit_jcc(j, CC_AE, i, true);
+  }
+  else {
+    emit_rm(j, 1, LEA, RAX, R12, n * VSIZE);
+    emit_rr(j, 1, CMP_STORE, R14, RAX);
+    emit_jcc(j, CC_A, i, true);
+  }
+}
+
+static void
+emit_copy(jit_state *j, int dst, int ddisp, int src, int sdisp)
+{
+  emit_rm(j, 1, MOV_LOAD, RAX, src, sdisp);
+  emit_rm(j, 1, MOV_LOAD, RCX, src, sdisp + 8);
+  emit_rm(j, 1, MOV_STORE, RAX, dst, ddisp);
+  emit_rm(j, 1, MOV_STORE, RCX, dst, ddisp + 8);
+}
+
+static void
+emit_push_value(jit_state *j, size_t i, pic_value v)
+{
+  emit_check_push(j, i, 1);
+  emit_store_imm(j, 0, R12, 0, pic_vtype(v));
+  emit_mov_imm(j, RAX, (uint64_t)(uintptr_t)v.u.data);
+  emit_rm(j, 1, MOV_STORE, RAX, R12, VDATA);
+  emit_alu_imm(j, 1, 0, R12, VSIZE);
+}
+
+static void
+emit_push_from(jit_state *j, size_t i, int base, int disp)
+{
+  emit_check_push(j, i, 1);
+  emit_copy(j, R12, 0, base, disp);
+  emit_alu_imm(j, 1, 0, R12, VSIZE);
+}
+
+/* leave to the interpreter unless the value at [r12 + disp] has type t */
+static void
+emit_check_type(jit_state *j, size_t i, int disp, enum pic_vtype t)
+{
+  emit_cmp_imm(j, R12, disp, t);
+  emit_jcc(j, CC_NE, i, true);
+}
+
+/* store the boolean of cc to the value at [r12 + disp] */
+static void
+emit_store_bool(jit_state *j, int cc, int disp)
+{
+  emit_byte(j, 0x0f);           /* setcc al */
+  emit_byte(j, 0x90 | cc);
+  emit_byte(j, 0xc0);
+  emit_rr(j, 0, 0x0fb6, RAX, RAX); /* movzx eax, al */
+  emit_mov_imm(j, RCX, PIC_VTYPE_FALSE);
+  emit_rr(j, 0, 0x2b, RCX, RAX); /* sub ecx, eax */
+  emit_rm(j, 0, MOV_STORE, RCX, R12, disp);
+  emit_store_imm(j, 1, R12, disp + VDATA, 0);
+}
+
+/* compare the two fixnums on top of the stack, leaving flags set */
+static void
+emit_compare(jit_state *j, size_t i)
+{
+  emit_check_type(j, i, -2 * VSIZE, PIC_VTYPE_INT);
+  emit_check_type(j, i, -VSIZE, PIC_VTYPE_INT);
+  emit_rm(j, 0, MOV_LOAD, RAX, R12, -2 * VSIZE + VDATA);
+  emit_rm(j, 0, CMP_LOAD, RAX, R12, -VSIZE + VDATA);
+}
+
+static int
+compare_cc(enum pic_opcode insn)
+{
+  switch (insn) {
+  case OP_EQ: case OP_EQJMPIF:
+    return CC_E;
+  case OP_LT: case OP_LTJMPIF:
+    return CC_L;
+  default:
+    return CC_LE;
+  }
+}
+
+/* returns false if slot i is always left to the interpreter */
+static bool
+jit_insn(jit_state *j, size_t i)
+{
+  struct pic_code *code = j->irep->code, c = code[i];
+  pic_state *pic = j->pic;
+  int d;
+
+  switch (c.insn) {
+  case OP_POP:
+    emit_alu_imm(j, 1, 5, R12, VSIZE);
+    return true;
+  case OP_PUSHNIL:
+    emit_push_value(j, i, pic_nil_value());
+    return true;
+  case OP_PUSHTRUE:
+    emit_push_value(j, i, pic_true_value());
+    return true;
+  case OP_PUSHFALSE:
+    emit_push_value(j, i, pic_false_value());
+    return true;
+  case OP_PUSHINT:
+    emit_push_value(j, i, pic_int_value(c.u.i));
+    return true;
+  case OP_PUSHCHAR:
+    emit_push_value(j, i, pic_char_value(c.u.c));
+    return true;
+  case OP_PUSHCONST:
+    /* the pool is fixed and kept alive by the irep */
+    emit_push_value(j, i, j->irep->pool[c.u.i]);
+    return true;
+  case OP_GREF:
+    /* the global table is never reallocated */
+    emit_mov_imm(j, RDX, (uint64_t)(uintptr_t)&pic->globals[c.u.i]);
+    emit_push_from(j, i, RDX, 0);
+    return true;
+  case OP_GSET:
+    emit_mov_imm(j, RDX, (uint64_t)(uintptr_t)&pic->globals[c.u.i]);
+    emit_alu_imm(j, 1, 5, R12, VSIZE);
+    emit_copy(j, RDX, 0, R12, 0);
+    return true;
+  case OP_LREF:
+    emit_push_from(j, i, R13, c.u.i * VSIZE);
+    return true;
+  case OP_LSET:
+    emit_alu_imm(j, 1, 5, R12, VSIZE);
+    emit_copy(j, R13, c.u.i * VSIZE, R12, 0);
+    return true;
+  case OP_CREF:
+    emit_check_push(j, i, 1);
+    emit_rm(j, 1, MOV_LOAD, RDX, RBX, offsetof(pic_state, ci));
+    emit_rm(j, 1, MOV_LOAD, RDX, RDX, offsetof(pic_callinfo, env));
+    emit_copy(j, R12, 0, RDX, offsetof(struct pic_env, values) + c.u.i * VSIZE);
+    emit_alu_imm(j, 1, 0, R12, VSIZE);
+    return true;
+  case OP_UNBOX:
+    /* boxes are pairs made by the compiler */
+    emit_rm(j, 1, MOV_LOAD, RDX, R12, -VSIZE + VDATA);
+    emit_copy(j, R12, -VSIZE, RDX, offsetof(struct pic_pair, car));
+    return true;
+  case OP_JMP:
+    emit_jmp(j, i + c.u.i, false);
+    return true;
+  case OP_JMPIF:
+    emit_alu_imm(j, 1, 5, R12, VSIZE);
+    emit_cmp_imm(j, R12, 0, PIC_VTYPE_FALSE);
+    emit_jcc(j, CC_NE, i + c.u.i, false);
+    return true;
+  case OP_CAR:
+  case OP_CDR:
+    d = c.insn == OP_CAR ? offsetof(struct pic_pair, car) : offsetof(struct pic_pair, cdr);
+    emit_check_type(j, i, -VSIZE, PIC_VTYPE_HEAP);
+    emit_rm(j, 1, MOV_LOAD, RDX, R12, -VSIZE + VDATA);
+    emit_cmp_imm(j, RDX, 0, PIC_TT_PAIR);
+    emit_jcc(j, CC_NE, i, true);
+    emit_copy(j, R12, -VSIZE, RDX, d);
+    return true;
+  case OP_NILP:
+    emit_cmp_imm(j, R12, -VSIZE, PIC_VTYPE_NIL);
+    emit_store_bool(j, CC_E, -VSIZE);
+    return true;
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MUL:
+    emit_check_type(j, i, -2 * VSIZE, PIC_VTYPE_INT);
+    emit_check_type(j, i, -VSIZE, PIC_VTYPE_INT);
+    emit_rm(j, 0, MOV_LOAD, RAX, R12, -2 * VSIZE + VDATA);
+    emit_rm(j, 0, c.insn == OP_ADD ? ADD_LOAD : c.insn == OP_SUB ? SUB_LOAD : IMUL_LOAD, RAX, R12, -VSIZE + VDATA);
+    emit_jcc(j, CC_O, i, true);
+    emit_rm(j, 1, MOV_STORE, RAX, R12, -2 * VSIZE + VDATA);
+    emit_alu_imm(j, 1, 5, R12, VSIZE);
+    return true;
+  case OP_MINUS:
+    emit_check_type(j, i, -VSIZE, PIC_VTYPE_INT);
+    emit_rm(j, 0, MOV_LOAD, RAX, R12, -VSIZE + VDATA);
+    emit_rr(j, 0, 0xf7, 3, RAX);  /* neg eax */
+    emit_jcc(j, CC_O, i, true);
+    emit_rm(j, 1, MOV_STORE, RAX, R12, -VSIZE + VDATA);
+    return true;
+  case OP_EQ:
+  case OP_LT:
+  case OP_LE:
+    emit_compare(j, i);
+    emit_store_bool(j, compare_cc(c.insn), -2 * VSIZE);
+    emit_alu_imm(j, 1, 5, R12, VSIZE);
+    return true;
+  case OP_LREF2:
+    emit_check_push(j, i, 2);
+    emit_copy(j, R12, 0, R13, c.u.i * VSIZE);
+    emit_copy(j, R12, VSIZE, R13, code[i + 1].u.i * VSIZE);
+    emit_alu_imm(j, 1, 0, R12, 2 * VSIZE);
+    emit_jmp(j, i + 2, false);
+    return true;
+  case OP_LREFADDI:
+  case OP_LREFSUBI:
+    emit_check_push(j, i, 1);
+    emit_cmp_imm(j, R13, c.u.i * VSIZE, PIC_VTYPE_INT);
+    emit_jcc(j, CC_NE, i, true);
+    emit_rm(j, 0, MOV_LOAD, RAX, R13, c.u.i * VSIZE + VDATA);
+    emit_alu_imm(j, 0, c.insn == OP_LREFADDI ? 0 : 5, RAX, (uint32_t)code[i + 1].u.i);
+    emit_jcc(j, CC_O, i, true);
+    emit_store_imm(j, 0, R12, 0, PIC_VTYPE_INT);
+    emit_rm(j, 1, MOV_STORE, RAX, R12, VDATA);
+    emit_alu_imm(j, 1, 0, R12, VSIZE);
+    emit_jmp(j, i + 3, false);
+    return true;
+  case OP_EQJMPIF:
+  case OP_LTJMPIF:
+  case OP_LEJMPIF:
+    emit_compare(j, i);
+    emit_rm(j, 1, LEA, R12, R12, -2 * VSIZE); /* keeps the flags */
+    emit_jcc(j, compare_cc(c.insn), i + 1 + code[i + 1].u.i, false);
+    emit_jmp(j, i + 2, false);
+    return true;
+  default:
+    emit_jmp(j, i, true);
+    return false;
+  }
+}
+
+void
+pic_jit_compile(pic_state *pic, struct pic_irep *irep)
+{
+  jit_state j;
+  struct pic_jit *jit;
+  bool *native;
+  size_t i, target, size;
+  uint32_t rel;
+  void *mem;
+
+  j.pic = pic;
+  j.irep = irep;
+  j.capa = 256;
+  j.len = 0;
+  j.buf = (unsigned char *)pic_alloc(pic, j.capa);
+  j.fcapa = 16;
+  j.flen = 0;
+  j.fix = (struct jit_fixup *)pic_alloc(pic, sizeof(struct jit_fixup) * j.fcapa);
+  j.ofs = (size_t *)pic_calloc(pic, irep->clen, sizeof(size_t));
+  j.exits = (size_t *)pic_calloc(pic, irep->clen, sizeof(size_t));
+  native = (bool *)pic_calloc(pic, irep->clen, sizeof(bool));
+
+  /* entry stub: (pic, target) */
+  emit_byte(&j, 0x53);          /* push rbx */
+  emit_byte(&j, 0x41); emit_byte(&j, 0x54); /* push r12 */
+  emit_byte(&j, 0x41); emit_byte(&j, 0x55); /* push r13 */
+  emit_byte(&j, 0x41); emit_byte(&j, 0x56); /* push r14 */
+  emit_rr(&j, 1, MOV_LOAD, RBX, RDI);
+  emit_rm(&j, 1, MOV_LOAD, R12, RBX, offsetof(pic_state, sp));
+  emit_rm(&j, 1, MOV_LOAD, RAX, RBX, offsetof(pic_state, ci));
+  emit_rm(&j, 1, MOV_LOAD, R13, RAX, offsetof(pic_callinfo, fp));
+  emit_rm(&j, 1, MOV_LOAD, R14, RBX, offsetof(pic_state, stend));
+  emit_rr(&j, 0, 0xff, 4, RSI);  /* jmp rsi */
+
+  /* exit stub: rax holds the next instruction to interpret */
+  j.exit = j.len;
+  emit_rm(&j, 1, MOV_STORE, R12, RBX, offsetof(pic_state, sp));
+  emit_byte(&j, 0x41); emit_byte(&j, 0x5e); /* pop r14 */
+  emit_byte(&j, 0x41); emit_byte(&j, 0x5d); /* pop r13 */
+  emit_byte(&j, 0x41); emit_byte(&j, 0x5c); /* pop r12 */
+  emit_byte(&j, 0x5b);          /* pop rbx */
+  emit_byte(&j, 0xc3);          /* ret */
+
+  for (i = 0; i < irep->clen; ++i) {
+    j.ofs[i] = j.len;
+    native[i] = jit_insn(&j, i);
+  }
+  for (i = 0; i < irep->clen; ++i) {
+    j.exits[i] = j.len;
+    emit_mov_imm(&j, RAX, (uint64_t)(uintptr_t)(irep->code + i));
+    emit_byte(&j, 0xe9);
+    emit_u32(&j, (uint32_t)(j.exit - (j.len + 4)));
+  }
+  for (i = 0; i < j.flen; ++i) {
+    target = j.fix[i].exit ? j.exits[j.fix[i].slot] : j.ofs[j.fix[i].slot];
+    rel = (uint32_t)(target - (j.fix[i].at + 4));
+    memcpy(j.buf + j.fix[i].at, &rel, 4);
+  }
+
+  size = (j.len + 4095) & ~(size_t)4095;
+  mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem != MAP_FAILED) {
+    memcpy(mem, j.buf, j.len);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) == 0) {
+      jit = (struct pic_jit *)pic_alloc(pic, sizeof(struct pic_jit));
+      jit->mem = mem;
+      jit->size = size;
+      jit->addr = (void **)pic_calloc(pic, irep->clen, sizeof(void *));
+      for (i = 0; i < irep->clen; ++i) {
+        if (native[i]) {
+          jit->addr[i] = (char *)mem + j.ofs[i];
+        }
+      }
+      irep->jit = jit;
+    }
+    else {
+      munmap(mem, size);
+    }
+  }
+
+  pic_free(pic, j.buf);
+  pic_free(pic, j.fix);
+  pic_free(pic, j.ofs);
+  pic_free(pic, j.exits);
+  pic_free(pic, native);
+}
+
+void
+pic_jit_free(pic_state *pic, struct pic_irep *irep)
+{
+  if (irep->jit == NULL)
+    return;
+
+  munmap(irep->jit->mem, irep->jit->size);
+  pic_free(pic, irep->jit->addr);
+  pic_free(pic, irep->jit);
+  irep->jit = NULL;
+}
+
+#endif
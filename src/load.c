@@ -2,8 +2,1013 @@
  * See Copyright Notice in picrin.h
  */
 
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+
 #include "picrin.h"
 #include "picrin/pair.h"
+#include "picrin/irep.h"
+#include "picrin/proc.h"
+#include "picrin/blob.h"
+#include "xhash/xhash.h"
+
+#if PIC_ENABLE_LOAD_CACHE
+
+/*
+ * A cache file keeps, for each toplevel form of its source, the irep
+ * compiled from the form. The forms are still macroexpanded on every
+ * load, since the expander binds names and defines macros as it goes,
+ * and an irep is only reused for a form expanding to the same program.
+ * Global variables are written by name, to be resolved again when the
+ * irep is read, and inline caches by their number of arguments only.
+ *
+ *   file:   magic, version, source hash, body hash, entry count, body
+ *   entry:  hash of the expanded form, payload size, payload
+ *   payload (empty when the form can't be cached):
+ *           number of symbols the compiler generated, global names,
+ *           each flagged if it must be bound beforehand, and the irep
+ *
+ * The count of generated symbols is replayed on reading, so that the
+ * forms after expand to the same names as when the file was written.
+ */
+
+#define CACHE_MAGIC 0x63636970  /* "picc" */
+
+/* bump on any change to the instruction set */
+#define CACHE_VERSION 0x002
+
+#define HASH_BASIS 0xcbf29ce484222325ULL
+#define HASH_PRIME 0x100000001b3ULL
+
+struct cache_buf {
+  char *data;
+  size_t len, capa;
+};
+
+struct cache_entry {
+  uint64_t hash;
+  const char *data;             /* the whole entry, payload included */
+  size_t size;                  /* of the payload */
+};
+
+struct cache_reader {
+  const char *ptr, *end;
+};
+
+struct load_cache {
+  char *path;
+  uint64_t src_hash;
+
+  /* the cache file found */
+  char *file;
+  struct cache_entry *entries;
+  size_t elen;
+
+  /* the cache file to write */
+  struct cache_buf body, code;
+  size_t count;
+  bool dirty;
+
+  /* the entry being written */
+  int *gids;
+  size_t glen, gcapa, gbound;
+  int gensyms;
+};
+
+static uint64_t
+hash_bytes(uint64_t h, const void *ptr, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)ptr;
+
+  while (len-- > 0) {
+    h = (h ^ *p++) * HASH_PRIME;
+  }
+  return h;
+}
+
+/* fails on data not written to caches */
+static bool
+hash_value(pic_state *pic, uint64_t *h, pic_value obj)
+{
+  unsigned char tt;
+  const char *name;
+  size_t i;
+  bool b;
+  int n;
+  double f;
+  char c;
+
+  while (true) {
+    tt = pic_type(obj);
+    *h = hash_bytes(*h, &tt, 1);
+
+    switch (pic_type(obj)) {
+    case PIC_TT_NIL:
+      return true;
+    case PIC_TT_BOOL:
+      b = pic_true_p(obj);
+      *h = hash_bytes(*h, &b, sizeof b);
+      return true;
+    case PIC_TT_INT:
+      n = pic_int(obj);
+      *h = hash_bytes(*h, &n, sizeof n);
+      return true;
+    case PIC_TT_FLOAT:
+      f = pic_float(obj);
+      *h = hash_bytes(*h, &f, sizeof f);
+      return true;
+    case PIC_TT_CHAR:
+      c = pic_char(obj);
+      *h = hash_bytes(*h, &c, 1);
+      return true;
+    case PIC_TT_SYMBOL:
+      name = pic_symbol_name(pic, pic_sym(obj));
+      *h = hash_bytes(*h, name, strlen(name) + 1);
+      return true;
+    case PIC_TT_STRING:
+      *h = hash_bytes(*h, &pic_str_ptr(obj)->len, sizeof(size_t));
+      *h = hash_bytes(*h, pic_str_ptr(obj)->str, pic_str_ptr(obj)->len);
+      return true;
+    case PIC_TT_BLOB:
+      *h = hash_bytes(*h, &pic_blob_ptr(obj)->len, sizeof(size_t));
+      *h = hash_bytes(*h, pic_blob_ptr(obj)->data, pic_blob_ptr(obj)->len);
+      return true;
+    case PIC_TT_VECTOR:
+      *h = hash_bytes(*h, &pic_vec_ptr(obj)->len, sizeof(size_t));
+      for (i = 0; i < pic_vec_ptr(obj)->len; ++i) {
+        if (! hash_value(pic, h, pic_vec_ptr(obj)->data[i]))
+          return false;
+      }
+      return true;
+    case PIC_TT_PAIR:
+      if (! hash_value(pic, h, pic_car(pic, obj)))
+        return false;
+      obj = pic_cdr(pic, obj);
+      break;
+    default:
+      return false;
+    }
+  }
+}
+
+static void
+buf_write(pic_state *pic, struct cache_buf *buf, const void *ptr, size_t len)
+{
+  if (buf->len + len > buf->capa) {
+    buf->capa = (buf->len + len) * 2;
+    buf->data = (char *)pic_realloc(pic, buf->data, buf->capa);
+  }
+  memcpy(buf->data + buf->len, ptr, len);
+  buf->len += len;
+}
+
+static void
+buf_write_int(pic_state *pic, struct cache_buf *buf, int n)
+{
+  buf_write(pic, buf, &n, sizeof n);
+}
+
+static void
+buf_write_size(pic_state *pic, struct cache_buf *buf, size_t n)
+{
+  buf_write(pic, buf, &n, sizeof n);
+}
+
+/* lists are written from their last element, for the reader to cons up */
+static bool
+write_value(pic_state *pic, struct cache_buf *buf, pic_value obj)
+{
+  unsigned char tt = pic_type(obj);
+  const char *name;
+  pic_value *elts, v;
+  size_t i, n;
+  bool b;
+  double f;
+  char c;
+
+  buf_write(pic, buf, &tt, 1);
+
+  switch (pic_type(obj)) {
+  case PIC_TT_NIL:
+    return true;
+  case PIC_TT_BOOL:
+    b = pic_true_p(obj);
+    buf_write(pic, buf, &b, sizeof b);
+    return true;
+  case PIC_TT_INT:
+    buf_write_int(pic, buf, pic_int(obj));
+    return true;
+  case PIC_TT_FLOAT:
+    f = pic_float(obj);
+    buf_write(pic, buf, &f, sizeof f);
+    return true;
+  case PIC_TT_CHAR:
+    c = pic_char(obj);
+    buf_write(pic, buf, &c, 1);
+    return true;
+  case PIC_TT_SYMBOL:
+    if (! pic_interned_p(pic, pic_sym(obj)))
+      return false;
+    name = pic_symbol_name(pic, pic_sym(obj));
+    buf_write_size(pic, buf, strlen(name));
+    buf_write(pic, buf, name, strlen(name) + 1);
+    return true;
+  case PIC_TT_STRING:
+    buf_write_size(pic, buf, pic_str_ptr(obj)->len);
+    buf_write(pic, buf, pic_str_ptr(obj)->str, pic_str_ptr(obj)->len + 1);
+    return true;
+  case PIC_TT_BLOB:
+    buf_write_size(pic, buf, pic_blob_ptr(obj)->len);
+    buf_write(pic, buf, pic_blob_ptr(obj)->data, pic_blob_ptr(obj)->len);
+    return true;
+  case PIC_TT_VECTOR:
+    buf_write_size(pic, buf, pic_vec_ptr(obj)->len);
+    for (i = 0; i < pic_vec_ptr(obj)->len; ++i) {
+      if (! write_value(pic, buf, pic_vec_ptr(obj)->data[i]))
+        return false;
+    }
+    return true;
+  case PIC_TT_PAIR:
+    n = 0;
+    for (v = obj; pic_pair_p(v); v = pic_cdr(pic, v)) {
+      ++n;
+    }
+    buf_write_size(pic, buf, n);
+    if (! write_value(pic, buf, v))
+      return false;
+
+    elts = (pic_value *)pic_alloc(pic, sizeof(pic_value) * n);
+    for (i = 0, v = obj; i < n; ++i, v = pic_cdr(pic, v)) {
+      elts[i] = pic_car(pic, v);
+    }
+    for (i = n; i > 0; --i) {
+      if (! write_value(pic, buf, elts[i - 1]))
+        break;
+    }
+    pic_free(pic, elts);
+    return i == 0;
+  default:
+    return false;
+  }
+}
+
+/* the index of global gid in the entry being written */
+static int
+entry_global(pic_state *pic, struct load_cache *cache, int gid)
+{
+  size_t i;
+
+  for (i = 0; i < cache->glen; ++i) {
+    if (cache->gids[i] == gid)
+      return i;
+  }
+  if (cache->glen >= cache->gcapa) {
+    cache->gcapa = cache->gcapa * 2 + 8;
+    cache->gids = (int *)pic_realloc(pic, cache->gids, sizeof(int) * cache->gcapa);
+  }
+  cache->gids[cache->glen] = gid;
+  return cache->glen++;
+}
+
+static bool
+write_irep(pic_state *pic, struct load_cache *cache, struct pic_irep *irep)
+{
+  struct cache_buf *buf = &cache->code;
+  struct pic_code c;
+  size_t i;
+
+  buf_write_int(pic, buf, irep->argc);
+  buf_write_int(pic, buf, irep->localc);
+  buf_write_int(pic, buf, irep->varg);
+  buf_write_size(pic, buf, irep->cv_num);
+  buf_write_size(pic, buf, irep->clen);
+  buf_write_size(pic, buf, irep->ilen);
+  buf_write_size(pic, buf, irep->plen);
+  buf_write_size(pic, buf, irep->cclen);
+
+  buf_write(pic, buf, irep->cv_tbl, sizeof(int) * irep->cv_num);
+  for (i = 0; i < irep->cclen; ++i) {
+    buf_write_int(pic, buf, pic_irep_callcache(irep, i)->argc);
+  }
+
+  for (i = 0; i < irep->clen; ++i) {
+    c = irep->code[i];
+    switch (c.insn) {
+    case OP_GREF:
+    case OP_GSET:
+      c.u.i = entry_global(pic, cache, c.u.i);
+      break;
+    case OP_GCALL:
+    case OP_GTAILCALL:
+      c.u.i = (c.u.i - (irep->clen - i)) / PIC_CALLCACHE_SLOTS;
+      break;
+    default:
+      break;
+    }
+    buf_write_int(pic, buf, c.insn);
+    buf_write_int(pic, buf, c.u.i);
+  }
+
+  for (i = 0; i < irep->ilen; ++i) {
+    if (! write_irep(pic, cache, irep->irep[i]))
+      return false;
+  }
+  for (i = 0; i < irep->plen; ++i) {
+    if (! write_value(pic, buf, irep->pool[i]))
+      return false;
+  }
+  return true;
+}
+
+static void
+write_entry(pic_state *pic, struct load_cache *cache, uint64_t hash, struct pic_irep *irep)
+{
+  struct cache_buf *body = &cache->body;
+  const char *name;
+  size_t start, i;
+
+  cache->code.len = 0;
+  cache->glen = 0;
+  if (irep != NULL && ! write_irep(pic, cache, irep)) {
+    irep = NULL;
+  }
+
+  start = body->len;
+  buf_write(pic, body, &hash, sizeof hash);
+  if (irep == NULL) {
+    buf_write_size(pic, body, 0);
+  }
+  else {
+    buf_write_size(pic, body, 0);   /* patched below */
+    buf_write_int(pic, body, cache->gensyms);
+    buf_write_size(pic, body, cache->glen);
+    for (i = 0; i < cache->glen; ++i) {
+      name = pic->global_names[cache->gids[i]];
+      buf_write_int(pic, body, cache->gids[i] < (int)cache->gbound);
+      buf_write_size(pic, body, strlen(name));
+      buf_write(pic, body, name, strlen(name) + 1);
+    }
+    buf_write(pic, body, cache->code.data, cache->code.len);
+    i = body->len - start - sizeof hash - sizeof(size_t);
+    memcpy(body->data + start + sizeof hash, &i, sizeof i);
+  }
+
+  /* the cache file changes unless the entry is written back the same */
+  if (cache->count >= cache->elen
+      || cache->entries[cache->count].size + sizeof hash + sizeof(size_t) != body->len - start
+      || memcmp(cache->entries[cache->count].data, body->data + start, body->len - start) != 0) {
+    cache->dirty = true;
+  }
+  cache->count++;
+}
+
+static bool
+read_bytes(struct cache_reader *r, void *dst, size_t len)
+{
+  if ((size_t)(r->end - r->ptr) < len)
+    return false;
+  memcpy(dst, r->ptr, len);
+  r->ptr += len;
+  return true;
+}
+
+static bool
+read_int(struct cache_reader *r, int *n)
+{
+  return read_bytes(r, n, sizeof(int));
+}
+
+/* a count of items, each taking at least one byte of what remains */
+static bool
+read_size(struct cache_reader *r, size_t *n)
+{
+  return read_bytes(r, n, sizeof(size_t)) && *n <= (size_t)(r->end - r->ptr);
+}
+
+/* reads a NUL-terminated string of len bytes in place */
+static const char *
+read_cstr(struct cache_reader *r, size_t len)
+{
+  const char *str = r->ptr;
+
+  if ((size_t)(r->end - r->ptr) <= len || memchr(str, '\0', len + 1) != str + len)
+    return NULL;
+  r->ptr += len + 1;
+  return str;
+}
+
+/* the value read is left protected on the arena */
+static bool
+read_value(pic_state *pic, struct cache_reader *r, pic_value *v)
+{
+  unsigned char tt;
+  const char *str;
+  struct pic_vector *vec;
+  pic_value x;
+  size_t i, n;
+  int k, ai;
+  double f;
+  char c;
+
+  if (! read_bytes(r, &tt, 1))
+    return false;
+
+  switch ((enum pic_tt)tt) {
+  case PIC_TT_NIL:
+    *v = pic_nil_value();
+    return true;
+  case PIC_TT_BOOL:
+    if (! read_bytes(r, &c, 1) || (c != 0 && c != 1))
+      return false;
+    *v = pic_bool_value(c);
+    return true;
+  case PIC_TT_INT:
+    if (! read_int(r, &k))
+      return false;
+    *v = pic_int_value(k);
+    return true;
+  case PIC_TT_FLOAT:
+    if (! read_bytes(r, &f, sizeof f))
+      return false;
+    *v = pic_float_value(f);
+    return true;
+  case PIC_TT_CHAR:
+    if (! read_bytes(r, &c, 1))
+      return false;
+    *v = pic_char_value(c);
+    return true;
+  case PIC_TT_SYMBOL:
+    if (! read_size(r, &n) || (str = read_cstr(r, n)) == NULL)
+      return false;
+    *v = pic_symbol_value(pic_intern_cstr(pic, str));
+    return true;
+  case PIC_TT_STRING:
+    if (! read_size(r, &n) || (str = read_cstr(r, n)) == NULL)
+      return false;
+    *v = pic_obj_value(pic_str_new(pic, str, n));
+    return true;
+  case PIC_TT_BLOB:
+    if (! read_size(r, &n))
+      return false;
+    *v = pic_obj_value(pic_blob_new(pic, (char *)r->ptr, n));
+    r->ptr += n;
+    return true;
+  case PIC_TT_VECTOR:
+    if (! read_size(r, &n))
+      return false;
+    vec = pic_vec_new(pic, n);
+    ai = pic_gc_arena_preserve(pic);
+    for (i = 0; i < n; ++i) {
+      if (! read_value(pic, r, &x))
+        return false;
+      vec->data[i] = x;
+      pic_gc_write_barrier(pic, (struct pic_object *)vec);
+      pic_gc_arena_restore(pic, ai);
+    }
+    *v = pic_obj_value(vec);
+    return true;
+  case PIC_TT_PAIR:
+    if (! read_size(r, &n) || ! read_value(pic, r, v))
+      return false;
+    ai = pic_gc_arena_preserve(pic);
+    for (i = 0; i < n; ++i) {
+      if (! read_value(pic, r, &x))
+        return false;
+      *v = pic_cons(pic, x, *v);
+      pic_gc_arena_restore(pic, ai);
+      pic_gc_protect(pic, *v);
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* records that code[t] is reached with d values above the frame */
+static bool
+check_flow(int *depth, struct pic_irep *irep, size_t t, int d, bool jump)
+{
+  enum pic_opcode insn;
+
+  if (d < 0 || t >= irep->clen)
+    return false;
+  /* these take what the instruction just before them left */
+  insn = irep->code[t].insn;
+  if (jump && (insn == OP_UNBOX || insn == OP_SETBOX || insn == OP_CALLV || insn == OP_TAILCALLV))
+    return false;
+  if (depth[t] < 0)
+    depth[t] = d;
+  return depth[t] == d;
+}
+
+/* whether code[i] is followed by the instructions fused into it */
+static bool
+check_fused(struct pic_irep *irep, size_t i, enum pic_opcode next, enum pic_opcode last)
+{
+  if (i + 1 >= irep->clen || irep->code[i + 1].insn != next)
+    return false;
+  return last == OP_STOP || (i + 2 < irep->clen && irep->code[i + 2].insn == last);
+}
+
+/* whether code[i] pushes a box, which UNBOX and SETBOX take on trust */
+static bool
+check_box(struct pic_irep *irep, size_t i, const bool *box, const bool *cvbox)
+{
+  struct pic_code c = irep->code[i];
+
+  return (c.insn == OP_LREF && box[c.u.i]) || (c.insn == OP_CREF && cvbox[c.u.i]);
+}
+
+/*
+ * The VM trusts code to refer only to what its irep holds, so code read
+ * from a cache is checked against it: slots against the frame, closed
+ * variables against the env, constants, children and jump targets
+ * against the irep, and what each instruction pops against the values
+ * it finds above the frame. Globals and call caches are checked as they
+ * are read. Anything out of place makes the entry a miss.
+ *
+ * Codegen only jumps forward, so one pass sees every way into code[i]
+ * before code[i] itself. A superinstruction is checked as the code it
+ * was fused from, which stays in the following slots. Boxes are made by
+ * the BOXes that open the code, and cvbox tells which free variables
+ * the parent passes boxed.
+ */
+static bool
+check_code(pic_state *pic, struct pic_irep *irep, const bool *cvbox)
+{
+  struct pic_code *code = irep->code;
+  struct pic_irep *child;
+  size_t frame, nbox, i, j;
+  int *depth, d, k, pop, push;
+  bool *box, *childbox, next, ok = true;
+
+  if (irep->argc < 0 || irep->localc < 0 || irep->clen == 0 || code[irep->clen - 1].insn != OP_RET)
+    return false;
+  frame = 1 + (size_t)irep->argc + (size_t)irep->localc + (irep->varg && irep->localc == 0);
+
+  box = (bool *)pic_calloc(pic, frame, sizeof(bool));
+  for (nbox = 0; nbox < irep->clen && code[nbox].insn == OP_BOX; ++nbox) {
+    k = code[nbox].u.i;
+    if (k < 0 || (size_t)k >= frame) {
+      pic_free(pic, box);
+      return false;
+    }
+    box[k] = true;
+  }
+
+  depth = (int *)pic_alloc(pic, sizeof(int) * irep->clen);
+  for (i = 0; i < irep->clen; ++i) {
+    depth[i] = -1;
+  }
+  depth[0] = 0;
+
+  for (i = 0; ok && i < irep->clen; ++i) {
+    if ((d = depth[i]) < 0)
+      continue;                 /* not reached */
+    k = code[i].u.i;
+    pop = 0;
+    push = 1;
+    next = true;
+    switch (code[i].insn) {
+    case OP_POP:
+    case OP_GSET:
+    case OP_LSET:
+    case OP_JMPIF:
+      pop = 1;
+      push = 0;
+      break;
+    case OP_SETBOX:
+      pop = 2;
+      push = 0;
+      break;
+    case OP_BOX:
+      push = 0;
+      break;
+    case OP_JMP:
+      push = 0;
+      next = false;
+      break;
+    case OP_UNBOX:
+    case OP_CAR:
+    case OP_CDR:
+    case OP_NILP:
+    case OP_MINUS:
+      pop = 1;
+      break;
+    case OP_CONS:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_EQ:
+    case OP_LT:
+    case OP_LE:
+    case OP_EQJMPIF:
+    case OP_LTJMPIF:
+    case OP_LEJMPIF:
+    case OP_CALLV:
+      pop = 2;
+      break;
+    case OP_CALL:
+      pop = k;
+      break;
+    case OP_GCALL:
+      pop = ((struct pic_callcache *)(code + i + k))->argc;
+      break;
+    case OP_TAILCALL:
+    case OP_VALUES:
+      pop = k;
+      next = false;
+      break;
+    case OP_GTAILCALL:
+      pop = ((struct pic_callcache *)(code + i + k))->argc;
+      next = false;
+      break;
+    case OP_TAILCALLV:
+      pop = 2;
+      next = false;
+      break;
+    case OP_RET:
+    case OP_STOP:
+      pop = 1;
+      next = false;
+      break;
+    default:
+      break;
+    }
+
+    switch (code[i].insn) {
+    case OP_PUSHCONST:
+      ok = k >= 0 && (size_t)k < irep->plen;
+      break;
+    case OP_LAMBDA:
+      ok = k >= 0 && (size_t)k < irep->ilen;
+      break;
+    case OP_LREF:
+      ok = k >= 0 && (size_t)k < frame;
+      break;
+    case OP_LSET:
+      ok = k >= 0 && (size_t)k < frame && ! box[k];
+      break;
+    case OP_CREF:
+      ok = k >= 0 && (size_t)k < irep->cv_num;
+      break;
+    case OP_BOX:
+      ok = i < nbox;
+      break;
+    case OP_UNBOX:
+    case OP_SETBOX:
+      ok = i > 0 && check_box(irep, i - 1, box, cvbox);
+      break;
+    case OP_JMP:
+    case OP_JMPIF:
+      ok = k > 0 && check_flow(depth, irep, i + k, d - pop, true);
+      break;
+    case OP_CALL:
+    case OP_TAILCALL:
+      ok = k >= 1;
+      break;
+    case OP_VALUES:
+      ok = k >= 0;
+      break;
+    case OP_CALLV:
+    case OP_TAILCALLV:
+      ok = i > 0 && code[i - 1].insn == OP_CALL && code[i - 1].u.i == 1;
+      break;
+    case OP_LREF2:
+      ok = k >= 0 && (size_t)k < frame && check_fused(irep, i, OP_LREF, OP_STOP);
+      break;
+    case OP_LREFADDI:
+      ok = k >= 0 && (size_t)k < frame && check_fused(irep, i, OP_PUSHINT, OP_ADD);
+      break;
+    case OP_LREFSUBI:
+      ok = k >= 0 && (size_t)k < frame && check_fused(irep, i, OP_PUSHINT, OP_SUB);
+      break;
+    case OP_EQJMPIF:
+    case OP_LTJMPIF:
+    case OP_LEJMPIF:
+      ok = check_fused(irep, i, OP_JMPIF, OP_STOP);
+      break;
+    default:
+      break;
+    }
+    ok = ok && d >= pop && (! next || check_flow(depth, irep, i + 1, d - pop + push, false));
+  }
+  pic_free(pic, depth);
+
+  /* where OP_LAMBDA fetches the free variables of each child */
+  for (i = 0; ok && i < irep->ilen; ++i) {
+    child = irep->irep[i];
+    childbox = (bool *)pic_calloc(pic, child->cv_num, sizeof(bool));
+    for (j = 0; ok && j < child->cv_num; ++j) {
+      k = child->cv_tbl[j];
+      if (k >= 0 ? (size_t)k >= frame : (size_t)~k >= irep->cv_num) {
+        ok = false;
+      }
+      else {
+        childbox[j] = k >= 0 ? box[k] : cvbox[~k];
+      }
+    }
+    ok = ok && check_code(pic, child, childbox);
+    pic_free(pic, childbox);
+  }
+  pic_free(pic, box);
+  return ok;
+}
+
+/* the irep read is left protected on the arena */
+static struct pic_irep *
+read_irep(pic_state *pic, struct cache_reader *r, const int *gids, size_t glen)
+{
+  struct pic_irep *irep, *child;
+  struct pic_code *c;
+  size_t cv_num, clen, ilen, plen, cclen, i;
+  int argc, localc, varg, ai, insn, op;
+  pic_value v;
+
+  if (! read_int(r, &argc) || ! read_int(r, &localc) || ! read_int(r, &varg))
+    return NULL;
+  if (! read_size(r, &cv_num) || ! read_size(r, &clen) || ! read_size(r, &ilen) || ! read_size(r, &plen))
+    return NULL;
+  if (! read_size(r, &cclen))
+    return NULL;
+
+  irep = (struct pic_irep *)pic_obj_alloc(pic, sizeof(struct pic_irep), PIC_TT_IREP);
+  irep->argc = argc;
+  irep->localc = localc;
+  irep->varg = varg;
+#if PIC_ENABLE_JIT
+  irep->ncall = 0;
+  irep->jit = NULL;
+#endif
+  irep->cv_tbl = (int *)pic_calloc(pic, cv_num, sizeof(int));
+  irep->cv_num = cv_num;
+  irep->code = (struct pic_code *)pic_calloc(pic, clen + PIC_CALLCACHE_SLOTS * cclen, sizeof(struct pic_code));
+  irep->clen = clen;
+  irep->irep = (struct pic_irep **)pic_calloc(pic, ilen, sizeof(struct pic_irep *));
+  irep->ilen = 0;
+  irep->pool = (pic_value *)pic_calloc(pic, plen, sizeof(pic_value));
+  irep->plen = 0;
+  irep->cclen = cclen;
+
+  if (! read_bytes(r, irep->cv_tbl, sizeof(int) * cv_num))
+    return NULL;
+  for (i = 0; i < cclen; ++i) {
+    pic_irep_callcache(irep, i)->irep = irep;
+    if (! read_int(r, &pic_irep_callcache(irep, i)->argc) || pic_irep_callcache(irep, i)->argc < 1)
+      return NULL;
+  }
+
+  for (i = 0; i < clen; ++i) {
+    c = &irep->code[i];
+    if (! read_int(r, &insn) || ! read_int(r, &op) || insn < 0 || insn > OP_STOP)
+      return NULL;
+    c->insn = insn;
+    c->u.i = op;
+    switch (c->insn) {
+    case OP_GREF:
+    case OP_GSET:
+      if (c->u.i < 0 || (size_t)c->u.i >= glen)
+        return NULL;
+      c->u.i = gids[c->u.i];
+      break;
+    case OP_GCALL:
+    case OP_GTAILCALL:
+      if (c->u.i < 0 || (size_t)c->u.i >= cclen)
+        return NULL;
+      c->u.i = clen - i + c->u.i * PIC_CALLCACHE_SLOTS;
+      break;
+    default:
+      break;
+    }
+  }
+
+  ai = pic_gc_arena_preserve(pic);
+  for (i = 0; i < ilen; ++i) {
+    if ((child = read_irep(pic, r, gids, glen)) == NULL)
+      return NULL;
+    irep->irep[irep->ilen++] = child;
+    pic_gc_write_barrier(pic, (struct pic_object *)irep);
+    pic_gc_arena_restore(pic, ai);
+  }
+  for (i = 0; i < plen; ++i) {
+    if (! read_value(pic, r, &v))
+      return NULL;
+    irep->pool[irep->plen++] = v;
+    pic_gc_write_barrier(pic, (struct pic_object *)irep);
+    pic_gc_arena_restore(pic, ai);
+  }
+  return irep;
+}
+
+/* NULL unless the globals the entry reads are all bound */
+static struct pic_irep *
+read_entry(pic_state *pic, struct cache_entry *entry)
+{
+  struct cache_reader r;
+  struct pic_irep *irep = NULL;
+  const char *name;
+  size_t glen, len, i;
+  int *gids, bound, gensyms;
+
+  r.ptr = entry->data + sizeof(uint64_t) + sizeof(size_t);
+  r.end = r.ptr + entry->size;
+
+  if (! read_int(&r, &gensyms) || ! read_size(&r, &glen))
+    return NULL;
+  if (gensyms < 0 || gensyms > INT_MAX - pic->uniq_sym_count)
+    return NULL;
+
+  gids = (int *)pic_calloc(pic, glen, sizeof(int));
+  for (i = 0; i < glen; ++i) {
+    if (! read_int(&r, &bound) || ! read_size(&r, &len) || (name = read_cstr(&r, len)) == NULL)
+      goto exit;
+    if (bound && ! xh_get(pic->global_tbl, name))
+      goto exit;
+    gids[i] = pic_global_index(pic, name);
+  }
+  irep = read_irep(pic, &r, gids, glen);
+
+  /* a toplevel irep has no env */
+  if (irep != NULL && (irep->cv_num != 0 || ! check_code(pic, irep, NULL))) {
+    irep = NULL;
+  }
+  if (irep != NULL) {
+    pic->uniq_sym_count += gensyms;
+  }
+
+ exit:
+  pic_free(pic, gids);
+  return irep;
+}
+
+static void
+read_cache(pic_state *pic, struct load_cache *cache)
+{
+  struct cache_reader r;
+  FILE *file;
+  long size;
+  uint64_t src_hash, body_hash;
+  size_t n, i;
+  int magic, version;
+
+  if ((file = fopen(cache->path, "rb")) == NULL)
+    return;
+
+  if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET) != 0) {
+    fclose(file);
+    return;
+  }
+  cache->file = (char *)pic_alloc(pic, size);
+  if (fread(cache->file, 1, size, file) != (size_t)size) {
+    fclose(file);
+    return;
+  }
+  fclose(file);
+
+  r.ptr = cache->file;
+  r.end = cache->file + size;
+
+  if (! read_int(&r, &magic) || magic != CACHE_MAGIC)
+    return;
+  if (! read_int(&r, &version) || version != CACHE_VERSION)
+    return;
+  if (! read_bytes(&r, &src_hash, sizeof src_hash) || src_hash != cache->src_hash)
+    return;
+  if (! read_bytes(&r, &body_hash, sizeof body_hash) || ! read_size(&r, &n))
+    return;
+  if (body_hash != hash_bytes(HASH_BASIS, r.ptr, r.end - r.ptr))
+    return;
+
+  cache->entries = (struct cache_entry *)pic_calloc(pic, n, sizeof(struct cache_entry));
+  for (i = 0; i < n; ++i) {
+    cache->entries[i].data = r.ptr;
+    if (! read_bytes(&r, &cache->entries[i].hash, sizeof(uint64_t)))
+      break;
+    if (! read_bytes(&r, &cache->entries[i].size, sizeof(size_t)) || cache->entries[i].size > (size_t)(r.end - r.ptr))
+      break;
+    r.ptr += cache->entries[i].size;
+  }
+  cache->elen = i;
+}
+
+static void
+write_cache(pic_state *pic, struct load_cache *cache)
+{
+  struct cache_buf *body = &cache->body;
+  FILE *file;
+  char *tmp;
+  uint64_t body_hash;
+  int magic = CACHE_MAGIC, version = CACHE_VERSION;
+  bool ok;
+
+  tmp = (char *)pic_alloc(pic, strlen(cache->path) + 2);
+  strcpy(tmp, cache->path);
+  strcat(tmp, "~");
+
+  /* written aside, so that no reader sees it half done */
+  if ((file = fopen(tmp, "wb")) != NULL) {
+    body_hash = hash_bytes(HASH_BASIS, body->data, body->len);
+    ok = fwrite(&magic, sizeof magic, 1, file) == 1
+      && fwrite(&version, sizeof version, 1, file) == 1
+      && fwrite(&cache->src_hash, sizeof(uint64_t), 1, file) == 1
+      && fwrite(&body_hash, sizeof body_hash, 1, file) == 1
+      && fwrite(&cache->count, sizeof(size_t), 1, file) == 1
+      && fwrite(body->data, 1, body->len, file) == body->len;
+    if (fclose(file) == 0 && ok) {
+      ok = rename(tmp, cache->path) == 0;
+    }
+    if (! ok) {
+      remove(tmp);
+    }
+  }
+  pic_free(pic, tmp);
+}
+
+static struct load_cache *
+cache_open(pic_state *pic, const char *fn, FILE *src)
+{
+  struct load_cache *cache;
+  char chunk[BUFSIZ];
+  size_t len;
+
+  cache = (struct load_cache *)pic_calloc(pic, 1, sizeof(struct load_cache));
+  cache->path = (char *)pic_alloc(pic, strlen(fn) + strlen(PIC_LOAD_CACHE_SUFFIX) + 1);
+  strcpy(cache->path, fn);
+  strcat(cache->path, PIC_LOAD_CACHE_SUFFIX);
+
+  cache->src_hash = HASH_BASIS;
+  while ((len = fread(chunk, 1, sizeof chunk, src)) > 0) {
+    cache->src_hash = hash_bytes(cache->src_hash, chunk, len);
+  }
+  rewind(src);
+
+  read_cache(pic, cache);
+
+  return cache;
+}
+
+static void
+cache_close(pic_state *pic, struct load_cache *cache, bool write)
+{
+  if (write && (cache->dirty || cache->count != cache->elen)) {
+    write_cache(pic, cache);
+  }
+  pic_free(pic, cache->path);
+  pic_free(pic, cache->file);
+  pic_free(pic, cache->entries);
+  pic_free(pic, cache->body.data);
+  pic_free(pic, cache->code.data);
+  pic_free(pic, cache->gids);
+  pic_free(pic, cache);
+}
+
+/* compile the i-th form, from the cache if it holds the same program */
+static struct pic_proc *
+cache_compile(pic_state *pic, struct load_cache *cache, size_t i, pic_value obj)
+{
+  struct cache_entry *entry = i < cache->elen ? &cache->entries[i] : NULL;
+  struct pic_proc *proc;
+  struct pic_irep *irep = NULL;
+  uint64_t hash = HASH_BASIS;
+  bool cacheable;
+  int ai = pic_gc_arena_preserve(pic);
+
+  obj = pic_macroexpand(pic, obj);
+  pic_gc_protect(pic, obj);
+
+  cacheable = hash_value(pic, &hash, obj);
+  if (! cacheable) {
+    hash = 0;
+  }
+
+  if (cacheable && entry && entry->hash == hash && entry->size > 0) {
+    irep = read_entry(pic, entry);
+  }
+  if (irep != NULL) {
+    proc = pic_proc_new_irep(pic, irep, NULL);
+    buf_write(pic, &cache->body, entry->data, sizeof(uint64_t) + sizeof(size_t) + entry->size);
+    cache->count++;
+  }
+  else {
+    cache->gbound = pic->glen;
+    cache->gensyms = pic->uniq_sym_count;
+    proc = pic_compile_expanded(pic, obj);
+    if (proc == NULL) {
+      return NULL;
+    }
+    cache->gensyms = pic->uniq_sym_count - cache->gensyms;
+    write_entry(pic, cache, hash, cacheable ? proc->u.irep : NULL);
+  }
+
+  pic_gc_arena_restore(pic, ai);
+  pic_gc_protect(pic, pic_obj_value(proc));
+
+  return proc;
+}
+
+#endif
 
 pic_value
 pic_load(pic_state *pic, const char *fn)
@@ -12,13 +1017,32 @@ pic_load(pic_state *pic, const char *fn)
   int n, i, ai;
   pic_value v, vs;
   struct pic_proc *proc;
+#if PIC_ENABLE_LOAD_CACHE
+  struct load_cache *cache;
+  jmp_buf jmp, *prev_jmp = pic->jmp;
+#endif
 
   file = fopen(fn, "r");
   if (file == NULL) {
     pic_error(pic, "load: could not read file");
   }
 
+#if PIC_ENABLE_LOAD_CACHE
+  cache = cache_open(pic, fn, file);
+
+  if (PIC_SETJMP(jmp) == 0) {
+    pic->jmp = &jmp;
+  }
+  else {
+    /* pass the error on once the cache is freed */
+    pic->jmp = prev_jmp;
+    cache_close(pic, cache, false);
+    pic_error(pic, pic->errmsg);
+  }
+#endif
+
   n = pic_parse_file(pic, file, &vs);
+  fclose(file);
   if (n < 0) {
     pic_error(pic, "load: parse failure");
   }
@@ -27,7 +1051,11 @@ pic_load(pic_state *pic, const char *fn)
   for (i = 0; i < n; ++i, vs = pic_cdr(pic, vs)) {
     v = pic_car(pic, vs);
 
+#if PIC_ENABLE_LOAD_CACHE
+    proc = cache_compile(pic, cache, i, v);
+#else
     proc = pic_compile(pic, v);
+#endif
     if (proc == NULL) {
       pic_error(pic, "load: compilation failure");
     }
@@ -40,6 +1068,11 @@ pic_load(pic_state *pic, const char *fn)
     pic_gc_arena_restore(pic, ai);
   }
 
+#if PIC_ENABLE_LOAD_CACHE
+  pic->jmp = prev_jmp;
+  cache_close(pic, cache, true);
+#endif
+
   return pic_none_value();
 }
 
@@ -33,6 +33,7 @@ pic_null_syntactic_env(pic_state *pic)
 
 #define register_core_syntax(pic,senv,kind,name) do {			\
     senv->stx[senv->xlen] = pic_syntax_new(pic, kind, pic_intern_cstr(pic, name)); \
+    pic_gc_write_barrier(pic, (struct pic_object *)senv);		\
     xh_put(senv->tbl, name, ~senv->xlen);				\
     senv->xlen++;							\
   } while (0)
@@ -208,6 +209,7 @@ pic_import(pic_state *pic, pic_value spec)
       }
       /* bring macro object from imported lib */
       senv->stx[idx] = lib->senv->stx[~it.e->val];
+      pic_gc_write_barrier(pic, (struct pic_object *)senv);
       xh_put(senv->tbl, it.e->key, ~idx);
       senv->xlen++;
     }
@@ -240,6 +242,7 @@ pic_defsyntax(pic_state *pic, const char *name, struct pic_proc *macro, struct p
     pic_abort(pic, "macro table overflow");
   }
   global_senv->stx[idx] = stx;
+  pic_gc_write_barrier(pic, (struct pic_object *)global_senv);
   xh_put(global_senv->tbl, name, ~idx);
   global_senv->xlen++;
 }
@@ -539,6 +542,8 @@ macroexpand(pic_state *pic, pic_value expr, struct pic_senv *senv)
   case PIC_TT_SYNTAX:
   case PIC_TT_LIB:
   case PIC_TT_VAR:
+  case PIC_TT_EPHEMERON:
+  case PIC_TT_WTABLE:
   case PIC_TT_IREP:
     pic_error(pic, "unexpected value type");
     return pic_undef_value();	/* unreachable */
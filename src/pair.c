@@ -236,7 +236,11 @@ pic_list_ref(pic_state *pic, pic_value list, int i)
 void
 pic_list_set(pic_state *pic, pic_value list, int i, pic_value obj)
 {
-  pic_pair_ptr(pic_list_tail(pic, list, i))->car = obj;
+  struct pic_pair *pair;
+
+  pair = pic_pair_ptr(pic_list_tail(pic, list, i));
+  pair->car = obj;
+  pic_gc_write_barrier(pic, (struct pic_object *)pair);
 }
 
 pic_value
@@ -341,6 +345,7 @@ pic_pair_set_car(pic_state *pic)
     pic_error(pic, "pair expected");
 
   pic_pair_ptr(v)->car = w;
+  pic_gc_write_barrier(pic, pic_obj_ptr(v));
   return pic_none_value();
 }
 
@@ -355,6 +360,7 @@ pic_pair_set_cdr(pic_state *pic)
     pic_error(pic, "pair expected");
 
   pic_pair_ptr(v)->cdr = w;
+  pic_gc_write_barrier(pic, pic_obj_ptr(v));
   return pic_none_value();
 }
 
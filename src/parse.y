@@ -57,6 +57,7 @@ yy_obj_protect(struct parser_control *p, struct pic_object *obj)
     pic_vec_extend_ip(p->pic, p->yy_arena, p->yy_arena->len * 2);
   }
   p->yy_arena->data[p->yy_arena_idx++] = pic_obj_value(obj);
+  pic_gc_write_barrier(p->pic, (struct pic_object *)p->yy_arena);
 }
 
 struct pic_object *
@@ -31,6 +31,20 @@ pic_proc_new_irep(pic_state *pic, struct pic_irep *irep, struct pic_env *env)
   return proc;
 }
 
+struct pic_env *
+pic_env_new(pic_state *pic, size_t valuec)
+{
+  struct pic_env *env;
+  size_t i;
+
+  env = (struct pic_env *)pic_obj_alloc(pic, sizeof(struct pic_env) + sizeof(pic_value) * valuec, PIC_TT_ENV);
+  env->valuec = valuec;
+  for (i = 0; i < valuec; ++i) {
+    env->values[i] = pic_undef_value();
+  }
+  return env;
+}
+
 void
 pic_proc_cv_init(pic_state *pic, struct pic_proc *proc, size_t cv_size)
 {
@@ -39,12 +53,10 @@ pic_proc_cv_init(pic_state *pic, struct pic_proc *proc, size_t cv_size)
   if (proc->env != NULL) {
     pic_error(pic, "env slot already in use");
   }
-  env = (struct pic_env *)pic_obj_alloc(pic, sizeof(struct pic_env), PIC_TT_ENV);
-  env->valuec = cv_size;
-  env->values = (pic_value *)pic_calloc(pic, cv_size, sizeof(pic_value));
-  env->up = NULL;
+  env = pic_env_new(pic, cv_size);
 
   proc->env = env;
+  pic_gc_write_barrier(pic, (struct pic_object *)proc);
 }
 
 int
@@ -70,6 +82,7 @@ pic_proc_cv_set(pic_state *pic, struct pic_proc *proc, size_t i, pic_value v)
     pic_error(pic, "no closed env");
   }
   proc->env->values[i] = v;
+  pic_gc_write_barrier(pic, (struct pic_object *)proc->env);
 }
 
 static pic_value
@@ -86,7 +99,7 @@ static pic_value
 pic_proc_apply(pic_state *pic)
 {
   struct pic_proc *proc;
-  pic_value *args;
+  pic_value *args, arg_list;
   size_t argc;
 
   pic_get_args(pic, "l*", &proc, &argc, &args);
@@ -95,33 +108,82 @@ pic_proc_apply(pic_state *pic)
     pic_error(pic, "apply: wrong number of arguments");
   }
 
-  return pic_apply(pic, proc, pic_list_from_array(pic, argc, args));
+  /* only the leading arguments are consed onto the last one */
+  arg_list = args[--argc];
+  while (argc--) {
+    arg_list = pic_cons(pic, args[argc], arg_list);
+  }
+
+  pic_apply_nocatch(pic, proc, arg_list);
+
+  /* pass on the values of proc */
+  return pic_values(pic, pic->ci[1].retc, pic->ci[1].fp);
+}
+
+static pic_value
+pic_proc_values(pic_state *pic)
+{
+  pic_value *argv;
+  size_t argc;
+
+  pic_get_args(pic, "*", &argc, &argv);
+
+  return pic_values(pic, argc, argv);
+}
+
+static pic_value
+pic_proc_call_with_values(pic_state *pic)
+{
+  struct pic_proc *producer, *consumer;
+
+  pic_get_args(pic, "ll", &producer, &consumer);
+
+  pic_apply_array_nocatch(pic, producer, 0, NULL);
+
+  /* the values are left right above the stack top and are moved in place */
+  pic_apply_array_nocatch(pic, consumer, pic->ci[1].retc, pic->ci[1].fp);
+
+  /* pass on the values of the consumer */
+  return pic_values(pic, pic->ci[1].retc, pic->ci[1].fp);
 }
 
 static pic_value
 pic_proc_map(pic_state *pic)
 {
   struct pic_proc *proc;
-  size_t argc;
-  pic_value *args;
-  int i;
-  pic_value cars, ret;
+  struct pic_vector *vec;
+  size_t argc, i;
+  pic_value *args, *cars;
+  pic_value ret;
+  int ai;
 
   pic_get_args(pic, "l*", &proc, &argc, &args);
 
+  ai = pic_gc_arena_preserve(pic);
+
+  /* collected with the rest if an error unwinds past us */
+  vec = pic_vec_new(pic, argc);
+  cars = vec->data;
+
   ret = pic_nil_value();
   do {
-    cars = pic_nil_value();
-    for (i = argc - 1; i >= 0; --i) {
+    for (i = 0; i < argc; ++i) {
       if (! pic_pair_p(args[i])) {
         break;
       }
-      cars = pic_cons(pic, pic_car(pic, args[i]), cars);
+      cars[i] = pic_car(pic, args[i]);
       args[i] = pic_cdr(pic, args[i]);
     }
-    if (i >= 0)
+    if (i < argc)
       break;
-    ret = pic_cons(pic, pic_apply(pic, proc, cars), ret);
+    ret = pic_cons(pic, pic_apply_array_nocatch(pic, proc, argc, cars), ret);
+
+    pic_gc_arena_restore(pic, ai);
+    pic_gc_protect(pic, pic_obj_value(vec));
+    pic_gc_protect(pic, ret);
+
+    /* the VM stack may have been moved by the call */
+    pic_get_args(pic, "l*", &proc, &argc, &args);
   } while (1);
 
   return pic_reverse(pic, ret);
@@ -131,25 +193,36 @@ static pic_value
 pic_proc_for_each(pic_state *pic)
 {
   struct pic_proc *proc;
-  size_t argc;
-  pic_value *args;
-  int i;
-  pic_value cars;
+  struct pic_vector *vec;
+  size_t argc, i;
+  pic_value *args, *cars;
+  int ai;
 
   pic_get_args(pic, "l*", &proc, &argc, &args);
 
+  ai = pic_gc_arena_preserve(pic);
+
+  /* collected with the rest if an error unwinds past us */
+  vec = pic_vec_new(pic, argc);
+  cars = vec->data;
+
   do {
-    cars = pic_nil_value();
-    for (i = argc - 1; i >= 0; --i) {
+    for (i = 0; i < argc; ++i) {
       if (! pic_pair_p(args[i])) {
         break;
       }
-      cars = pic_cons(pic, pic_car(pic, args[i]), cars);
+      cars[i] = pic_car(pic, args[i]);
       args[i] = pic_cdr(pic, args[i]);
     }
-    if (i >= 0)
+    if (i < argc)
       break;
-    pic_apply(pic, proc, cars);
+    pic_apply_array_nocatch(pic, proc, argc, cars);
+
+    pic_gc_arena_restore(pic, ai);
+    pic_gc_protect(pic, pic_obj_value(vec));
+
+    /* the VM stack may have been moved by the call */
+    pic_get_args(pic, "l*", &proc, &argc, &args);
   } while (1);
 
   return pic_none_value();
@@ -160,6 +233,8 @@ pic_init_proc(pic_state *pic)
 {
   pic_defun(pic, "procedure?", pic_proc_proc_p);
   pic_defun(pic, "apply", pic_proc_apply);
+  pic_defun(pic, "values", pic_proc_values);
+  pic_defun(pic, "call-with-values", pic_proc_call_with_values);
   pic_defun(pic, "map", pic_proc_map);
   pic_defun(pic, "for-each", pic_proc_for_each);
 }
@@ -7,6 +7,7 @@
 #include "picrin.h"
 #include "picrin/gc.h"
 #include "picrin/proc.h"
+#include "picrin/irep.h"
 #include "picrin/macro.h"
 #include "picrin/cont.h"
 #include "xhash/xhash.h"
@@ -14,12 +15,12 @@
 void pic_init_core(pic_state *);
 
 pic_state *
-pic_open(int argc, char *argv[], char **envp)
+pic_open_with_gc_threads(int argc, char *argv[], char **envp, int nthreads)
 {
   pic_value t;
 
   pic_state *pic;
-  int ai;
+  int ai, i;
 
   pic = (pic_state *)malloc(sizeof(pic_state));
 
@@ -50,7 +51,7 @@ pic_open(int argc, char *argv[], char **envp)
 
   /* memory heap */
   pic->heap = (struct pic_heap *)calloc(1, sizeof(struct pic_heap));
-  init_heap(pic->heap);
+  init_heap(pic->heap, nthreads);
 
   /* symbol table */
   pic->sym_tbl = xh_new();
@@ -62,6 +63,10 @@ pic_open(int argc, char *argv[], char **envp)
   /* global variables */
   pic->global_tbl = xh_new();
   pic->globals = (pic_value *)calloc(PIC_GLOBALS_SIZE, sizeof(pic_value));
+  for (i = 0; i < PIC_GLOBALS_SIZE; ++i) {
+    pic->globals[i] = pic_undef_value(); /* until its define has run */
+  }
+  pic->global_names = (const char **)calloc(PIC_GLOBALS_SIZE, sizeof(const char *));
   pic->glen = 0;
   pic->gcapa = PIC_GLOBALS_SIZE;
 
@@ -76,7 +81,7 @@ pic_open(int argc, char *argv[], char **envp)
   /* GC arena */
   pic->arena_idx = 0;
 
-  /* native stack marker */
+  /* native stack marker; pic_open moves it one frame up */
   pic->native_stack_start = &t;
 
 #define register_core_symbol(pic,slot,name) do {	\
@@ -123,16 +128,43 @@ pic_open(int argc, char *argv[], char **envp)
   return pic;
 }
 
+pic_state *
+pic_open(int argc, char *argv[], char **envp)
+{
+  pic_value t;
+
+  pic_state *pic;
+
+  pic = pic_open_with_gc_threads(argc, argv, envp, 1);
+
+  /*
+   * t dies with this frame, but only its address is used: continuations
+   * copy the native stack between it and their own frame. Later calls
+   * into picrin from our caller run below this frame's locals, so the
+   * address still bounds them, and it is one frame nearer the caller
+   * than the marker left by pic_open_with_gc_threads.
+   */
+  pic->native_stack_start = &t;
+
+  return pic;
+}
+
 void
 pic_close(pic_state *pic)
 {
   size_t i;
 
+  /* clear out the roots; an error may leave them populated */
+  pic->sp = pic->stbase;
+  pic->ci = pic->cibase;
+  pic->ridx = 0;
+
   /* free global stacks */
   free(pic->stbase);
   free(pic->cibase);
   free(pic->rescue);
   free(pic->globals);
+  free(pic->global_names);
 
   xh_destroy(pic->sym_tbl);
   xh_destroy(pic->global_tbl);
@@ -43,8 +43,8 @@ pic_var_set(pic_state *pic, struct pic_var *var, pic_value value)
 void
 pic_var_set_force(pic_state *pic, struct pic_var *var, pic_value value)
 {
-  UNUSED(pic);
   var->value = value;
+  pic_gc_write_barrier(pic, (struct pic_object *)var);
 }
 
 static struct pic_var *
@@ -115,6 +115,7 @@ pic_vec_vector_set(pic_state *pic)
     pic_error(pic, "vector-set!: index out of range");
   }
   v->data[k] = o;
+  pic_gc_write_barrier(pic, (struct pic_object *)v);
   return pic_none_value();
 }
 
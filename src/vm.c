@@ -5,16 +5,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <limits.h>
-#include <math.h>
 
 #include "picrin.h"
+#include "picrin/gc.h"
 #include "picrin/pair.h"
 #include "picrin/proc.h"
 #include "picrin/port.h"
 #include "picrin/irep.h"
 #include "picrin/blob.h"
 #include "picrin/var.h"
+#include "picrin/error.h"
+#include "picrin/jit.h"
 
 #define GET_OPERAND(pic,n) ((pic)->ci->fp[(n)])
 
@@ -37,6 +40,11 @@ pic_get_args(pic_state *pic, const char *format, ...)
   va_list ap;
   bool opt = false;
 
+  /* natives are a safe point for the (picrin gc) hook */
+  if (pic->heap->hook_pending) {
+    pic_gc_run_hook(pic);
+  }
+
   va_start(ap, format);
   while ((c = *format++)) {
     switch (c) {
@@ -329,24 +337,6 @@ pic_defvar(pic_state *pic, const char *name, pic_value init)
   pic_define(pic, name, pic_obj_value(pic_wrap_var(pic, var)));
 }
 
-pic_value
-pic_apply_argv(pic_state *pic, struct pic_proc *proc, size_t argc, ...)
-{
-  va_list ap;
-  pic_value v;
-
-  va_start(ap, argc);
-
-  v = pic_nil_value();
-  while (argc--) {
-    v = pic_cons(pic, va_arg(ap, pic_value), v);
-  }
-  v = pic_reverse(pic, v);
-
-  va_end(ap);
-  return pic_apply(pic, proc, v);
-}
-
 void print_code(pic_state *, struct pic_code);
 
 #if VM_DEBUG
@@ -369,55 +359,237 @@ void print_code(pic_state *, struct pic_code);
 # define VM_LOOP_END } }
 #endif
 
-#define PUSH(v) ((pic->sp >= pic->stend) ? abort() : (*pic->sp++ = (v)))
+/*
+ * Stack overflow is raised as an error object, for exception handlers to
+ * catch. A stack that reaches PIC_STACK_MAX gets PIC_STACK_SIZE more
+ * slots to run the handler in, and a continuation the handler escapes to
+ * gives the stack back its own size. With no handler, or overflowing in
+ * the handler, it is an error as before.
+ */
+NORETURN static void
+vm_overflow(pic_state *pic)
+{
+  struct pic_error *e;
+
+  e = (struct pic_error *)pic_obj_alloc(pic, sizeof(struct pic_error), PIC_TT_ERROR);
+  e->type = PIC_ERROR_OTHER;
+  e->msg = pic_strdup(pic, "stack overflow");
+  e->irrs = pic_nil_value();
+  pic_raise(pic, pic_obj_value(e));
+}
+
+static size_t
+vm_grow_size(pic_state *pic, size_t size)
+{
+  if (size >= PIC_STACK_MAX + PIC_STACK_SIZE || (size >= PIC_STACK_MAX && pic->ridx == 0)) {
+    pic_error(pic, "stack overflow");
+  }
+  if (size >= PIC_STACK_MAX) {
+    return PIC_STACK_MAX + PIC_STACK_SIZE;
+  }
+  return size * 2 < PIC_STACK_MAX ? size * 2 : PIC_STACK_MAX;
+}
+
+static void
+vm_grow_stack(pic_state *pic)
+{
+  pic_value *stbase = pic->stbase;
+  size_t size = vm_grow_size(pic, pic->stend - pic->stbase);
+  pic_callinfo *ci;
+
+  pic->stbase = (pic_value *)pic_realloc(pic, pic->stbase, sizeof(pic_value) * size);
+  pic->sp = pic->stbase + (pic->sp - stbase);
+  pic->stend = pic->stbase + size;
+
+  /* frames point into the old stack */
+  for (ci = pic->cibase; ci <= pic->ci; ++ci) {
+    if (ci->fp != NULL) {
+      ci->fp = pic->stbase + (ci->fp - stbase);
+    }
+  }
+  if (size > PIC_STACK_MAX) {
+    vm_overflow(pic);
+  }
+}
+
+static void
+vm_grow_cistack(pic_state *pic)
+{
+  size_t size = vm_grow_size(pic, pic->ciend - pic->cibase);
+  ptrdiff_t ci = pic->ci - pic->cibase;
+
+  pic->cibase = (pic_callinfo *)pic_realloc(pic, pic->cibase, sizeof(pic_callinfo) * size);
+  pic->ci = pic->cibase + ci;
+  pic->ciend = pic->cibase + size;
+  if (size > PIC_STACK_MAX) {
+    vm_overflow(pic);
+  }
+}
+
+/* make room for n values above the top, keeping argv if it points into the stack */
+static pic_value *
+vm_reserve(pic_state *pic, size_t n, pic_value *argv)
+{
+  ptrdiff_t off = argv - pic->stbase;
+  bool on_stack = argv >= pic->stbase && argv < pic->stend;
+
+  while ((size_t)(pic->stend - pic->sp) < n) {
+    vm_grow_stack(pic);
+  }
+  return on_stack ? pic->stbase + off : argv;
+}
+
+/*
+ * Multiple values are returned at the bottom of the returning frame, with
+ * their number in its callinfo, which stays intact just above pic->ci
+ * until the next call. A caller that wants a single value only sees the
+ * first one.
+ */
+
+pic_value
+pic_values(pic_state *pic, size_t argc, pic_value *argv)
+{
+  ptrdiff_t off = argv - pic->stbase;
+  bool on_stack = argv >= pic->stbase && argv < pic->stend;
+  size_t i;
+
+  while (pic->stend - pic->ci->fp < (ptrdiff_t)argc) {
+    vm_grow_stack(pic);
+    if (on_stack) {
+      argv = pic->stbase + off;
+    }
+  }
+  for (i = 0; i < argc; ++i) {
+    pic->ci->fp[i] = argv[i];
+  }
+  pic->ci->retc = argc;
+
+  return argc == 0 ? pic_none_value() : pic->ci->fp[0];
+}
+
+size_t
+pic_receive(pic_state *pic, size_t n, pic_value *argv)
+{
+  pic_callinfo *ci = pic->ci + 1;
+  size_t i;
+
+  for (i = 0; i < n && i < (size_t)ci->retc; ++i) {
+    argv[i] = ci->fp[i];
+    pic_gc_protect(pic, argv[i]);
+  }
+  return ci->retc;
+}
+
+#define PUSH(v) (((pic->sp >= pic->stend) ? vm_grow_stack(pic) : (void)0), *pic->sp++ = (v))
 #define POP() (*--pic->sp)
 #define POPN(i) (pic->sp -= (i))
 
-#define PUSHCI() (++pic->ci)
+#define PUSHCI() (((pic->ci + 1 >= pic->ciend) ? vm_grow_cistack(pic) : (void)0), ++pic->ci)
 #define POPCI() (pic->ci--)
 
-pic_value
-pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
+/* fixnum operations; true if the result does not fit or is inexact */
+#define ADD_OVERFLOW(a, b, r) __builtin_add_overflow(a, b, r)
+#define SUB_OVERFLOW(a, b, r) __builtin_sub_overflow(a, b, r)
+#define MUL_OVERFLOW(a, b, r) __builtin_mul_overflow(a, b, r)
+#define DIV_OVERFLOW(a, b, r)						\
+  ((b) == 0 || ((a) == INT_MIN && (b) == -1) || (a) % (b) != 0 || (*(r) = (a) / (b), false))
+
+/*
+ * A closure of irep, with its free variables copied out of the current
+ * frame. Variables assigned after they are captured are shared through
+ * boxes, which are pairs of the value and ().
+ */
+static struct pic_proc *
+vm_closure(pic_state *pic, struct pic_irep *irep)
+{
+  pic_callinfo *ci = pic->ci;
+  struct pic_env *env = NULL;
+  unsigned i;
+  int k;
+
+  if (irep->cv_num > 0) {
+    env = pic_env_new(pic, irep->cv_num);
+    for (i = 0; i < irep->cv_num; ++i) {
+      k = irep->cv_tbl[i];
+      env->values[i] = k >= 0 ? ci->fp[k] : ci->env->values[~k];
+    }
+  }
+  return pic_proc_new_irep(pic, irep, env);
+}
+
+#if PIC_ENABLE_JIT
+
+/* count calls of irep and run its native code once it is compiled */
+# define JIT_ENTER(irep) do {						\
+    if ((irep)->jit == NULL && ++(irep)->ncall == PIC_JIT_THRESHOLD) {	\
+      pic_jit_compile(pic, (irep));					\
+    }									\
+    if ((irep)->jit) {							\
+      pc = pic_jit_run(pic, (irep), pc);				\
+    }									\
+  } while (0)
+
+/* the compiled irep that a return to pc lands in, if any */
+static inline struct pic_irep *
+jit_caller(pic_state *pic, struct pic_code *pc)
+{
+  pic_value *fp = pic->ci->fp;
+  struct pic_irep *irep;
+
+  if (fp == NULL || ! pic_proc_p(fp[0]) || pic_proc_cfunc_p(fp[0]))
+    return NULL;
+  irep = pic_proc_ptr(fp[0])->u.irep;
+  if (irep->jit == NULL || pc < irep->code || pc >= irep->code + irep->clen)
+    return NULL;
+  return irep;
+}
+
+#else
+# define JIT_ENTER(irep) ((void)0)
+#endif
+
+static pic_value
+vm_apply(pic_state *pic, struct pic_proc *proc, size_t argc, pic_value *argv, bool rescue)
 {
   struct pic_code *pc, c;
   int ai = pic_gc_arena_preserve(pic);
   jmp_buf jmp, *prev_jmp = pic->jmp;
-  size_t argc, i;
   struct pic_code boot[2];
+  ptrdiff_t sp = pic->sp - pic->stbase, ci = pic->ci - pic->cibase;
+  struct pic_callcache *cc;
 
 #if PIC_DIRECT_THREADED_VM
   static void *oplabels[] = {
     &&L_OP_POP, &&L_OP_PUSHNIL, &&L_OP_PUSHTRUE, &&L_OP_PUSHFALSE,
     &&L_OP_PUSHINT, &&L_OP_PUSHCHAR, &&L_OP_PUSHCONST,
-    &&L_OP_GREF, &&L_OP_GSET, &&L_OP_LREF, &&L_OP_LSET, &&L_OP_CREF, &&L_OP_CSET,
-    &&L_OP_JMP, &&L_OP_JMPIF, &&L_OP_CALL, &&L_OP_TAILCALL, &&L_OP_RET, &&L_OP_LAMBDA,
+    &&L_OP_GREF, &&L_OP_GSET, &&L_OP_LREF, &&L_OP_LSET, &&L_OP_CREF,
+    &&L_OP_BOX, &&L_OP_UNBOX, &&L_OP_SETBOX,
+    &&L_OP_JMP, &&L_OP_JMPIF, &&L_OP_CALL, &&L_OP_TAILCALL, &&L_OP_GCALL, &&L_OP_GTAILCALL,
+    &&L_OP_CALLV, &&L_OP_TAILCALLV, &&L_OP_RET, &&L_OP_VALUES, &&L_OP_LAMBDA,
     &&L_OP_CONS, &&L_OP_CAR, &&L_OP_CDR, &&L_OP_NILP,
     &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV, &&L_OP_MINUS,
-    &&L_OP_EQ, &&L_OP_LT, &&L_OP_LE, &&L_OP_STOP
+    &&L_OP_EQ, &&L_OP_LT, &&L_OP_LE,
+    &&L_OP_LREF2, &&L_OP_LREFADDI, &&L_OP_LREFSUBI,
+    &&L_OP_EQJMPIF, &&L_OP_LTJMPIF, &&L_OP_LEJMPIF, &&L_OP_STOP
   };
 #endif
 
-  if (setjmp(jmp) == 0) {
-    pic->jmp = &jmp;
-  }
-  else {
-    goto L_RAISE;
-  }
-
-  if (! pic_list_p(pic, argv)) {
-    pic_error(pic, "argv must be a proper list");
+  /* a nested call without a rescue frame leaves errors to the outer one */
+  if (rescue || pic->jmp == NULL) {
+    if (PIC_SETJMP(jmp) == 0) {
+      pic->jmp = &jmp;
+    }
+    else {
+      goto L_RAISE;
+    }
   }
 
-  argc = pic_length(pic, argv) + 1;
-
 #if VM_DEBUG
   puts("== booting VM...");
   printf("  proc = ");
   pic_debug(pic, pic_obj_value(proc));
   puts("");
-  printf("  argv = ");
-  pic_debug(pic, argv);
-  puts("");
+  printf("  argc = %d\n", (int)argc);
   if (! proc->cfunc_p) {
     printf("  irep = ");
     pic_dump_irep(pic, proc->u.irep);
@@ -428,15 +600,20 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
   puts("\nLet's go!");
 #endif
 
-  PUSH(pic_obj_value(proc));
-  for (i = 1; i < argc; ++i) {
-    PUSH(pic_car(pic, argv));
-    argv = pic_cdr(pic, argv);
+  /* argv may point into the stack, even right above its top */
+  {
+    pic_value *args = vm_reserve(pic, argc + 1, argv);
+
+    if (argc > 0) {
+      memmove(pic->sp + 1, args, sizeof(pic_value) * argc);
+    }
+    pic->sp[0] = pic_obj_value(proc);
+    pic->sp += argc + 1;
   }
 
   /* boot! */
   boot[0].insn = OP_CALL;
-  boot[0].u.i = argc;
+  boot[0].u.i = argc + 1;
   boot[1].insn = OP_STOP;
   pc = boot;
   c = *pc;
@@ -499,25 +676,24 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
       NEXT;
     }
     CASE(OP_CREF) {
-      int depth = c.u.r.depth;
-      struct pic_env *env;
-
-      env = pic->ci->env;
-      while (depth--) {
-	env = env->up;
-      }
-      PUSH(env->values[c.u.r.idx]);
+      PUSH(pic->ci->env->values[c.u.i]);
       NEXT;
     }
-    CASE(OP_CSET) {
-      int depth = c.u.r.depth;
-      struct pic_env *env;
+    CASE(OP_BOX) {
+      pic->ci->fp[c.u.i] = pic_cons(pic, pic->ci->fp[c.u.i], pic_nil_value());
+      pic_gc_arena_restore(pic, ai);
+      NEXT;
+    }
+    CASE(OP_UNBOX) {
+      pic->sp[-1] = pic_pair_ptr(pic->sp[-1])->car;
+      NEXT;
+    }
+    CASE(OP_SETBOX) {
+      struct pic_pair *box;
 
-      env = pic->ci->env;
-      while (depth--) {
-	env = env->up;
-      }
-      env->values[c.u.r.idx] = POP();
+      box = pic_pair_ptr(POP());
+      box->car = POP();
+      pic_gc_write_barrier(pic, (struct pic_object *)box);
       NEXT;
     }
     CASE(OP_JMP) {
@@ -555,9 +731,7 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
       printf("  proc = ");
       pic_debug(pic, pic_obj_value(proc));
       puts("");
-      printf("  argv = ");
-      pic_debug(pic, argv);
-      puts("");
+      printf("  argc = %d\n", c.u.i);
       if (! proc->cfunc_p) {
 	printf("  irep = ");
 	pic_dump_irep(pic, proc->u.irep);
@@ -574,8 +748,9 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
       ci->fp = pic->sp - c.u.i;
       ci->env = NULL;
       if (pic_proc_cfunc_p(x)) {
+	ci->retc = 1;
 	v = proc->u.cfunc(pic);
-	pic->sp = ci->fp;
+	pic->sp = pic->ci->fp;
 	POPCI();
 	PUSH(v);
 	pic_gc_arena_restore(pic, ai);
@@ -611,17 +786,11 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
 	  }
 	}
 
-	/* prepare env */
-        ci->env = (struct pic_env *)pic_obj_alloc(pic, sizeof(struct pic_env), PIC_TT_ENV);
-        ci->env->up = proc->env;
-        ci->env->valuec = proc->u.irep->cv_num;
-        ci->env->values = (pic_value *)pic_calloc(pic, ci->env->valuec, sizeof(pic_value));
-        for (i = 0; i < ci->env->valuec; ++i) {
-          ci->env->values[i] = ci->fp[proc->u.irep->cv_tbl[i]];
-        }
+	ci->env = proc->env;
 
 	pc = proc->u.irep->code;
 	pic_gc_arena_restore(pic, ai);
+	JIT_ENTER(proc->u.irep);
 	JUMP;
       }
     }
@@ -629,6 +798,7 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
       int i, argc;
       pic_value *argv;
 
+    L_TAILCALL:
       argc = c.u.i;
       argv = pic->sp - argc;
       for (i = 0; i < argc; ++i) {
@@ -640,6 +810,74 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
       /* c is not changed */
       goto L_CALL;
     }
+    CASE(OP_GCALL) {
+      pic_value x;
+      pic_callinfo *ci;
+      struct pic_proc *proc;
+      struct pic_irep *irep;
+      int i;
+
+      cc = (struct pic_callcache *)(pc + c.u.i);
+
+    L_GCALL:
+      x = pic->sp[-cc->argc];
+      if (pic_vtype(x) != PIC_VTYPE_HEAP || pic_ptr(x) != (void *)cc->proc) {
+	proc = pic_proc_p(x) ? pic_proc_ptr(x) : NULL;
+	if (proc && ! pic_proc_cfunc_p(x) && ! proc->u.irep->varg && proc->u.irep->argc == cc->argc) {
+	  cc->proc = proc;
+	  pic_gc_write_barrier(pic, (struct pic_object *)cc->irep);
+	}
+	c.u.i = cc->argc;
+	goto L_CALL;
+      }
+
+      /* monomorphic hit: arity was checked when the cache was filled */
+      proc = cc->proc;
+      irep = proc->u.irep;
+
+      ci = PUSHCI();
+      ci->argc = cc->argc;
+      ci->pc = pc;
+      ci->fp = pic->sp - cc->argc;
+      for (i = 0; i < irep->localc; ++i) {
+	PUSH(pic_undef_value());
+      }
+      ci->env = proc->env;
+
+      pc = irep->code;
+      pic_gc_arena_restore(pic, ai);
+      JIT_ENTER(irep);
+      JUMP;
+    }
+    CASE(OP_GTAILCALL) {
+      int i, argc;
+      pic_value *argv;
+
+      cc = (struct pic_callcache *)(pc + c.u.i);
+      argc = cc->argc;
+      argv = pic->sp - argc;
+      for (i = 0; i < argc; ++i) {
+	pic->ci->fp[i] = argv[i];
+      }
+      pic->sp = pic->ci->fp + argc;
+      pc = POPCI()->pc;
+      goto L_GCALL;
+    }
+    CASE(OP_CALLV) {
+      int n = pic->ci[1].retc;
+
+      /* the consumer is followed by the values on the stack */
+      pic->sp += n - 1;
+      c.u.i = n + 1;
+      goto L_CALL;
+    }
+    CASE(OP_TAILCALLV) {
+      int n = pic->ci[1].retc;
+
+      pic->sp += n - 1;
+      c.u.i = n + 1;
+      goto L_TAILCALL;
+    }
     CASE(OP_RET) {
       pic_value v;
       pic_callinfo *ci;
@@ -655,9 +893,40 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
 	pc = ci->pc;
 	pic->sp = ci->fp;
 	PUSH(v);
+	ci->retc = 1;
+      }
+    L_RETURN:
+#if PIC_ENABLE_JIT
+      {
+	struct pic_irep *irep;
+
+	if ((irep = jit_caller(pic, pc)) != NULL) {
+	  pc = pic_jit_run(pic, irep, pc + 1);
+	  JUMP;
+	}
       }
+#endif
       NEXT;
     }
+    CASE(OP_VALUES) {
+      int i, n;
+      pic_value *argv;
+      pic_callinfo *ci;
+
+      n = c.u.i;
+      argv = pic->sp - n;
+      ci = POPCI();
+      pc = ci->pc;
+      for (i = 0; i < n; ++i) {
+	ci->fp[i] = argv[i];
+      }
+      if (n == 0) {
+	ci->fp[0] = pic_none_value();
+      }
+      pic->sp = ci->fp + 1;
+      ci->retc = n;
+      goto L_RETURN;
+    }
     CASE(OP_LAMBDA) {
       pic_value self;
       struct pic_irep *irep;
@@ -671,7 +940,7 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
       if (pic_proc_cfunc_p(self)) {
         pic_error(pic, "logic flaw");
       }
-      proc = pic_proc_new_irep(pic, irep->irep[c.u.i], pic->ci->env);
+      proc = vm_closure(pic, irep->irep[c.u.i]);
       PUSH(pic_obj_value(proc));
       pic_gc_arena_restore(pic, ai);
       NEXT;
@@ -703,18 +972,18 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
       NEXT;
     }
 
-#define DEFINE_ARITH_OP(opcode, op, guard)			\
+#define DEFINE_ARITH_OP(opcode, op, overflow)			\
     CASE(opcode) {						\
       pic_value a, b;						\
+      int r;							\
       b = POP();						\
       a = POP();						\
       if (pic_int_p(a) && pic_int_p(b)) {			\
-	double f = (double)pic_int(a) op (double)pic_int(b);	\
-	if (INT_MIN <= f && f <= INT_MAX && (guard)) {		\
-	  PUSH(pic_int_value((int)f));				\
+	if (! overflow(pic_int(a), pic_int(b), &r)) {		\
+	  PUSH(pic_int_value(r));				\
 	}							\
 	else {							\
-	  PUSH(pic_float_value(f));				\
+	  PUSH(pic_float_value((double)pic_int(a) op (double)pic_int(b))); \
 	}							\
       }								\
       else if (pic_float_p(a) && pic_float_p(b)) {		\
@@ -733,16 +1002,22 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
       NEXT;							\
     }
 
-    DEFINE_ARITH_OP(OP_ADD, +, true);
-    DEFINE_ARITH_OP(OP_SUB, -, true);
-    DEFINE_ARITH_OP(OP_MUL, *, true);
-    DEFINE_ARITH_OP(OP_DIV, /, f == round(f));
+    DEFINE_ARITH_OP(OP_ADD, +, ADD_OVERFLOW);
+    DEFINE_ARITH_OP(OP_SUB, -, SUB_OVERFLOW);
+    DEFINE_ARITH_OP(OP_MUL, *, MUL_OVERFLOW);
+    DEFINE_ARITH_OP(OP_DIV, /, DIV_OVERFLOW);
 
     CASE(OP_MINUS) {
       pic_value n;
+      int r;
       n = POP();
       if (pic_int_p(n)) {
-	PUSH(pic_int_value(-pic_int(n)));
+	if (! SUB_OVERFLOW(0, pic_int(n), &r)) {
+	  PUSH(pic_int_value(r));
+	}
+	else {
+	  PUSH(pic_float_value(-(double)pic_int(n)));
+	}
       }
       else if (pic_float_p(n)) {
 	PUSH(pic_float_value(-pic_float(n)));
@@ -753,44 +1028,97 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
       NEXT;
     }
 
-#define DEFINE_COMP_OP(opcode, op)				\
-    CASE(opcode) {						\
-      pic_value a, b;						\
-      b = POP();						\
-      a = POP();						\
-      if (pic_int_p(a) && pic_int_p(b)) {			\
-	PUSH(pic_bool_value(pic_int(a) op pic_int(b)));		\
-      }								\
-      else if (pic_float_p(a) && pic_float_p(b)) {		\
-	PUSH(pic_bool_value(pic_float(a) op pic_float(b)));	\
-      }								\
-      else if (pic_int_p(a) && pic_float_p(b)) {		\
-	PUSH(pic_bool_value(pic_int(a) op pic_float(b)));	\
-      }								\
-      else if (pic_float_p(a) && pic_int_p(b)) {		\
-	PUSH(pic_bool_value(pic_float(a) op pic_int(b)));	\
-      }								\
-      else {							\
-	pic->errmsg = #op " got non-number operands";		\
-	goto L_RAISE;						\
-      }								\
-      NEXT;							\
+#define COMPARE(a, op, b, r)				\
+    if (pic_int_p(a) && pic_int_p(b)) {			\
+      r = pic_int(a) op pic_int(b);			\
+    }							\
+    else if (pic_float_p(a) && pic_float_p(b)) {	\
+      r = pic_float(a) op pic_float(b);			\
+    }							\
+    else if (pic_int_p(a) && pic_float_p(b)) {		\
+      r = pic_int(a) op pic_float(b);			\
+    }							\
+    else if (pic_float_p(a) && pic_int_p(b)) {		\
+      r = pic_float(a) op pic_int(b);			\
+    }							\
+    else {						\
+      pic->errmsg = #op " got non-number operands";	\
+      goto L_RAISE;					\
+    }
+
+#define DEFINE_COMP_OP(opcode, op)		\
+    CASE(opcode) {				\
+      pic_value a, b;				\
+      bool r;					\
+      b = POP();				\
+      a = POP();				\
+      COMPARE(a, op, b, r);			\
+      PUSH(pic_bool_value(r));			\
+      NEXT;					\
     }
 
     DEFINE_COMP_OP(OP_EQ, ==);
     DEFINE_COMP_OP(OP_LT, <);
     DEFINE_COMP_OP(OP_LE, <=);
 
+    CASE(OP_LREF2) {
+      PUSH(pic->ci->fp[c.u.i]);
+      PUSH(pic->ci->fp[pc[1].u.i]);
+      pc += 2;
+      JUMP;
+    }
+
+    /* fall back on the PUSHINT and arithmetic left in the next slots */
+#define DEFINE_ARITHI_OP(opcode, overflow)		\
+    CASE(opcode) {					\
+      pic_value a;					\
+      int r;						\
+      a = pic->ci->fp[c.u.i];				\
+      if (pic_int_p(a) && ! overflow(pic_int(a), pc[1].u.i, &r)) { \
+	PUSH(pic_int_value(r));				\
+	pc += 3;					\
+	JUMP;						\
+      }							\
+      PUSH(a);						\
+      NEXT;						\
+    }
+
+    DEFINE_ARITHI_OP(OP_LREFADDI, ADD_OVERFLOW);
+    DEFINE_ARITHI_OP(OP_LREFSUBI, SUB_OVERFLOW);
+
+    /* the JMPIF is in the next slot */
+#define DEFINE_COMP_JMPIF_OP(opcode, op)	\
+    CASE(opcode) {				\
+      pic_value a, b;				\
+      bool r;					\
+      b = POP();				\
+      a = POP();				\
+      COMPARE(a, op, b, r);			\
+      pc += r ? 1 + pc[1].u.i : 2;		\
+      JUMP;					\
+    }
+
+    DEFINE_COMP_JMPIF_OP(OP_EQJMPIF, ==);
+    DEFINE_COMP_JMPIF_OP(OP_LTJMPIF, <);
+    DEFINE_COMP_JMPIF_OP(OP_LEJMPIF, <=);
+
     CASE(OP_STOP) {
       pic_value val;
 
     L_STOP:
       val = POP();
 
-      pic->jmp = prev_jmp;
       if (pic->errmsg) {
+	/* unwind the frames left by the failed call */
+	pic->sp = pic->stbase + sp;
+	pic->ci = pic->cibase + ci;
+	if (pic->jmp != &jmp) {
+	  PIC_LONGJMP(*pic->jmp, 1);
+	}
+	pic->jmp = prev_jmp;
 	return pic_undef_value();
       }
+      pic->jmp = prev_jmp;
 
 #if VM_DEBUG
       puts("**VM END STATE**");
@@ -815,3 +1143,69 @@ pic_apply(pic_state *pic, struct pic_proc *proc, pic_value argv)
     }
   } VM_LOOP_END;
 }
+
+static pic_value
+vm_apply_list(pic_state *pic, struct pic_proc *proc, pic_value args, bool rescue)
+{
+  pic_value *argv;
+  size_t argc, i;
+
+  if (! pic_list_p(pic, args)) {
+    pic_error(pic, "argv must be a proper list");
+  }
+  argc = pic_length(pic, args);
+
+  /* spread the list just above the slot of proc, where it is pushed in place */
+  vm_reserve(pic, argc + 1, NULL);
+  argv = pic->sp + 1;
+  for (i = 0; i < argc; ++i) {
+    argv[i] = pic_car(pic, args);
+    args = pic_cdr(pic, args);
+  }
+  return vm_apply(pic, proc, argc, argv, rescue);
+}
+
+pic_value
+pic_apply(pic_state *pic, struct pic_proc *proc, pic_value args)
+{
+  return vm_apply_list(pic, proc, args, true);
+}
+
+pic_value
+pic_apply_array(pic_state *pic, struct pic_proc *proc, size_t argc, pic_value *argv)
+{
+  return vm_apply(pic, proc, argc, argv, true);
+}
+
+pic_value
+pic_apply_argv(pic_state *pic, struct pic_proc *proc, size_t argc, ...)
+{
+  va_list ap;
+  pic_value *argv;
+  size_t i;
+
+  vm_reserve(pic, argc + 1, NULL);
+  argv = pic->sp + 1;
+
+  va_start(ap, argc);
+  for (i = 0; i < argc; ++i) {
+    argv[i] = va_arg(ap, pic_value);
+  }
+  va_end(ap);
+
+  return vm_apply(pic, proc, argc, argv, true);
+}
+
+/* no rescue frame of our own, so the C stack is not saved per callback */
+
+pic_value
+pic_apply_nocatch(pic_state *pic, struct pic_proc *proc, pic_value args)
+{
+  return vm_apply_list(pic, proc, args, false);
+}
+
+pic_value
+pic_apply_array_nocatch(pic_state *pic, struct pic_proc *proc, size_t argc, pic_value *argv)
+{
+  return vm_apply(pic, proc, argc, argv, false);
+}
@@ -0,0 +1,348 @@
+/**
+ * See Copyright Notice in picrin.h
+ */
+
+#include <stdint.h>
+
+#include "picrin.h"
+#include "picrin/weak.h"
+
+struct pic_ephemeron *
+pic_ephemeron_new(pic_state *pic, pic_value key, pic_value value)
+{
+  struct pic_ephemeron *e;
+
+  e = (struct pic_ephemeron *)pic_obj_alloc(pic, sizeof(struct pic_ephemeron), PIC_TT_EPHEMERON);
+  e->key = key;
+  e->value = value;
+  e->broken = false;
+  return e;
+}
+
+struct pic_ephemeron *
+pic_weak_new(pic_state *pic, pic_value key)
+{
+  return pic_ephemeron_new(pic, key, pic_false_value());
+}
+
+void
+pic_ephemeron_set(pic_state *pic, struct pic_ephemeron *e, pic_value value)
+{
+  if (e->broken)
+    return;
+  e->value = value;
+  pic_gc_write_barrier(pic, (struct pic_object *)e);
+}
+
+struct pic_wtable *
+pic_wtable_new(pic_state *pic)
+{
+  struct pic_wtable *tbl;
+
+  tbl = (struct pic_wtable *)pic_obj_alloc(pic, sizeof(struct pic_wtable), PIC_TT_WTABLE);
+  tbl->slots = NULL;
+  tbl->capa = tbl->count = 0;
+  return tbl;
+}
+
+/* objects never move, so heap keys hash by address */
+static size_t
+wtable_hash(pic_value key)
+{
+  switch (pic_vtype(key)) {
+  case PIC_VTYPE_HEAP:
+    return (size_t)((uintptr_t)pic_ptr(key) >> 4);
+  case PIC_VTYPE_INT:
+    return (size_t)pic_int(key);
+  case PIC_VTYPE_SYMBOL:
+    return (size_t)pic_sym(key);
+  case PIC_VTYPE_CHAR:
+    return (size_t)pic_char(key);
+  default:
+    return (size_t)pic_vtype(key);
+  }
+}
+
+/* the slot holding key, or the empty slot where it would go */
+static struct pic_ephemeron **
+wtable_lookup(struct pic_wtable *tbl, pic_value key)
+{
+  struct pic_ephemeron **slot;
+  size_t i;
+
+  for (i = wtable_hash(key) & (tbl->capa - 1); ; i = (i + 1) & (tbl->capa - 1)) {
+    slot = &tbl->slots[i];
+    if (*slot == NULL)
+      return slot;
+    if (! (*slot)->broken && pic_eq_p((*slot)->key, key))
+      return slot;
+  }
+}
+
+static void
+wtable_resize(pic_state *pic, struct pic_wtable *tbl)
+{
+  struct pic_ephemeron **slots = tbl->slots;
+  size_t capa = tbl->capa, live = 0, i;
+
+  for (i = 0; i < capa; ++i) {
+    if (slots[i] != NULL && ! slots[i]->broken) {
+      live++;
+    }
+  }
+
+  /* keep the load under a half after dropping the broken entries */
+  tbl->capa = 8;
+  while (tbl->capa < live * 4) {
+    tbl->capa *= 2;
+  }
+  tbl->slots = (struct pic_ephemeron **)pic_calloc(pic, tbl->capa, sizeof(struct pic_ephemeron *));
+  tbl->count = live;
+
+  for (i = 0; i < capa; ++i) {
+    if (slots[i] != NULL && ! slots[i]->broken) {
+      *wtable_lookup(tbl, slots[i]->key) = slots[i];
+    }
+  }
+  pic_free(pic, slots);
+}
+
+bool
+pic_wtable_has(pic_state *pic, struct pic_wtable *tbl, pic_value key)
+{
+  UNUSED(pic);
+
+  if (tbl->capa == 0)
+    return false;
+  return *wtable_lookup(tbl, key) != NULL;
+}
+
+pic_value
+pic_wtable_ref(pic_state *pic, struct pic_wtable *tbl, pic_value key)
+{
+  struct pic_ephemeron *e;
+
+  if (tbl->capa == 0 || (e = *wtable_lookup(tbl, key)) == NULL) {
+    pic_error(pic, "key not found in weak table");
+  }
+  return e->value;
+}
+
+void
+pic_wtable_set(pic_state *pic, struct pic_wtable *tbl, pic_value key, pic_value value)
+{
+  struct pic_ephemeron **slot, *e;
+  int ai;
+
+  if (tbl->capa != 0 && (e = *wtable_lookup(tbl, key)) != NULL) {
+    pic_ephemeron_set(pic, e, value);
+    return;
+  }
+
+  ai = pic_gc_arena_preserve(pic);
+  e = pic_ephemeron_new(pic, key, value);
+
+  if ((tbl->count + 1) * 4 > tbl->capa * 3) {
+    wtable_resize(pic, tbl);
+  }
+  slot = wtable_lookup(tbl, key);
+  *slot = e;
+  tbl->count++;
+  pic_gc_write_barrier(pic, (struct pic_object *)tbl);
+  pic_gc_arena_restore(pic, ai);
+}
+
+/* number of entries whose keys are still alive */
+size_t
+pic_wtable_size(pic_state *pic, struct pic_wtable *tbl)
+{
+  size_t n = 0, i;
+
+  UNUSED(pic);
+
+  for (i = 0; i < tbl->capa; ++i) {
+    if (tbl->slots[i] != NULL && ! tbl->slots[i]->broken) {
+      n++;
+    }
+  }
+  return n;
+}
+
+void
+pic_wtable_del(pic_state *pic, struct pic_wtable *tbl, pic_value key)
+{
+  struct pic_ephemeron *e;
+
+  if (tbl->capa == 0 || (e = *wtable_lookup(tbl, key)) == NULL)
+    return;
+
+  /* leave the slot behind as a tombstone for the probe sequence */
+  e->key = e->value = pic_false_value();
+  e->broken = true;
+  pic_gc_write_barrier(pic, (struct pic_object *)e);
+}
+
+static pic_value
+pic_weak_make_ephemeron(pic_state *pic)
+{
+  pic_value key, value;
+
+  pic_get_args(pic, "oo", &key, &value);
+
+  return pic_obj_value(pic_ephemeron_new(pic, key, value));
+}
+
+static pic_value
+pic_weak_ephemeron_p(pic_state *pic)
+{
+  pic_value v;
+
+  pic_get_args(pic, "o", &v);
+
+  return pic_bool_value(pic_ephemeron_p(v));
+}
+
+static struct pic_ephemeron *
+get_ephemeron(pic_state *pic, pic_value v)
+{
+  if (! pic_ephemeron_p(v)) {
+    pic_error(pic, "expected ephemeron");
+  }
+  return pic_ephemeron_ptr(v);
+}
+
+static pic_value
+pic_weak_ephemeron_key(pic_state *pic)
+{
+  pic_value v;
+
+  pic_get_args(pic, "o", &v);
+
+  return get_ephemeron(pic, v)->key;
+}
+
+static pic_value
+pic_weak_ephemeron_value(pic_state *pic)
+{
+  pic_value v;
+
+  pic_get_args(pic, "o", &v);
+
+  return get_ephemeron(pic, v)->value;
+}
+
+static pic_value
+pic_weak_ephemeron_broken_p(pic_state *pic)
+{
+  pic_value v;
+
+  pic_get_args(pic, "o", &v);
+
+  return pic_bool_value(get_ephemeron(pic, v)->broken);
+}
+
+static pic_value
+pic_weak_make_weak_table(pic_state *pic)
+{
+  pic_get_args(pic, "");
+
+  return pic_obj_value(pic_wtable_new(pic));
+}
+
+static pic_value
+pic_weak_weak_table_p(pic_state *pic)
+{
+  pic_value v;
+
+  pic_get_args(pic, "o", &v);
+
+  return pic_bool_value(pic_wtable_p(v));
+}
+
+static struct pic_wtable *
+get_wtable(pic_state *pic, pic_value v)
+{
+  if (! pic_wtable_p(v)) {
+    pic_error(pic, "expected weak table");
+  }
+  return pic_wtable_ptr(v);
+}
+
+static pic_value
+pic_weak_weak_table_ref(pic_state *pic)
+{
+  struct pic_wtable *tbl;
+  pic_value t, key, fallback;
+  int argc;
+
+  argc = pic_get_args(pic, "oo|o", &t, &key, &fallback);
+
+  tbl = get_wtable(pic, t);
+  if (argc > 2 && ! pic_wtable_has(pic, tbl, key)) {
+    return fallback;
+  }
+  return pic_wtable_ref(pic, tbl, key);
+}
+
+static pic_value
+pic_weak_weak_table_set(pic_state *pic)
+{
+  pic_value t, key, value;
+
+  pic_get_args(pic, "ooo", &t, &key, &value);
+
+  pic_wtable_set(pic, get_wtable(pic, t), key, value);
+
+  return pic_none_value();
+}
+
+static pic_value
+pic_weak_weak_table_contains_p(pic_state *pic)
+{
+  pic_value t, key;
+
+  pic_get_args(pic, "oo", &t, &key);
+
+  return pic_bool_value(pic_wtable_has(pic, get_wtable(pic, t), key));
+}
+
+static pic_value
+pic_weak_weak_table_delete(pic_state *pic)
+{
+  pic_value t, key;
+
+  pic_get_args(pic, "oo", &t, &key);
+
+  pic_wtable_del(pic, get_wtable(pic, t), key);
+
+  return pic_none_value();
+}
+
+static pic_value
+pic_weak_weak_table_size(pic_state *pic)
+{
+  pic_value t;
+
+  pic_get_args(pic, "o", &t);
+
+  return pic_int_value((int)pic_wtable_size(pic, get_wtable(pic, t)));
+}
+
+void
+pic_init_weak(pic_state *pic)
+{
+  pic_deflibrary ("(picrin weak)") {
+    pic_defun(pic, "make-ephemeron", pic_weak_make_ephemeron);
+    pic_defun(pic, "ephemeron?", pic_weak_ephemeron_p);
+    pic_defun(pic, "ephemeron-key", pic_weak_ephemeron_key);
+    pic_defun(pic, "ephemeron-value", pic_weak_ephemeron_value);
+    pic_defun(pic, "ephemeron-broken?", pic_weak_ephemeron_broken_p);
+    pic_defun(pic, "make-weak-table", pic_weak_make_weak_table);
+    pic_defun(pic, "weak-table?", pic_weak_weak_table_p);
+    pic_defun(pic, "weak-table-ref", pic_weak_weak_table_ref);
+    pic_defun(pic, "weak-table-set!", pic_weak_weak_table_set);
+    pic_defun(pic, "weak-table-contains?", pic_weak_weak_table_contains_p);
+    pic_defun(pic, "weak-table-delete!", pic_weak_weak_table_delete);
+    pic_defun(pic, "weak-table-size", pic_weak_weak_table_size);
+  }
+}
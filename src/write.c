@@ -148,6 +148,12 @@ write(pic_state *pic, pic_value obj)
   case PIC_TT_VAR:
     printf("#<var %p>", pic_ptr(obj));
     break;
+  case PIC_TT_EPHEMERON:
+    printf("#<ephemeron %p>", pic_ptr(obj));
+    break;
+  case PIC_TT_WTABLE:
+    printf("#<weak-table %p>", pic_ptr(obj));
+    break;
   case PIC_TT_IREP:
     printf("#<irep %p>", pic_ptr(obj));
     break;
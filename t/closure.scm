@@ -20,4 +20,71 @@
 
  ; must be 1
  (write (bar))
+ (newline)
+
+ (define (counter)
+   (let ((n 0))
+     (lambda ()
+       (set! n (+ n 1))
+       n)))
+ (define c (counter))
+ (c)
+
+ ; must be 2
+ (write (c))
+ (newline)
+
+ (define (shared)
+   (let ((x 1))
+     (let ((get (lambda () x))
+           (put (lambda (v) (set! x v))))
+       (put 5)
+       (get))))
+
+ ; must be 5
+ (write (shared))
+ (newline)
+
+ (define (assigned-before)
+   (let ((x 1))
+     (set! x (+ x 1))
+     (lambda () x)))
+
+ ; must be 2
+ (write ((assigned-before)))
+ (newline)
+
+ (define (assigned-after)
+   (let ((x 1))
+     (let ((f (lambda () x)))
+       (set! x 3)
+       (f))))
+
+ ; must be 3
+ (write (assigned-after))
+ (newline)
+
+ (define (mutual n)
+   (define (even? n) (if (= n 0) #t (odd? (- n 1))))
+   (define (odd? n) (if (= n 0) #f (even? (- n 1))))
+   (lambda () (even? n)))
+
+ ; must be #t
+ (write ((mutual 10)))
+ (newline)
+
+ (define (nested a)
+   (lambda (b)
+     (lambda (c)
+       (list a b c))))
+
+ ; must be (1 2 3)
+ (write (((nested 1) 2) 3))
+ (newline)
+
+ (define (rest . xs)
+   (lambda () xs))
+
+ ; must be (1 2)
+ (write ((rest 1 2)))
  (newline))
@@ -30,3 +30,19 @@
   (lambda ()
     (+ (raise-continuable "should be a number")
        23))))
+
+; stack overflow is an error object for the handler, every time
+(define (deep n)
+  (+ 1 (deep (+ n 1))))
+
+(define (catch-overflow)
+  (call/cc
+   (lambda (k)
+     (with-exception-handler
+      (lambda (e)
+        (k (error-object? e)))
+      (lambda ()
+        (deep 0))))))
+
+(print (catch-overflow))
+(print (catch-overflow))
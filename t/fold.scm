@@ -0,0 +1,27 @@
+(import (scheme base)
+        (scheme write))
+
+(define (print obj)
+  (write-simple obj)
+  (newline))
+
+(define side 0)
+
+(print (+ 1 2 3))
+(print (* 65536 65536))
+(print (/ 7 2))
+(print (- 5))
+(print (if (< 1 2) 'yes (begin (set! side 1) 'no)))
+(print side)
+
+(let ((x 3) (y 'a))
+  (print (if (eq? y 'a) (* x x) 'no)))
+
+(let ((x 3))
+  (set! x 4)
+  (print x))
+
+(define get
+  (let ((n 10))
+    (lambda () (+ n 1))))
+(print (get))
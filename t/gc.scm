@@ -0,0 +1,81 @@
+(import (scheme base)
+        (scheme write)
+        (picrin gc))
+
+(define (print obj)
+  (write-simple obj)
+  (newline))
+
+(define (stat name)
+  (cdr (assq name (gc-stats))))
+
+(print (map car (gc-stats)))
+(print (pair? (assq 'pair (stat 'objects))))
+
+(define collections (stat 'collections))
+(define allocated (stat 'allocated))
+
+(define (garbage n acc)
+  (if (= n 0)
+      (length acc)
+      (garbage (- n 1) (cons n acc))))
+
+(garbage 10000 '())
+(gc-run)
+(print (> (stat 'collections) collections))
+(print (> (stat 'allocated) allocated))
+(print (> (stat 'live) 0))
+(print (> (stat 'pages) 0))
+
+(define runs 0)
+(gc-set-hook! (lambda () (set! runs (+ runs 1))))
+(gc-run)
+(print (> runs 0))
+
+; collections triggered by allocation run the hook from the next native call
+(set! runs 0)
+(garbage 100000 '())
+(print (> runs 0))
+
+(gc-set-hook! #f)
+(set! runs 0)
+(gc-run)
+(print runs)
+
+; more children than the mark stack holds, with part of a bump allocation
+; buffer still unused when the collection starts
+(define wide (make-vector 1500000 #f))
+
+(define (fill-conses! v i)
+  (if (< i (vector-length v))
+      (begin
+        (vector-set! v i (cons i i))
+        (fill-conses! v (+ i 1)))))
+
+(fill-conses! wide 0)
+(call/cc (lambda (k) k))
+(gc-run)
+(print (car (vector-ref wide 1499999)))
+(set! wide #f)
+
+; overflow again, with more to trace under every object found by rescanning
+(define (make-lists n acc)
+  (if (= n 0)
+      acc
+      (make-lists (- n 1) (cons (list (- n 1) (vector (- n 1) (cons n '()))) acc))))
+
+(define (fill-from-list! v i xs)
+  (if (pair? xs)
+      (begin
+        (vector-set! v i (car xs))
+        (fill-from-list! v (+ i 1) (cdr xs)))))
+
+(define wide (make-vector 1100000 #f))
+(fill-from-list! wide 0 (make-lists 1100000 '()))
+(call/cc (lambda (k) k))
+(gc-run)
+(gc-run)
+(print (car (vector-ref wide 0)))
+(print (vector-ref (cadr (vector-ref wide 1099999)) 0))
+(print (car (vector-ref (cadr (vector-ref wide 1099999)) 1)))
+(set! wide #f)
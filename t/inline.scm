@@ -0,0 +1,81 @@
+(import (scheme base)
+        (scheme write))
+
+(define (print obj)
+  (write-simple obj)
+  (newline))
+
+(define (sum n)
+  (let loop ((i 0) (acc 0))
+    (if (= i n)
+        acc
+        (loop (+ i 1) (+ acc i)))))
+(print (sum 100))
+
+(define (squares n)
+  (do ((i 0 (+ i 1))
+       (acc '() (cons (* i i) acc)))
+      ((= i n) acc)))
+(print (squares 5))
+
+(define (let-in-loop n)
+  (let loop ((i 0) (acc 0))
+    (if (= i n)
+        acc
+        (let ((j (* i 2)) (k 1))
+          (loop (+ i 1) (+ acc j k))))))
+(print (let-in-loop 10))
+
+(define (counters)
+  (let ((n 0))
+    (lambda ()
+      (set! n (+ n 1))
+      n)))
+(define c1 (counters))
+(define c2 (counters))
+(c1)
+(c1)
+(print (list (c1) (c2)))
+
+(define (closures n)
+  (let loop ((i 0) (acc '()))
+    (if (= i n)
+        (map (lambda (f) (f)) acc)
+        (let ((j i))
+          (loop (+ i 1) (cons (lambda () j) acc))))))
+(print (closures 3))
+
+(define (helpers x)
+  (define (twice y)
+    (let ((z (* y 2)))
+      z))
+  (define (even-sum? a b)
+    (odd? (+ (twice a) (twice b) 1)))
+  (list (twice x) (twice (+ x 1)) (even-sum? x 3)))
+(print (helpers 5))
+
+(define (non-tail x)
+  (let ((y (let ((z (+ x 1))) (car (list z x)))))
+    (+ y 1)))
+(print (non-tail 1))
+
+(define (with-values x)
+  (let ((r (call-with-values (lambda () (values x (+ x 1))) list)))
+    (cons 'r r)))
+(print (with-values 1))
+
+(define (shadow x)
+  (let ((x (+ x 1)))
+    (let ((x (* x 2)))
+      x)))
+(print (shadow 3))
+
+(define (reassign x)
+  (define (bump) (set! x (+ x 1)) x)
+  (bump)
+  (bump))
+(print (reassign 10))
+
+(define (begin-arg x)
+  (list (begin (car x) 2) 3))
+(print (begin-arg '(1)))
@@ -0,0 +1,19 @@
+(import (scheme base)
+        (scheme write))
+
+(define (print obj)
+  (write-simple obj)
+  (newline))
+
+; read by the loaded file before it is assigned there
+(define base 10)
+
+(load "t/load/constants.scm")
+
+(print (constants))
+(print (long-list))
+(print (counter))
+(print (counter))
+(print base)
+(print (eq? (constants) (constants)))
+(print (eq? (car (constants)) (car (constants))))
@@ -0,0 +1,17 @@
+; loaded by t/load.scm; quoted data of every kind kept in compiled code
+
+(define (constants)
+  (list "string" 1.5 -0.25 #\a 'symbol '(1 (2 "three") . 4.0)
+        #(1 (2) "three" #(#t #f)) #() #u8(1 2 255) '#t '()))
+
+(define (long-list)
+  '(0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19
+    20 21 22 23 24 25 26 27 28 29 30 31 32 33 34 35 36 37 38 39))
+
+(define counter
+  (let ((n base))
+    (lambda ()
+      (set! n (+ n 1))
+      n)))
+
+(set! base (* base 2))
@@ -0,0 +1,29 @@
+(import (scheme base)
+        (scheme write))
+
+(define (print obj)
+  (write-simple obj)
+  (newline))
+
+(define (range n acc)
+  (if (= n 0)
+      acc
+      (range (- n 1) (cons (- n 1) acc))))
+
+(define xs (range 1000 '()))
+
+(define ys (map (lambda (x) (* x 2)) xs))
+(print (length ys))
+(print (car ys))
+(print (list-ref ys 999))
+
+(print (length (map (lambda (x y) (list x y)) xs ys)))
+
+(define sum 0)
+(for-each (lambda (x) (list x) (set! sum (+ sum x))) xs)
+(print sum)
+
+(define cells '())
+(for-each (lambda (x y) (set! cells (cons (cons x y) cells))) xs ys)
+(print (length cells))
+(print (car cells))
@@ -0,0 +1,41 @@
+(import (scheme base)
+        (scheme write))
+
+(define (split n)
+  (call-with-values (lambda () (floor/ n 3))
+    (lambda (q r)
+      (list q r))))
+
+(define (count k acc)
+  (if (zero? k)
+      acc
+      (call-with-values (lambda () (truncate/ k 2))
+        (lambda (q r)
+          (count (- k 1) (+ acc r))))))
+
+(write-simple (split 10))
+(newline)
+(write-simple (count 100000 0))
+(newline)
+(write-simple (call-with-values (lambda () (values)) list))
+(newline)
+(write-simple (+ 1 (values 2 3)))
+(newline)
+
+(define (void) #f)
+(define p (make-parameter 1))
+
+(write-simple (call-with-values (lambda () (dynamic-wind void (lambda () (values 1 2)) void)) list))
+(newline)
+(write-simple (call-with-values (lambda () (call/cc (lambda (k) (values 1 2)))) list))
+(newline)
+(write-simple (call-with-values (lambda () (call/cc (lambda (k) (k 1 2)))) list))
+(newline)
+(write-simple (call-with-values (lambda () (call/cc (lambda (k) (k)))) list))
+(newline)
+(write-simple (call-with-values (lambda () (with-exception-handler void (lambda () (values 1 2)))) list))
+(newline)
+(write-simple (call-with-values (lambda () (parameterize ((p 2)) (values (p) 3))) list))
+(newline)
+(write-simple (p))
+(newline)
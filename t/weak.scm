@@ -0,0 +1,47 @@
+(import (scheme base)
+        (scheme write)
+        (picrin gc)
+        (picrin weak))
+
+(define (print obj)
+  (write-simple obj)
+  (newline))
+
+; keys are built inside procedures so that no frame keeps them alive
+
+(define table (make-weak-table))
+(define key (list 'key))
+
+(weak-table-set! table key 'value)
+(gc-run)
+(print (weak-table-contains? table key))
+(print (weak-table-ref table key))
+(print (weak-table-size table))
+
+(define (add-garbage! n)
+  (if (> n 0)
+      (begin
+        (weak-table-set! table (list n) n)
+        (add-garbage! (- n 1)))))
+
+(add-garbage! 10)
+(print (weak-table-size table))
+(gc-run)
+(print (weak-table-size table))
+
+; a value that refers to its own key does not keep the entry alive
+(define (add-cycle!)
+  (let ((k (list 'cycle)))
+    (weak-table-set! table k (cons k 'value))))
+
+(add-cycle!)
+(print (weak-table-size table))
+(gc-run)
+(print (weak-table-size table))
+
+(define eph (make-ephemeron (list 'gone) 'value))
+(define kept (make-ephemeron key 'value))
+(gc-run)
+(print (ephemeron-broken? eph))
+(print (ephemeron-broken? kept))
+(print (ephemeron-value kept))